@@ -2,3 +2,4 @@
 
 from .clients import UnlabeledClient, LabeledClient
 from .servers import UnlabeledServer, LabeledServer
+from .coalescing import QueryCoalescer
@@ -1,19 +1,59 @@
 """(Un-)labeled APSI client implementations."""
 
-from typing import Dict, List
+import json
+from typing import Any, Dict, List, Optional
 
 from _pyapsi import APSIClient as _Client
 
+from .utils import _thread_budget
+
+# Load factors up to which the queried items reliably fit into APSI's cuckoo table,
+# which has no stash, by number of hash functions; with one, any collision fails
+_CUCKOO_LOAD_FACTORS = {2: 0.45, 3: 0.85}
+
+
+def max_query_items(params: Dict[str, Any]) -> int:
+    """The maximum number of items a query with the given parameters can hold.
+
+    A query places its items into a cuckoo table of `table_size` bins, which fills
+    up before all bins are taken: beyond a load factor that grows with the number
+    of hash functions, inserting another item fails more and more likely.
+
+    Args:
+        params: The APSI/SEAL parameters as parsed from their JSON representation
+    """
+    table_params = params["table_params"]
+    hash_func_count = table_params["hash_func_count"]
+    if hash_func_count < 2:
+        return 1
+    load_factor = _CUCKOO_LOAD_FACTORS.get(hash_func_count, 0.9)
+    return max(1, int(table_params["table_size"] * load_factor))
+
 
 class _BaseClient(_Client):
     queried_items: List[str]
+    oprf_items: List[str]
+
+    def __init__(self, params_json: str):
+        super().__init__(params_json)
+        self.max_query_items = max_query_items(json.loads(params_json))
 
     def oprf_request(self, items: List[str]) -> bytes:
         """Create an OPRF request for a given item.
 
         This is the first step when querying a server for items.
+
+        Raises:
+            ValueError: If there are more items than a query can hold, see
+                `max_query_items`.
         """
+        if len(items) > self.max_query_items:
+            raise ValueError(
+                f"A query holds at most {self.max_query_items} items but got "
+                f"{len(items)}"
+            )
         self.queried_items = items
+        self.oprf_items = items
         return self._oprf_request(items)
 
     def build_query(self, oprf_response: bytes) -> bytes:
@@ -37,25 +77,75 @@ class LabeledClient(_BaseClient):
         1. `oprf_request`
         2. `build_query`
         3. `extract_result`
+
+    Against a server with a membership database, a two-phase query skips the
+    labeled query when none of the items is present:
+        1. `oprf_request`
+        2. `build_query`, answered by the server's `handle_membership_query`
+        3. `extract_matches`
+        4. `build_labeled_query` for the matches, answered by `handle_query`
+        5. `extract_result`
+
+    A labeled query has the same size and server cost however many items it holds,
+    so this only saves cost for batches without any match. It also leaks more than
+    a single labeled query: whether the second query is sent tells the server if
+    any of the items matched.
     """
 
-    def __init__(self, params_json: str):
+    def __init__(
+        self, params_json: str, label_dictionary: Optional[List[bytes]] = None
+    ):
         """Initialize a client for labeled APSI.
 
         Args:
             params_json: The JSON string representation of APSI/SEAL parameters
+            label_dictionary: The server's `label_dictionary` if it stores its labels
+                as dictionary codes; `extract_result` then decodes them
         """
         super().__init__(params_json)
+        self.set_label_dictionary(label_dictionary)
+
+    def set_label_dictionary(self, label_dictionary: Optional[List[bytes]]) -> None:
+        """Decode labels with the server's `label_dictionary`, or not at all with None.
 
-    def extract_result(self, query_response: bytes) -> Dict[str, str]:
+        Servers add labels they have not seen before to their dictionary, so refresh it
+        when results contain codes the client does not know yet.
+        """
+        self.label_dictionary = (
+            None if label_dictionary is None else list(label_dictionary)
+        )
+        if self.label_dictionary is not None:
+            # Codes are big-endian, start at 1 and are just wide enough for all labels
+            bit_count = len(self.label_dictionary).bit_length()
+            self._code_byte_count = max(1, (bit_count + 7) // 8)
+
+    def _decode_label(self, label: bytes) -> bytes:
+        code = int.from_bytes(label[: self._code_byte_count], "big")
+        if not 0 < code <= len(self.label_dictionary):
+            raise ValueError(
+                f"Unknown label code {code}; the label dictionary may be out of date"
+            )
+        return self.label_dictionary[code - 1]
+
+    def extract_result(
+        self, query_response: bytes, thread_count: Optional[int] = None
+    ) -> Dict[str, str]:
         """Extract the resulting item, label pairs from the server's query response.
 
         This is the final step when querying for items.
 
+        Args:
+            query_response: The server's response to the query
+            thread_count: The number of workers decrypting the response; defaults
+                to the thread count of APSI's pool, see
+                `apsi.utils.set_thread_auto_tune`
+
         Returns:
             Found items as keys where corresponding labels are values.
         """
-        labels = self._extract_labeled_result_from_query_response(query_response)
+        labels = self._extract_labeled_result_from_query_response(
+            query_response, _thread_budget(thread_count)
+        )
         # Labels are retrieved from a fixed size memory and can thus contain other data
         # in case a specific label does not fill the full maximum label length.
         # Accordingly, everything after the first '\x00' is cut off. (item: label.split(b"\x00", 1)[0])
@@ -64,8 +154,52 @@ class LabeledClient(_BaseClient):
             for item, label in zip(self.queried_items, labels)
             if label
         }
+        if self.label_dictionary is not None:
+            found_items_with_labels = {
+                item: self._decode_label(label)
+                for item, label in found_items_with_labels.items()
+            }
         return found_items_with_labels
 
+    def extract_matches(
+        self, membership_response: bytes, thread_count: Optional[int] = None
+    ) -> List[str]:
+        """Extract the matched items from the server's membership query response.
+
+        This is the first phase of a two-phase query; follow up with
+        `build_labeled_query` for the returned items. `thread_count` is as for
+        `extract_result`.
+        """
+        matches = self._extract_unlabeled_result_from_query_response(
+            membership_response, _thread_budget(thread_count)
+        )
+        return [item for item, match in zip(self.queried_items, matches) if match]
+
+    def build_labeled_query(self, items: List[str]) -> bytes:
+        """Build a labeled query for a subset of the items of the last OPRF request.
+
+        The OPRF hashes of the previous round trip are reused, so no second OPRF
+        request is needed. This is the second phase of a two-phase query; sending it
+        reveals to the server that at least one item matched, see `LabeledClient`.
+
+        Raises:
+            RuntimeError: If `build_query` was not called before.
+            ValueError: If an item was not part of the last OPRF request.
+        """
+        if not getattr(self, "oprf_items", None):
+            raise RuntimeError("You need to create an OPRF request first.")
+
+        item_indices = {}
+        for idx, item in enumerate(self.oprf_items):
+            item_indices.setdefault(item, idx)
+        try:
+            indices = [item_indices[item] for item in items]
+        except KeyError as e:
+            raise ValueError(f"Item {e.args[0]!r} was not part of the OPRF request.")
+
+        self.queried_items = items
+        return self._build_subquery(indices)
+
     def get_prf_bytes_all(self) -> list[bytes]:
         """
         Returns the list of PRF (Pseudorandom Function) bytes derived from the client's query items.
@@ -81,6 +215,33 @@ class LabeledClient(_BaseClient):
         """
         return self._get_prf_bytes_all()
 
+    def unmask_uid_labels(
+        self, items: List[str], masked_labels: List[bytes], mask_mode: str = "repeat"
+    ) -> List[bytes]:
+        """Unmask labels from the `uid_xored_label_table` of a server.
+
+        Like `get_prf_bytes_all`, this needs the OPRF hashes from `build_query`.
+
+        Args:
+            items: Items of the last OPRF request, one for every masked label
+            masked_labels: The masked labels of the items' UIDs
+            mask_mode: The server's `uid_mask_mode`
+
+        Returns:
+            The labels, in the order of `items`.
+
+        Raises:
+            ValueError: If an item was not part of the last OPRF request.
+        """
+        item_indices = {}
+        for idx, item in enumerate(getattr(self, "oprf_items", [])):
+            item_indices.setdefault(item, idx)
+        try:
+            indices = [item_indices[item] for item in items]
+        except KeyError as e:
+            raise ValueError(f"Item {e.args[0]!r} was not part of the OPRF request.")
+        return self._unmask_uid_labels(indices, masked_labels, mask_mode)
+
 
 class UnlabeledClient(_BaseClient):
     """A client for unlabeled asynchronous private set intersection (APSI).
@@ -99,10 +260,20 @@ class UnlabeledClient(_BaseClient):
         """
         super().__init__(params_json)
 
-    def extract_result(self, query_response: bytes) -> List[str]:
+    def extract_result(
+        self, query_response: bytes, thread_count: Optional[int] = None
+    ) -> List[str]:
         """Extract the matched items from the server's query response.
 
         This is the final step when querying for items.
+
+        Args:
+            query_response: The server's response to the query
+            thread_count: The number of workers decrypting the response; defaults
+                to the thread count of APSI's pool, see
+                `apsi.utils.set_thread_auto_tune`
         """
-        matches = super()._extract_unlabeled_result_from_query_response(query_response)
+        matches = super()._extract_unlabeled_result_from_query_response(
+            query_response, _thread_budget(thread_count)
+        )
         return [item for item, match in zip(self.queried_items, matches) if match]
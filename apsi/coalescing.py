@@ -0,0 +1,148 @@
+"""Client-side coalescing of independent single-item lookups into shared queries."""
+
+import threading
+import time
+from concurrent.futures import Future
+from typing import Any, Dict, List, Optional, Tuple, Union
+
+from .clients import LabeledClient, UnlabeledClient
+
+
+class QueryCoalescer:
+    """Buffer independent lookups and send them to the server as one APSI query.
+
+    Every APSI query carries a fixed cost: one OPRF round trip plus a full-size
+    encrypted query, no matter whether it asks for one item or for hundreds. The
+    coalescer collects lookups for up to `max_delay` seconds or `max_items` items,
+    whichever comes first, runs one query for the whole batch and resolves each
+    caller's future with its own result.
+
+    For a `LabeledClient` a lookup resolves to the item's label or `None` if the item
+    was not found; for an `UnlabeledClient` it resolves to `True` or `False`.
+
+    The server can be any object providing `handle_oprf_request` and `handle_query`,
+    e.g. an in-process `LabeledServer` or a stub forwarding the bytes over the
+    network.
+    """
+
+    def __init__(
+        self,
+        client: Union[LabeledClient, UnlabeledClient],
+        server: Any,
+        max_delay: float = 0.005,
+        max_items: int = 100,
+    ):
+        """Initialize a coalescer and start its background flush thread.
+
+        Args:
+            client: The client used for all coalesced queries; it must not be used
+                concurrently by anyone else
+            server: Object providing `handle_oprf_request` and `handle_query`
+            max_delay: Maximum time in seconds a lookup waits for others to join
+            max_items: Maximum number of distinct items per query; must fit into the
+                cuckoo table of the client's parameters
+        """
+        if max_delay < 0:
+            raise ValueError(f"max_delay needs to be non-negative but is {max_delay}")
+        if max_items < 1:
+            raise ValueError(
+                f"max_items needs to be a positive integer but is {max_items}"
+            )
+
+        self._client = client
+        self._server = server
+        self._max_delay = max_delay
+        self._max_items = max_items
+
+        self._cond = threading.Condition()
+        # Items in the order of their first lookup, with its time and all their futures
+        self._pending: Dict[str, Tuple[float, List[Future]]] = {}
+        self._closed = False
+
+        self._thread = threading.Thread(target=self._run, daemon=True)
+        self._thread.start()
+
+    def lookup(self, item: str) -> Future:
+        """Schedule a lookup of a single item and return a future for its result."""
+        future: Future = Future()
+        with self._cond:
+            if self._closed:
+                raise RuntimeError("The coalescer has already been closed.")
+            self._pending.setdefault(item, (time.monotonic(), []))[1].append(future)
+            self._cond.notify()
+        return future
+
+    def close(self) -> None:
+        """Flush all pending lookups and stop the background thread."""
+        with self._cond:
+            self._closed = True
+            self._cond.notify()
+        self._thread.join()
+
+    def __enter__(self) -> "QueryCoalescer":
+        """Use the coalescer as a context manager that closes it on exit."""
+        return self
+
+    def __exit__(self, *exc_info) -> None:
+        """Flush pending lookups and stop the background thread."""
+        self.close()
+
+    def _next_batch(self) -> Optional[List[Tuple[str, List[Future]]]]:
+        with self._cond:
+            while True:
+                if self._pending:
+                    if self._closed or len(self._pending) >= self._max_items:
+                        break
+                    oldest = next(iter(self._pending.values()))[0]
+                    remaining = oldest + self._max_delay - time.monotonic()
+                    if remaining <= 0:
+                        break
+                    self._cond.wait(remaining)
+                elif self._closed:
+                    return None
+                else:
+                    self._cond.wait()
+
+            batch = []
+            for item in list(self._pending)[: self._max_items]:
+                batch.append((item, self._pending.pop(item)[1]))
+            return batch
+
+    def _run(self) -> None:
+        while True:
+            batch = self._next_batch()
+            if batch is None:
+                return
+
+            # Cancelled lookups are left out; the others can no longer be cancelled
+            running_batch = []
+            for item, futures in batch:
+                running = [f for f in futures if f.set_running_or_notify_cancel()]
+                if running:
+                    running_batch.append((item, running))
+            batch = running_batch
+            if not batch:
+                continue
+
+            items = [item for item, _ in batch]
+            try:
+                oprf_request = self._client.oprf_request(items)
+                oprf_response = self._server.handle_oprf_request(oprf_request)
+                query = self._client.build_query(oprf_response)
+                response = self._server.handle_query(query)
+                result = self._client.extract_result(response)
+            except Exception as e:
+                for _, futures in batch:
+                    for future in futures:
+                        future.set_exception(e)
+                continue
+
+            if isinstance(result, dict):
+                values = [result.get(item) for item in items]
+            else:
+                matches = set(result)
+                values = [item in matches for item in items]
+
+            for (_, futures), value in zip(batch, values):
+                for future in futures:
+                    future.set_result(value)
@@ -0,0 +1,220 @@
+"""Serving a sharded database from several worker processes.
+
+Every worker process loads one shard of a database (see `apsi.sharding`) and serves
+it on a local Unix socket. A coordinator takes the place of the server towards the
+client: it forwards a query once to every worker, which answer it against their shard
+in parallel, and combines their result parts into one response that `LabeledClient`
+and `UnlabeledClient` decode as usual:
+
+    python -m apsi.coordinator shard-0.db /run/apsi/shard-0.sock &
+    python -m apsi.coordinator shard-1.db /run/apsi/shard-1.sock &
+
+    coordinator = ShardCoordinator(["/run/apsi/shard-0.sock", "/run/apsi/shard-1.sock"])
+    oprf_response = coordinator.handle_oprf_request(oprf_request)
+    query_response = coordinator.handle_query(query)
+
+Frames are a fixed size header followed by the payload. They are sent with a single
+scatter/gather `sendmsg`, without first joining header and payload, and received with
+`recv_into` into buffers of the payload's size. The payloads are still copied as they
+pass into and out of the native server, and the result parts once more when the
+coordinator joins them into the response.
+"""
+
+import argparse
+import socket
+import socketserver
+import struct
+import threading
+from typing import List, Optional, Sequence, Tuple
+
+from .servers import LabeledServer, _BaseServer
+
+# op, params index, key version, payload size
+_REQUEST = struct.Struct("!BIIQ")
+# status, package count, payload size
+_RESPONSE = struct.Struct("!BIQ")
+
+_OP_OPRF = 1
+_OP_QUERY = 2
+
+_STATUS_OK = 0
+_STATUS_ERROR = 1
+
+# Sent instead of a key version to use the worker's current OPRF key
+_CURRENT_KEY_VERSION = 0xFFFFFFFF
+
+
+def _send_frame(sock: socket.socket, header: bytes, payload: bytes) -> None:
+    buffers = [memoryview(header), memoryview(payload)]
+    while buffers:
+        sent = sock.sendmsg(buffers)
+        while buffers and sent >= len(buffers[0]):
+            sent -= len(buffers[0])
+            buffers.pop(0)
+        if buffers:
+            buffers[0] = buffers[0][sent:]
+
+
+def _recv_exact(sock: socket.socket, size: int) -> bytearray:
+    buffer = bytearray(size)
+    view = memoryview(buffer)
+    while view:
+        received = sock.recv_into(view)
+        if not received:
+            raise ConnectionError("Connection closed by peer")
+        view = view[received:]
+    return buffer
+
+
+class _ShardRequestHandler(socketserver.BaseRequestHandler):
+    def handle(self) -> None:
+        server: _BaseServer = self.server.apsi_server
+        while True:
+            try:
+                header = _recv_exact(self.request, _REQUEST.size)
+            except ConnectionError:
+                return
+            op, params_index, key_version, size = _REQUEST.unpack(header)
+            payload = bytes(_recv_exact(self.request, size))
+            if key_version == _CURRENT_KEY_VERSION:
+                key_version = None
+
+            try:
+                if op == _OP_OPRF:
+                    count, data = 0, server.handle_oprf_request(payload, key_version)
+                elif op == _OP_QUERY:
+                    count, data = server.handle_query_parts(
+                        payload, params_index, key_version
+                    )
+                else:
+                    raise ValueError(f"Unknown operation: {op}")
+                status = _STATUS_OK
+            except Exception as e:
+                status, count, data = _STATUS_ERROR, 0, str(e).encode()
+
+            _send_frame(self.request, _RESPONSE.pack(status, count, len(data)), data)
+
+
+class ShardWorker(socketserver.ThreadingUnixStreamServer):
+    """Serves one shard of a database to a `ShardCoordinator` on a Unix socket."""
+
+    daemon_threads = True
+
+    def __init__(self, server: _BaseServer, socket_path: str):
+        self.apsi_server = server
+        super().__init__(socket_path, _ShardRequestHandler)
+
+
+def serve_shard(db_file_path: str, socket_path: str) -> None:
+    """Load a shard from a file and serve it until the process is terminated."""
+    # The kind of database follows the file; serving is the same for both servers
+    server = LabeledServer()
+    server.load_db(db_file_path)
+    with ShardWorker(server, socket_path) as worker:
+        worker.serve_forever()
+
+
+class ShardCoordinator:
+    """Answers queries against a database from the workers serving its shards.
+
+    The coordinator holds one connection to every worker. Queries are forwarded to
+    all workers at once and answered one after the other; run several coordinators
+    to answer several queries at the same time.
+
+    Args:
+        socket_paths: The sockets of the workers, one for every shard
+        timeout: Timeout in seconds for connecting to and waiting for a worker
+    """
+
+    def __init__(self, socket_paths: Sequence[str], timeout: Optional[float] = None):
+        if not socket_paths:
+            raise ValueError("At least one worker is required")
+        self._lock = threading.Lock()
+        self._sockets: List[socket.socket] = []
+        try:
+            for path in socket_paths:
+                sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                self._sockets.append(sock)
+                sock.settimeout(timeout)
+                sock.connect(path)
+        except OSError:
+            self.close()
+            raise
+
+    def close(self) -> None:
+        for sock in self._sockets:
+            sock.close()
+        self._sockets = []
+
+    def __enter__(self) -> "ShardCoordinator":
+        return self
+
+    def __exit__(self, *exc) -> None:
+        self.close()
+
+    def _request(
+        self,
+        sockets: List[socket.socket],
+        op: int,
+        payload: bytes,
+        params_index: int,
+        key_version: Optional[int],
+    ) -> List[Tuple[int, bytearray]]:
+        if not self._sockets:
+            raise RuntimeError("Coordinator is closed")
+        if key_version is None:
+            key_version = _CURRENT_KEY_VERSION
+        header = _REQUEST.pack(op, params_index, key_version, len(payload))
+
+        with self._lock:
+            for sock in sockets:
+                _send_frame(sock, header, payload)
+
+            # Every response is read, even after an error, to keep the connections in
+            # step with the workers
+            results, errors = [], []
+            for sock in sockets:
+                status, count, size = _RESPONSE.unpack(
+                    _recv_exact(sock, _RESPONSE.size)
+                )
+                data = _recv_exact(sock, size)
+                if status == _STATUS_OK:
+                    results.append((count, data))
+                else:
+                    errors.append(data.decode())
+
+        if errors:
+            raise RuntimeError(f"Shard worker failed: {errors[0]}")
+        return results
+
+    def handle_oprf_request(
+        self, oprf_request: bytes, key_version: Optional[int] = None
+    ) -> bytes:
+        """Handle an OPRF request; all shards share the OPRF key so one worker does."""
+        [(_, response)] = self._request(
+            self._sockets[:1], _OP_OPRF, oprf_request, 0, key_version
+        )
+        return bytes(response)
+
+    def handle_query(
+        self, query: bytes, params_index: int = 0, key_version: Optional[int] = None
+    ) -> bytes:
+        """Handle a query against all shards, see `LabeledServer.handle_query`."""
+        return _BaseServer.query_response(
+            self._request(self._sockets, _OP_QUERY, query, params_index, key_version)
+        )
+
+
+def main(argv: Optional[List[str]] = None) -> None:
+    """Serve a shard from the command line."""
+    parser = argparse.ArgumentParser(
+        prog="python -m apsi.coordinator", description="Serve a database shard."
+    )
+    parser.add_argument("db", help="path of the shard")
+    parser.add_argument("socket", help="path of the Unix socket to serve on")
+    args = parser.parse_args(argv)
+    serve_shard(args.db, args.socket)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,181 @@
+"""Routing of client queries to the cheapest of several parameter sets."""
+
+import json
+import math
+from typing import List, Optional, Union
+
+from .clients import LabeledClient, UnlabeledClient, max_query_items
+
+
+class QueryPlanner:
+    """Pick the parameter set that minimizes the cost of a query of a given size.
+
+    A query has to fit into the cuckoo table of its parameters, so parameter sets
+    whose `max_query_items` is below the number of queried items are not eligible.
+    APSI always encrypts and answers the whole cuckoo table, so among the remaining
+    ones the cost of a query does not depend on its number of items.
+
+    The cost is the server's work per query, counted in ciphertext operations and
+    weighted by their cost under the SEAL parameters. Per bundle index, the server
+    computes the powers of the query that `query_powers` and `ps_low_degree` leave
+    out, and then evaluates a matching polynomial and one per label part for every
+    bin bundle. The number of bin bundles grows with the database, so the planner
+    needs the database size and label length for its estimate.
+    """
+
+    def __init__(
+        self,
+        params_jsons: List[str],
+        db_item_count: int = 0,
+        label_byte_count: int = 0,
+    ):
+        """Initialize a planner for the given parameter sets.
+
+        Args:
+            params_jsons: JSON string representations of APSI/SEAL parameters in the
+                order of their params index on the server
+            db_item_count: The number of items of the server's database
+            label_byte_count: The label length of the server's database; 0 for
+                unlabeled databases
+        """
+        if not params_jsons:
+            raise ValueError("At least one parameter set is required.")
+        self._params = [json.loads(params_json) for params_json in params_jsons]
+        self._db_item_count = db_item_count
+        self._label_byte_count = label_byte_count
+
+    def capacity(self, params_index: int) -> int:
+        """The maximum number of items a query with the given parameters can hold."""
+        return max_query_items(self._params[params_index])
+
+    def estimate_cost(self, params_index: int) -> float:
+        """Estimate the relative server cost of a query with the given parameters."""
+        params = self._params[params_index]
+        table_params = params["table_params"]
+        query_params = params["query_params"]
+        seal_params = params["seal_params"]
+
+        poly_modulus_degree = seal_params["poly_modulus_degree"]
+        coeff_modulus_count = len(seal_params["coeff_modulus_bits"])
+        felts_per_item = params["item_params"]["felts_per_item"]
+        table_size = table_params["table_size"]
+        max_items_per_bin = table_params["max_items_per_bin"]
+        ps_low_degree = query_params.get("ps_low_degree", 0)
+
+        items_per_bundle = poly_modulus_degree // felts_per_item
+        bundle_idx_count = math.ceil(table_size / items_per_bundle)
+
+        # Every item takes one slot per hash function; bins hold max_items_per_bin
+        bin_bundle_count = max(
+            1,
+            math.ceil(
+                self._db_item_count
+                * table_params["hash_func_count"]
+                / (table_size * max_items_per_bin)
+            ),
+        )
+
+        # Labels are split into parts of the bits a query item has
+        if "plain_modulus_bits" in seal_params:
+            bits_per_felt = seal_params["plain_modulus_bits"] - 1
+        else:
+            bits_per_felt = seal_params["plain_modulus"].bit_length() - 1
+        label_part_count = math.ceil(
+            self._label_byte_count * 8 / (felts_per_item * bits_per_felt)
+        )
+        poly_count = 1 + label_part_count
+
+        # With Paterson-Stockmeyer, the server needs the low powers and the powers of
+        # ps_low_degree + 1, and multiplies the low-degree parts ciphertext by
+        # ciphertext; without it, it needs all powers up to max_items_per_bin
+        if ps_low_degree > 1:
+            power_count = ps_low_degree + max_items_per_bin // (ps_low_degree + 1)
+            ct_products_per_poly = max_items_per_bin // (ps_low_degree + 1)
+        else:
+            power_count = max_items_per_bin
+            ct_products_per_poly = 0
+        computed_power_count = max(power_count - len(query_params["query_powers"]), 0)
+
+        # Relinearizing a product is quadratic in the number of coefficient moduli
+        plain_product_cost = poly_modulus_degree * coeff_modulus_count
+        ct_product_cost = plain_product_cost * coeff_modulus_count
+
+        bin_bundle_cost = poly_count * (
+            max_items_per_bin * plain_product_cost
+            + ct_products_per_poly * ct_product_cost
+        )
+        return float(
+            bundle_idx_count
+            * (
+                computed_power_count * ct_product_cost
+                + bin_bundle_count * bin_bundle_cost
+            )
+        )
+
+    def select(self, item_count: int) -> int:
+        """Return the params index of the cheapest parameter set for `item_count` items.
+
+        Raises:
+            ValueError: If no parameter set can hold that many items.
+        """
+        eligible = [
+            idx for idx in range(len(self._params)) if self.capacity(idx) >= item_count
+        ]
+        if not eligible:
+            raise ValueError(f"No parameter set can hold a query of {item_count} items")
+        return min(eligible, key=self.estimate_cost)
+
+
+class MultiParamsClient:
+    """A client that routes each query to the cheapest parameter set of a server.
+
+    The server needs to hold its data under all of the given parameter sets, in the
+    same order, see `add_params`. Pass `params_index` along with the query to the
+    server's `handle_query`:
+
+        oprf_request = client.oprf_request(items)
+        oprf_response = server.handle_oprf_request(oprf_request)
+        query = client.build_query(oprf_response)
+        response = server.handle_query(query, client.params_index)
+        result = client.extract_result(response)
+    """
+
+    params_index: int = 0
+
+    def __init__(
+        self,
+        params_jsons: List[str],
+        labeled: bool = True,
+        planner: Optional[QueryPlanner] = None,
+    ):
+        """Initialize a client for several parameter sets.
+
+        Args:
+            params_jsons: JSON string representations of APSI/SEAL parameters in the
+                order of their params index on the server
+            labeled: Whether the server holds labeled data
+            planner: Planner choosing the parameter set per query; defaults to a
+                `QueryPlanner` for `params_jsons`
+        """
+        client_class = LabeledClient if labeled else UnlabeledClient
+        self._clients = [client_class(params_json) for params_json in params_jsons]
+        self.planner = planner or QueryPlanner(params_jsons)
+
+    @property
+    def _client(self) -> Union[LabeledClient, UnlabeledClient]:
+        return self._clients[self.params_index]
+
+    def oprf_request(self, items: List[str]) -> bytes:
+        """Select the parameter set for the query and create its OPRF request."""
+        self.params_index = self.planner.select(len(items))
+        return self._client.oprf_request(items)
+
+    def build_query(self, oprf_response: bytes) -> bytes:
+        """Build a query for the selected parameter set."""
+        return self._client.build_query(oprf_response)
+
+    def extract_result(
+        self, query_response: bytes, thread_count: Optional[int] = None
+    ):
+        """Extract the result of the query from the server's response."""
+        return self._client.extract_result(query_response, thread_count)
@@ -1,10 +1,35 @@
 """(Un-)labeled APSI server implementations."""
 
-from typing import Iterable, List, Tuple
+from concurrent.futures import Future
+from typing import Dict, Iterable, List, Optional, Tuple, Union
+import glob
+import threading
 from pathlib import Path
 
 from _pyapsi import APSIServer as _Server
 
+from .utils import _thread_budget
+
+
+def _expand_paths(paths: Union[str, Iterable[str]]) -> List[str]:
+    """Expand a path, a glob pattern or a list of paths into the list of files."""
+    if isinstance(paths, (str, Path)):
+        path = str(paths)
+        if glob.has_magic(path):
+            expanded = sorted(glob.glob(path))
+            if not expanded:
+                raise FileNotFoundError(f"No DB files match: {path}")
+            return expanded
+        paths = [path]
+
+    paths = [str(p) for p in paths]
+    if not paths:
+        raise ValueError("No DB files given.")
+    for p in paths:
+        if not Path(p).exists():
+            raise FileNotFoundError(f"DB file does not exist: {p}")
+    return paths
+
 
 class _BaseServer(_Server):
     db_initialized: bool = False
@@ -14,7 +39,11 @@ class _BaseServer(_Server):
             raise RuntimeError("Please initialize or load a database first.")
 
     def save_db(self, db_file_path: str) -> None:
-        """Save the database in unencrypted binary representation at the given path."""
+        """Save the database in unencrypted binary representation at the given path.
+
+        Queries are answered as usual while the database is written; changes to it
+        wait until it is saved.
+        """
         self._requires_db()
 
         p = Path(db_file_path)
@@ -23,6 +52,55 @@ class _BaseServer(_Server):
 
         self._save_db(db_file_path)
 
+    def save_db_async(
+        self, db_file_path: str, max_bytes_per_second: Optional[int] = None
+    ) -> "Future[None]":
+        """Save the database like `save_db`, but in the background.
+
+        The database as of this call is written on a thread with low CPU and I/O
+        priority, at no more than `max_bytes_per_second` if given. Queries are answered
+        as usual meanwhile; changes to the database wait until it is saved. The future
+        is only done once the file and its directory entry are synced to disk.
+
+        Returns:
+            A future that is done once the database is saved, and holds the error if
+            saving failed; use its `add_done_callback` to be notified.
+
+        Raises:
+            RuntimeError: If another snapshot is being written, by a save or by a
+                compaction; only one is written at a time.
+        """
+        self._requires_db()
+
+        p = Path(db_file_path)
+        if not p.parent.exists():
+            raise FileNotFoundError(f"Save directory does not exist: {p.parent}")
+        if max_bytes_per_second is not None and max_bytes_per_second < 1:
+            raise ValueError(
+                "max_bytes_per_second needs to be a positive integer but is "
+                f"{max_bytes_per_second}"
+            )
+
+        self._start_save(db_file_path, max_bytes_per_second or 0)
+        future: "Future[None]" = Future()
+        future.set_running_or_notify_cancel()
+
+        def wait():
+            try:
+                self._wait_for_save()
+            except Exception as e:
+                future.set_exception(e)
+            else:
+                future.set_result(None)
+
+        threading.Thread(target=wait, daemon=True).start()
+        return future
+
+    @property
+    def saving(self) -> bool:
+        """Whether a save started with `save_db_async` is running."""
+        return self._is_saving()
+
     def load_db(self, db_file_path: str) -> None:
         """Load a previously saved binary database representation into memory."""
         p = Path(db_file_path)
@@ -32,44 +110,550 @@ class _BaseServer(_Server):
         self._load_db(db_file_path)
         self.db_initialized = True
 
-    def load_csv_db(self,csv_db_file_path:str, params_json:str,
+    def load_csv_db(
+        self,
+        csv_db_file_path: Union[str, Iterable[str]],
+        params_json: str,
         nonce_byte_count: int = 16,
-        compressed: bool = False
+        compressed: bool = False,
+        membership_db: bool = False,
+        retain_items: bool = False,
+        oprf_key: Optional[bytes] = None,
+        shard_index: int = 0,
+        shard_count: int = 1,
+        dictionary_labels: bool = False,
+        max_label_length: Optional[int] = None,
     ) -> None:
-        """Load a database from csv file."""
-        p = Path(csv_db_file_path)
-        if not p.exists():
-            raise FileNotFoundError(f"DB file does not exist: {p}")
-        self._load_csv_db(csv_db_file_path, params_json, nonce_byte_count, compressed)
+        """Load a database from csv file.
+
+        Partitioned exports can be loaded into a single database at once by passing a
+        list of files or a glob pattern like `"export/part-*.csv"`. The files are
+        parsed concurrently, one reader per file, and all need to be either labeled or
+        unlabeled.
+
+        With `membership_db`, a labeled CSV additionally gets an unlabeled membership
+        database for two-phase queries; see `handle_membership_query`. With
+        `retain_items`, the raw items and labels are kept next to the database; see
+        `add_params`.
+
+        To build a large database in several processes or on several hosts, each one
+        loads only the items of its shard with `shard_index` and `shard_count`, all with
+        the same `oprf_key` and parameters, see `apsi.sharding`.
+
+        With `dictionary_labels`, labels are stored as integer codes into a dictionary
+        of all distinct labels, just wide enough to tell them apart. For labels from a
+        small domain, this shrinks the database, the query cost and the responses in
+        proportion to the label width. Clients decode the labels with the server's
+        `label_dictionary`. Shards of the same input share the dictionary if every
+        shard is built from the complete input.
+
+        Labels are stored as wide as the longest one, or `max_label_length` bytes if
+        given; longer labels then fail the load. Shards can only be served together
+        if they agree on the width, so builders that only see part of the input need
+        to pass the same `max_label_length`.
+        """
+        if not 0 <= shard_index < shard_count:
+            raise ValueError(
+                f"shard_index needs to be in [0, {shard_count}) but is {shard_index}"
+            )
+        csv_db_file_paths = _expand_paths(csv_db_file_path)
+        self._load_csv_db(
+            csv_db_file_paths,
+            params_json,
+            nonce_byte_count,
+            compressed,
+            membership_db,
+            retain_items,
+            oprf_key or b"",
+            shard_index,
+            shard_count,
+            dictionary_labels,
+            max_label_length or 0,
+        )
         self.db_initialized = True
 
+    def load_db_shards(self, db_file_paths: List[str]) -> None:
+        """Load databases built as shards of the same data and serve them together.
+
+        Queries are answered by all shards at once in a single response. Sharded
+        databases cannot be updated; see `apsi.sharding` for building and merging them.
+        """
+        paths = _expand_paths(db_file_paths)
+        self._load_db_shards(paths)
+        self.db_initialized = True
+
+    @property
+    def shard_count(self) -> int:
+        """The number of shards the database is served from."""
+        return self._get_shard_count()
+
+    def export_oprf_key(self) -> bytes:
+        """Export the OPRF key of the database.
+
+        The key is the server's secret; only share it with processes building shards
+        or replicas of this database.
+        """
+        self._requires_db()
+        return self._export_oprf_key()
+
     def load_csv_uid_db(self, csv_db_file_path: str, params_json: str,
                         nonce_byte_count: int = 16,
-                        compressed: bool = False
+                        compressed: bool = False,
+                        retain_items: bool = False,
+                        mask_mode: str = "repeat"
     ) -> None:
-        """Load a database from csv with item→UID remapping and masked labels."""
+        """Load a database from csv with item→UID remapping and masked labels.
+
+        The database maps items to UIDs; the labels are kept in `uid_xored_label_table`,
+        masked with the OPRF hashes of their items. With `mask_mode="repeat"` the hash
+        is repeated over the label; `"aes_ctr"` expands it into an AES-CTR keystream
+        instead, which does not reuse key material for long labels and runs on AES-NI
+        where available. Clients unmask with `unmask_uid_labels` in the same mode.
+        """
         p = Path(csv_db_file_path)
         if not p.exists():
             raise FileNotFoundError(f"DB file does not exist: {p}")
-        self._load_csv_uid_db(csv_db_file_path, params_json, nonce_byte_count, compressed)
+        self._load_csv_uid_db(
+            csv_db_file_path,
+            params_json,
+            nonce_byte_count,
+            compressed,
+            retain_items,
+            mask_mode,
+        )
         self.db_initialized = True
 
-    def handle_oprf_request(self, oprf_request: bytes) -> bytes:
+    @property
+    def uid_mask_mode(self) -> str:
+        """How the labels of `uid_xored_label_table` are masked.
+
+        The mode is saved with the database, so a server restored with `load_db`
+        masks appended rows and remasks on key rotations the same way.
+        """
+        return self._get_uid_mask_mode()
+
+    def get_uid_xored_label_table(
+        self, key_version: Optional[int] = None
+    ) -> List[Tuple[List[int], List[int]]]:
+        """The rows of `uid_xored_label_table` masked for an OPRF key version.
+
+        After `finish_key_rotation`, `uid_xored_label_table` is masked for the new key.
+        Clients whose OPRF request was handled with `retired_oprf_key_version` need the
+        table masked for that key, which is kept until `retire_oprf_key`.
+
+        Args:
+            key_version: The OPRF key version the OPRF request was handled with;
+                defaults to `oprf_key_version`
+        """
+        self._requires_db()
+        return self._get_key_version_uid_table(self._resolve_key_version(key_version))
+
+    @property
+    def has_item_store(self) -> bool:
+        """Whether the raw items and labels are retained next to the database."""
+        return self._has_item_store()
+
+    @property
+    def label_dictionary(self) -> Optional[List[bytes]]:
+        """The labels whose codes the database stores, see `dictionary_labels`.
+
+        The label with code `c` is at index `c - 1`. Pass the dictionary to
+        `LabeledClient` to decode results. Labels added later are appended, so clients
+        need the updated dictionary only for results with the new labels. None if the
+        database stores its labels as they are.
+        """
+        return self._get_label_dictionary()
+
+    @property
+    def params_count(self) -> int:
+        """The number of parameter sets the database is encoded under."""
+        return self._get_params_count()
+
+    def reparameterize(self, params_json: str) -> None:
+        """Encode the database under other APSI/SEAL parameters, replacing the current.
+
+        The new encoding is built from the retained items, so neither the source files
+        nor a full reload are needed, and the primary and membership databases are
+        built in parallel. The OPRF key stays the same, so clients only need to switch
+        to the new parameters. Encodings added with `add_params` are kept as they are.
+
+        Raises:
+            RuntimeError: If the server does not retain its items, see `retain_items`.
+        """
+        self._requires_db()
+        self._reparameterize(params_json)
+
+    def add_params(self, params_json: str) -> int:
+        """Additionally encode the database under other APSI/SEAL parameters.
+
+        Parameters suited for few-item queries perform poorly for large queries and
+        vice versa. All encodings share the OPRF key, so clients do a single OPRF round
+        trip and then query the encoding that is cheapest for their query size, see
+        `apsi.planning.QueryPlanner`.
+
+        Encoding a non-empty database requires the server to retain its items, see
+        `retain_items` when initializing or loading it.
+
+        Returns:
+            The params index to pass to `handle_query` for this encoding.
+        """
+        self._requires_db()
+        return self._add_params(params_json)
+
+    def remove_items(self, items: List[str]) -> None:
+        """Remove items and their labels from the database, ignoring unknown items."""
+        self._requires_db()
+        self._remove_items(items)
+
+    def remove_item(self, item: str) -> None:
+        """Remove a single item and its label from the database."""
+        self.remove_items([item])
+
+    def set_write_buffer_size(self, max_items: int) -> None:
+        """Keep up to `max_items` newly inserted items in a separate write buffer.
+
+        Queries run without holding the GIL, so they can be answered from other threads
+        while items are added. Inserts of new items go to a small buffer that is
+        encoded again and swapped in for every update that changes it, and so do not
+        wait for running queries. Once the buffer is full, its items are moved into the
+        database. Changes to items already in the database and removals are applied to
+        it directly, in place, so running queries may or may not see them.
+
+        A query keeps the buffer it started with. If the buffer is moved into the
+        database while the query runs, an item can be found in both, possibly with
+        different labels; clients of this package then return the buffer's label, the
+        one the item had when the query started.
+
+        Args:
+            max_items: The capacity of the buffer; 0 turns it off
+        """
+        self._requires_db()
+        self._set_write_buffer_size(max_items)
+
+    @property
+    def write_buffer_size(self) -> int:
+        """The capacity of the write buffer, 0 if it is off."""
+        return self._get_write_buffer_size()
+
+    @property
+    def buffered_item_count(self) -> int:
+        """The number of items currently held in the write buffer."""
+        return self._get_buffered_item_count()
+
+    def flush_write_buffer(self) -> None:
+        """Move the items of the write buffer into the database."""
+        self._flush_write_buffer()
+
+    def open_update_log(self, log_file_path: str, sync_every: int = 64) -> None:
+        """Append all following updates of the database to a log file.
+
+        Updates become durable without saving the whole database: after a crash,
+        `recover_db` restores the state from the last snapshot and the log. The log is
+        synced to disk every `sync_every` records; call `sync_update_log` to make all
+        updates so far durable, e.g. before acknowledging them.
+        """
+        self._requires_db()
+        if sync_every < 1:
+            raise ValueError(
+                f"sync_every needs to be a positive integer but is {sync_every}"
+            )
+        p = Path(log_file_path)
+        if not p.parent.exists():
+            raise FileNotFoundError(f"Log directory does not exist: {p.parent}")
+        self._open_update_log(log_file_path, sync_every)
+
+    def sync_update_log(self) -> None:
+        """Flush all logged updates to disk."""
+        self._sync_update_log()
+
+    def close_update_log(self) -> None:
+        """Sync and close the update log; following updates are not logged anymore."""
+        self._close_update_log()
+
+    def replay_update_log(self, log_file_path: str) -> int:
+        """Apply the updates of a log file to the database.
+
+        Replay stops at the first incomplete or corrupted record, as left behind by a
+        crash in the middle of a write. That record is cut off the file, so that
+        updates logged to it afterwards are replayed as well.
+
+        Returns:
+            The number of replayed updates.
+        """
+        self._requires_db()
+        p = Path(log_file_path)
+        if not p.exists():
+            raise FileNotFoundError(f"Log file does not exist: {p}")
+        return self._replay_update_log(log_file_path)
+
+    def compact(self, snapshot_path: str) -> None:
+        """Fold the update log into a new snapshot of the database in the background.
+
+        The log continues in a fresh file right away and queries are served as usual
+        meanwhile; updates wait until the snapshot is written, so that it matches the
+        previous log, which is kept as `<log>.compacting` until then. Use
+        `wait_for_compaction` to wait for it.
+        """
+        self._requires_db()
+        p = Path(snapshot_path)
+        if not p.parent.exists():
+            raise FileNotFoundError(f"Save directory does not exist: {p.parent}")
+        self._start_compaction(snapshot_path)
+
+    @property
+    def compacting(self) -> bool:
+        """Whether a compaction started by `compact` is still running."""
+        return self._is_compacting()
+
+    def wait_for_compaction(self) -> None:
+        """Wait for a running compaction and raise its error if it failed."""
+        self._wait_for_compaction()
+
+    def recover_db(self, snapshot_path: str, log_file_path: str) -> int:
+        """Restore the database from its last snapshot and update log after a crash.
+
+        Loads the snapshot and replays the logs of an interrupted compaction, if any,
+        and of `log_file_path` on top of it. Incomplete records at the end of the logs
+        are cut off, so `log_file_path` can be opened again with `open_update_log`.
+
+        Returns:
+            The number of replayed updates.
+        """
+        self.load_db(snapshot_path)
+        count = 0
+        for log_path in (Path(log_file_path + ".compacting"), Path(log_file_path)):
+            if log_path.exists():
+                count += self._replay_update_log(str(log_path))
+        return count
+
+    @property
+    def db_version(self) -> int:
+        """The version of the database; it increases with every batch of updates."""
+        return self._get_db_version()
+
+    def start_change_tracking(self) -> None:
+        """Track all following changes so that they can be exported with `export_delta`.
+
+        Changes are tracked in memory and per item, so the journal never holds more
+        entries than there are distinct changed items. Tracking ends when the database
+        is initialized or loaded again.
+        """
+        self._requires_db()
+        self._start_change_tracking()
+
+    @property
+    def tracking_changes(self) -> bool:
+        """Whether changes are tracked for `export_delta`."""
+        return self._is_tracking_changes()
+
+    def export_delta(self, from_version: int) -> bytes:
+        """Export the changes since `from_version` for replicas of this database.
+
+        The delta holds the latest state of every item changed after `from_version`
+        and brings a replica at `from_version` or newer up to the current `db_version`
+        with `apply_delta`. This is usually far smaller than a copy of the whole
+        database.
+
+        Raises:
+            RuntimeError: If changes are not tracked, see `start_change_tracking`.
+            IndexError: If `from_version` is older than the tracked changes.
+        """
+        self._requires_db()
+        return self._export_delta(from_version)
+
+    def apply_delta(self, delta: bytes) -> bool:
+        """Apply a delta exported by the server this database is a replica of.
+
+        The delta is applied in place and, if open, written to the update log.
+        Afterwards `db_version` equals the version the delta was exported at.
+
+        Returns:
+            False if the database already is at least as new as the delta.
+        """
+        self._requires_db()
+        return self._apply_delta(delta)
+
+    def discard_changes(self, up_to_version: int) -> None:
+        """Forget tracked changes up to `up_to_version`, e.g. once replicas have it."""
+        self._discard_changes(up_to_version)
+
+    @property
+    def oprf_key_version(self) -> int:
+        """The version of the OPRF key new queries are answered with."""
+        return self._get_key_version()
+
+    @property
+    def retired_oprf_key_version(self) -> Optional[int]:
+        """The previous OPRF key version that is still served after a rotation."""
+        version = self._get_retired_key_version()
+        return None if version < 0 else version
+
+    def _resolve_key_version(self, key_version: Optional[int]) -> int:
+        return self.oprf_key_version if key_version is None else key_version
+
+    def rotate_oprf_key(self, wait: bool = False) -> None:
+        """Start encoding the database under a new OPRF key in the background.
+
+        The server keeps answering requests with the current key, and updates made in
+        the meantime also reach the new encoding. Once the rebuild is done,
+        `finish_key_rotation` switches over. The rebuild starts from the retained
+        items, so it requires `retain_items`, and it temporarily needs memory for a
+        second copy of the database.
+
+        Args:
+            wait: Wait for the rebuild and switch to the new key right away
+        """
+        self._requires_db()
+        self._start_key_rotation()
+        if wait:
+            self.finish_key_rotation()
+
+    @property
+    def rotating_oprf_key(self) -> bool:
+        """Whether a key rotation was started and not finished yet."""
+        return self._is_rotating_key()
+
+    @property
+    def key_rotation_ready(self) -> bool:
+        """Whether `finish_key_rotation` can switch over without waiting."""
+        return self._is_key_rotation_ready()
+
+    def finish_key_rotation(self) -> None:
+        """Switch to the new OPRF key, waiting for its rebuild if necessary.
+
+        Requests keep being answered with the current key while this waits; once the
+        rebuild is done, new requests are answered with the new key. The previous key
+        stays available as `retired_oprf_key_version` for queries whose OPRF step used
+        it, until `retire_oprf_key` is called. In UID mode, `uid_xored_label_table` is
+        masked for the new key; `get_uid_xored_label_table` returns the table for the
+        previous one.
+        """
+        self._finish_key_rotation()
+
+    def retire_oprf_key(self) -> None:
+        """Stop answering requests for the previous OPRF key after a rotation.
+
+        In UID mode, this also drops the UID table masked for the previous key.
+        """
+        self._retire_key()
+
+    @property
+    def packing_rate(self) -> float:
+        """The share of the capacity of the database's bin bundles holding items."""
+        return self._get_packing_rate()
+
+    @property
+    def bundle_stats(self) -> List[Dict[str, Union[int, float]]]:
+        """Packing statistics of the database for every bundle index.
+
+        Each entry holds `bundle_idx`, the number of bin bundles at the index
+        (`bundle_count`), the fewest bin bundles that could hold its items
+        (`min_bundle_count`), the number of item entries (`entry_count`) and their
+        share of the capacity of the bin bundles (`fill_rate`). Query cost grows with
+        the number of bin bundles, so a `bundle_count` well above `min_bundle_count`
+        after many removals means that `repack` pays off.
+        """
+        self._requires_db()
+        return self._get_bundle_stats()
+
+    def repack(self, wait: bool = False) -> None:
+        """Start encoding the database again in the background to restore its packing.
+
+        The server keeps answering requests from the current encoding, and updates made
+        in the meantime also reach the new one. Once the rebuild is done,
+        `finish_repack` swaps it in. The rebuild starts from the retained items, so it
+        requires `retain_items`, and it temporarily needs memory for a second copy of
+        the database.
+
+        Args:
+            wait: Wait for the rebuild and swap it in right away
+        """
+        self._requires_db()
+        self._start_repack()
+        if wait:
+            self.finish_repack()
+
+    @property
+    def repacking(self) -> bool:
+        """Whether a repack was started and not finished yet."""
+        return self._is_repacking()
+
+    @property
+    def repack_ready(self) -> bool:
+        """Whether `finish_repack` can swap in the new encoding without waiting."""
+        return self._is_repack_ready()
+
+    def finish_repack(self) -> None:
+        """Swap in the repacked database, waiting for its rebuild if necessary.
+
+        Requests keep being answered from the current encoding while this waits.
+        """
+        self._finish_repack()
+
+    def handle_oprf_request(
+        self,
+        oprf_request: bytes,
+        key_version: Optional[int] = None,
+        thread_count: Optional[int] = None,
+    ) -> bytes:
         """Handle an initial APSI Client OPRF request.
 
         The returned bytes response can be used by the client to create the main query.
+
+        Args:
+            oprf_request: The OPRF request created by the client
+            key_version: The OPRF key version to use; defaults to `oprf_key_version`.
+                Around key rotations, pass the same version to `handle_query`.
+            thread_count: The number of workers for this call; defaults to the
+                thread count of APSI's pool, see `apsi.utils.set_thread_auto_tune`
         """
         self._requires_db()
-        return self._handle_oprf_request(oprf_request)
-
-    def handle_query(self, query: bytes) -> bytes:
+        return self._handle_oprf_request(
+            oprf_request,
+            self._resolve_key_version(key_version),
+            _thread_budget(thread_count),
+        )
+
+    def handle_query(
+        self, query: bytes, params_index: int = 0, key_version: Optional[int] = None
+    ) -> bytes:
         """Handle an APSI Client query.
 
         This step follows after an initial OPRF request and returns the encrypted query
         response in an APSI Client compatible byte string.
+
+        Args:
+            query: The query built by the client
+            params_index: The parameter set the query was built for; 0 refers to the
+                parameters the database was initialized with, see `add_params`
+            key_version: The OPRF key version the OPRF request was handled with;
+                defaults to `oprf_key_version`
+        """
+        self._requires_db()
+        return self._handle_query(
+            query, params_index, self._resolve_key_version(key_version)
+        )
+
+    def handle_query_parts(
+        self, query: bytes, params_index: int = 0, key_version: Optional[int] = None
+    ) -> Tuple[int, bytes]:
+        """Handle an APSI Client query without wrapping the result in a response.
+
+        Returns the number of result parts and their serialization. The parts of
+        servers holding different shards of a database are combined into one response
+        with `query_response`.
         """
         self._requires_db()
-        return self._handle_query(query)
+        return self._handle_query_parts(
+            query, params_index, self._resolve_key_version(key_version)
+        )
+
+    @staticmethod
+    def query_response(parts: Iterable[Tuple[int, bytes]]) -> bytes:
+        """Combine the result of `handle_query_parts` calls into one query response."""
+        parts = list(parts)
+        header = _Server._query_response_header(sum(count for count, _ in parts))
+        return b"".join([header, *(data for _, data in parts)])
 
 
 class LabeledServer(_BaseServer):
@@ -95,6 +679,9 @@ class LabeledServer(_BaseServer):
         max_label_length: int,
         nonce_byte_count: int = 16,
         compressed: bool = False,
+        membership_db: bool = False,
+        retain_items: bool = False,
+        oprf_key: Optional[bytes] = None,
     ) -> None:
         """Initialize an empty database with the specified configuration.
 
@@ -105,10 +692,50 @@ class LabeledServer(_BaseServer):
                 https://github.com/microsoft/apsi#label-encryption
             compressed: Reduces memory footprint of database but increases computational
                 demand
+            membership_db: Additionally keep an unlabeled membership database of all
+                items to answer the cheap first phase of two-phase queries
+            retain_items: Keep the raw items and labels next to the database so that it
+                can be encoded again, e.g. with `add_params`
+            oprf_key: Use this OPRF key instead of a random one, see `export_oprf_key`
         """
-        self._init_db(params_json, max_label_length, nonce_byte_count, compressed)
+        self._init_db(
+            params_json, max_label_length, nonce_byte_count, compressed, oprf_key or b""
+        )
+        if membership_db:
+            self._init_membership_db()
+        if retain_items:
+            self._init_item_store()
         self.db_initialized = True
 
+    @property
+    def has_membership_db(self) -> bool:
+        """Whether the server can answer membership queries."""
+        return self._has_membership_db()
+
+    def handle_membership_query(
+        self, query: bytes, key_version: Optional[int] = None
+    ) -> bytes:
+        """Handle the membership phase of a two-phase APSI Client query.
+
+        The query is answered against the unlabeled membership database, so the
+        response only tells which items are present. Clients then use
+        `LabeledClient.build_labeled_query` to retrieve the labels of the matches.
+
+        Args:
+            query: The query built by the client
+            key_version: The OPRF key version the OPRF request was handled with;
+                defaults to `oprf_key_version`
+
+        Raises:
+            RuntimeError: If the server has no membership database.
+        """
+        self._requires_db()
+        if not self.has_membership_db:
+            raise RuntimeError("The server has no membership database.")
+        return self._handle_membership_query(
+            query, self._resolve_key_version(key_version)
+        )
+
     def add_item(self, item: str, label: str) -> None:
         """Add an item with a label to the server.
 
@@ -117,7 +744,7 @@ class LabeledServer(_BaseServer):
         label.
         """
         self._requires_db()
-        if len(label) > self.max_label_length:
+        if not self._has_label_dictionary() and len(label) > self.max_label_length:
             raise ValueError(
                 f"Label {label} exceeds maximum length {self.max_label_length}"
             )
@@ -131,6 +758,9 @@ class LabeledServer(_BaseServer):
         value is the label.
         """
         self._requires_db()
+        if self._has_label_dictionary():
+            self._add_labeled_items(items_with_label)
+            return
         for item, label in items_with_label:
             if len(label) > self.max_label_length:
                 raise ValueError(
@@ -138,6 +768,24 @@ class LabeledServer(_BaseServer):
                 )
         self._add_labeled_items(items_with_label)
 
+    def append_uid_items(self, items_with_label: Iterable[Tuple[str, str]]) -> None:
+        """Add items with labels to a database loaded with `load_csv_uid_db`.
+
+        Every item gets the next UID and its masked label is appended to
+        `uid_xored_label_table`; only the new items are hashed and masked. Once the
+        UIDs need another byte, the database is rebuilt from its item store, so this
+        requires `retain_items=True` for databases that grow past such a boundary.
+
+        The new rows of `uid_xored_label_table` and a widening rebuild can neither be
+        replayed from an update log nor exported as a delta, so this raises while an
+        update log is open or change tracking is on. Append before either is started
+        and persist the appends with `save_db` and `uid_xored_label_table` instead.
+        Appends also raise while a key rotation or a repack is running, since these
+        replace `uid_xored_label_table` with the copy they started from.
+        """
+        self._requires_db()
+        self._append_uid_items(items_with_label)
+
 
 class UnlabeledServer(_BaseServer):
     """A server for unlabeled asynchronous private set intersection (APSI).
@@ -150,15 +798,26 @@ class UnlabeledServer(_BaseServer):
         """Initialize an unlabled APSI server."""
         super().__init__()
 
-    def init_db(self, params_json: str, compressed: bool = False) -> None:
+    def init_db(
+        self,
+        params_json: str,
+        compressed: bool = False,
+        retain_items: bool = False,
+        oprf_key: Optional[bytes] = None,
+    ) -> None:
         """Initialize an empty database with the specified configuration.
 
         Args:
             params_json: The JSON string representation of APSI/SEAL parameters
             compressed: Reduces memory footprint of database but increases computational
                 demand
+            retain_items: Keep the raw items next to the database so that it can be
+                encoded again, e.g. with `add_params`
+            oprf_key: Use this OPRF key instead of a random one, see `export_oprf_key`
         """
-        self._init_db(params_json, 0, 0, compressed)
+        self._init_db(params_json, 0, 0, compressed, oprf_key or b"")
+        if retain_items:
+            self._init_item_store()
         self.db_initialized = True
 
     def add_item(self, item: str) -> None:
@@ -0,0 +1,141 @@
+"""Distributed offline builds of large databases from independently built shards.
+
+A database too large to build on one machine in time is split into shards by item
+hash. Every shard is built in its own process or on its own host from the full input,
+or from any part of it, with the same parameters and OPRF key:
+
+    key = new_oprf_key(params_json)
+    build_shard("export/part-*.csv", params_json, key, i, n, f"shard-{i}.db")
+
+The shard files are then either merged into one database file that a server loads
+with `load_db`, or listed in a manifest and served with `load_db_shards`. Either way a
+query is answered by all shards in a single response. From the command line:
+
+    python -m apsi.sharding merge apsi.db shard-*.db
+"""
+
+import argparse
+import json
+from pathlib import Path
+from typing import Iterable, List, Optional, Union
+
+from _pyapsi import APSIServer as _Server
+
+from .servers import LabeledServer, UnlabeledServer
+
+
+def new_oprf_key(params_json: str) -> bytes:
+    """Create a random OPRF key to share between the builders of all shards."""
+    server = UnlabeledServer()
+    server.init_db(params_json)
+    return server.export_oprf_key()
+
+
+def build_shard(
+    csv_db_file_path: Union[str, Iterable[str]],
+    params_json: str,
+    oprf_key: bytes,
+    shard_index: int,
+    shard_count: int,
+    output_path: str,
+    nonce_byte_count: int = 16,
+    compressed: bool = False,
+    retain_items: bool = False,
+    dictionary_labels: bool = False,
+    max_label_length: Optional[int] = None,
+) -> None:
+    """Build one shard of a database and save it to `output_path`.
+
+    Only the items of the CSV files that belong to the shard are loaded, so every
+    builder can be given the complete input.
+
+    Args:
+        csv_db_file_path: CSV files of the database, see `load_csv_db`
+        params_json: The JSON string representation of APSI/SEAL parameters
+        oprf_key: The OPRF key shared by all shards, see `new_oprf_key`
+        shard_index: The shard to build, in `[0, shard_count)`
+        shard_count: The number of shards the database is split into
+        output_path: Where to save the shard
+        nonce_byte_count: The nonce size in bytes for labeled data
+        compressed: Reduces memory footprint of database but increases computational
+            demand
+        retain_items: Keep the raw items next to the shard; a merged database then has
+            an item store only if every shard was built with one
+        dictionary_labels: Store labels as dictionary codes, see `load_csv_db`; all
+            shards then need to be built from the complete input
+        max_label_length: The label width in bytes shared by all shards; defaults to
+            the longest label of the input, which only agrees between shards if all
+            of them are built from the complete input
+    """
+    # The kind of database follows the CSV data; loading is the same for both servers
+    server = LabeledServer()
+    server.load_csv_db(
+        csv_db_file_path,
+        params_json,
+        nonce_byte_count=nonce_byte_count,
+        compressed=compressed,
+        retain_items=retain_items,
+        oprf_key=oprf_key,
+        shard_index=shard_index,
+        shard_count=shard_count,
+        dictionary_labels=dictionary_labels,
+        max_label_length=max_label_length,
+    )
+    server.save_db(output_path)
+
+
+def merge_shards(shard_paths: List[str], output_path: str) -> None:
+    """Merge shard files into one database file serving all of them.
+
+    The shards are validated to share parameters, OPRF key and label width. Their
+    encoded data is taken over as it is, so merging costs about as much as loading
+    and saving them.
+    """
+    for p in shard_paths:
+        if not Path(p).exists():
+            raise FileNotFoundError(f"Shard file does not exist: {p}")
+    _Server._merge_db_shard_files([str(p) for p in shard_paths], output_path)
+
+
+def write_manifest(manifest_path: str, shard_paths: List[str]) -> None:
+    """Write a manifest listing shard files, relative to the manifest if possible."""
+    base = Path(manifest_path).parent.resolve()
+    shards = []
+    for p in shard_paths:
+        path = Path(p).resolve()
+        try:
+            shards.append(str(path.relative_to(base)))
+        except ValueError:
+            shards.append(str(path))
+    Path(manifest_path).write_text(json.dumps({"shards": shards}, indent=2))
+
+
+def read_manifest(manifest_path: str) -> List[str]:
+    """Read the shard files listed in a manifest, e.g. to pass to `load_db_shards`."""
+    base = Path(manifest_path).parent
+    manifest = json.loads(Path(manifest_path).read_text())
+    return [str(base / p) for p in manifest["shards"]]
+
+
+def main(argv: Optional[List[str]] = None) -> None:
+    """Merge shard files or write a manifest for them from the command line."""
+    parser = argparse.ArgumentParser(
+        prog="python -m apsi.sharding", description=__doc__.splitlines()[0]
+    )
+    subparsers = parser.add_subparsers(dest="command", required=True)
+    merge_parser = subparsers.add_parser("merge", help="merge shards into one file")
+    merge_parser.add_argument("output", help="path of the merged database")
+    merge_parser.add_argument("shards", nargs="+", help="shard files")
+    manifest_parser = subparsers.add_parser("manifest", help="list shards in a file")
+    manifest_parser.add_argument("output", help="path of the manifest")
+    manifest_parser.add_argument("shards", nargs="+", help="shard files")
+
+    args = parser.parse_args(argv)
+    if args.command == "merge":
+        merge_shards(args.shards, args.output)
+    else:
+        write_manifest(args.output, args.shards)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,8 +1,22 @@
 """Utility functions for multi threading and logging."""
 
+import time
+from contextlib import contextmanager
+from typing import Any, Dict, Iterator, List, Optional, Union
+
 from _pyapsi.utils import (
     _set_thread_count,
     _get_thread_count,
+    _set_thread_auto_tune,
+    _is_thread_auto_tune,
+    _get_thread_tuning,
+    _get_op_stats,
+    _reset_op_stats,
+    _get_process_cpu_seconds,
+    _get_memory_usage,
+    _set_memory_tracking,
+    _get_build_stage_stats,
+    _clear_build_stage_stats,
     _set_log_level,
     _set_console_log_disabled,
     _set_log_file,
@@ -30,6 +44,179 @@ def get_thread_count() -> int:
     return _get_thread_count()
 
 
+def _thread_budget(thread_count: Optional[int]) -> int:
+    """Validate the thread count of a single call; 0 stands for no budget."""
+    if thread_count is None:
+        return 0
+    if not isinstance(thread_count, int) or thread_count < 1:
+        raise ValueError(
+            f"The thread_count needs to be a positive integer but is {thread_count}"
+        )
+    return thread_count
+
+
+def set_thread_auto_tune(
+    enabled: bool = True, max_thread_count: Optional[int] = None
+) -> None:
+    """Turn auto-tuning of the thread count per kind of work on or off.
+
+    The best thread count differs between OPRF requests and result extraction, the
+    calls taking a `thread_count` of their own. While auto-tuning is on, such calls
+    without one try 1, 2, 4, ... workers up to `max_thread_count` for a few calls
+    each, and each kind of work settles on the last count that was still at least
+    10% faster per item or result part than the one before, see
+    `get_thread_tuning`. Turning it on again starts the tuning over, e.g. after the
+    workload changed.
+
+    A thread count never resizes APSI's thread pool, which the whole process
+    shares; it caps the tasks a call splits its work into, so calls run side by
+    side, and counts above `get_thread_count` gain nothing. Queries and database
+    builds are parallelized by APSI itself and always use the whole pool.
+
+    Args:
+        enabled: Whether to auto-tune
+        max_thread_count: The highest thread count to try; defaults to the number
+            of hardware threads
+    """
+    max_thread_count = _thread_budget(max_thread_count)
+    _set_thread_auto_tune(enabled, max_thread_count)
+
+
+def is_thread_auto_tune() -> bool:
+    """Whether the thread count is auto-tuned, see `set_thread_auto_tune`."""
+    return _is_thread_auto_tune()
+
+
+def get_thread_tuning() -> Dict[str, Dict[str, Union[int, bool]]]:
+    """Get the state of auto-tuning for every kind of work.
+
+    The kinds are those of `get_op_stats`. For each, "thread_count" is the chosen
+    thread count once "tuned" is true, and the one being tried before. Only "oprf"
+    and "decrypt" are ever tuned.
+    """
+    return _get_thread_tuning()
+
+
+def get_op_stats() -> Dict[str, Dict[str, Union[int, float]]]:
+    """Get live counters for every kind of work done by clients and servers.
+
+    The kinds are "oprf", "query", "db_build" (loading and updating databases) and
+    "decrypt" (extracting results). For each, "waiting" and "running" are the calls
+    in progress, waiting for a lock or running right now, and "calls",
+    "wait_seconds" and "run_seconds" are summed over finished calls since the last
+    `reset_op_stats`.
+    """
+    return _get_op_stats()
+
+
+def reset_op_stats() -> None:
+    """Reset the call counts and times of `get_op_stats`."""
+    _reset_op_stats()
+
+
+class ThreadPoolSampler:
+    """Measures how busy APSI's threads were between consecutive samples.
+
+    APSI's thread pool does not expose its queue, so how busy it is follows from
+    the CPU time of the process: `busy_threads` is the CPU time used per second of
+    wall time, and `utilization` relates it to the thread count. The CPU time of
+    all threads is included, so this is an upper bound if the process does other
+    work. Utilization well below 1 while calls are waiting points to contention;
+    close to 1 with growing run times points to a saturated pool.
+
+        sampler = ThreadPoolSampler()
+        ...
+        sample = sampler.sample()
+    """
+
+    def __init__(self):
+        self._last = self._now()
+
+    @staticmethod
+    def _now() -> Dict[str, Any]:
+        return {
+            "wall": time.monotonic(),
+            "cpu": _get_process_cpu_seconds(),
+            "ops": _get_op_stats(),
+        }
+
+    def sample(self) -> Dict[str, Any]:
+        """Take a sample covering the time since the previous one.
+
+        Returns:
+            "thread_count", "busy_threads" and "utilization" as described above, and
+            under "ops" for every kind of work the calls in progress ("waiting",
+            "running") and for the calls finished since the last sample their number
+            ("calls") and mean "wait_seconds" and "run_seconds".
+        """
+        now, last = self._now(), self._last
+        self._last = now
+
+        wall = max(now["wall"] - last["wall"], 1e-9)
+        busy_threads = (now["cpu"] - last["cpu"]) / wall
+        thread_count = _get_thread_count()
+
+        ops = {}
+        for name, op in now["ops"].items():
+            previous = last["ops"][name]
+            # A reset in between restarts the counters
+            if op["calls"] < previous["calls"]:
+                previous = {"calls": 0, "wait_seconds": 0.0, "run_seconds": 0.0}
+            calls = op["calls"] - previous["calls"]
+            ops[name] = {
+                "waiting": op["waiting"],
+                "running": op["running"],
+                "calls": calls,
+                "wait_seconds": (op["wait_seconds"] - previous["wait_seconds"])
+                / max(calls, 1),
+                "run_seconds": (op["run_seconds"] - previous["run_seconds"])
+                / max(calls, 1),
+            }
+
+        return {
+            "thread_count": thread_count,
+            "busy_threads": busy_threads,
+            "utilization": busy_threads / thread_count,
+            "ops": ops,
+        }
+
+
+def get_memory_usage() -> Dict[str, int]:
+    """Get the memory usage of the process.
+
+    Returns "rss_bytes" and "peak_rss_bytes" (Linux only), "heap_bytes" allocated
+    and not freed yet (glibc 2.33 or newer only) and "seal_pool_bytes" held by SEAL's
+    memory pool; figures that are not available are 0.
+    """
+    return _get_memory_usage()
+
+
+@contextmanager
+def track_build_memory() -> Iterator[List[Dict[str, Any]]]:
+    """Record the memory of every stage of the database builds in this context.
+
+    Database loads from CSV files are split into stages such as "parse" and
+    "encode". Each stage is logged at INFO level and appended to the yielded list
+    once the context exits, with its "stage" name, the number of "items" it held,
+    its duration in "seconds", and its memory usage "before" and "after" as in
+    `get_memory_usage`. The "peak_rss_bytes" after a stage is the peak of that
+    stage, as the peak RSS of the process is reset at the start of every stage.
+
+        with track_build_memory() as stages:
+            server.load_csv_db("db.csv", params)
+        peak = max(stage["after"]["peak_rss_bytes"] for stage in stages)
+    """
+    stages: List[Dict[str, Any]] = []
+    _clear_build_stage_stats()
+    _set_memory_tracking(True)
+    try:
+        yield stages
+    finally:
+        _set_memory_tracking(False)
+        stages.extend(_get_build_stage_stats())
+        _clear_build_stage_stats()
+
+
 def set_log_level(level: str) -> None:
     """Set APSI log level.
 
@@ -0,0 +1,110 @@
+"""Compare benchmark results against a stored baseline.
+
+Results are the JSON files written by pytest-benchmark. Baselines are results
+stored under `benchmarks/baselines/`, one per machine, as timings from different
+machines cannot be compared:
+
+    pytest benchmarks --benchmark-json=benchmarks/baselines/<machine>.json
+    pytest benchmarks --benchmark-json=current.json
+    python -m benchmarks.compare benchmarks/baselines/<machine>.json current.json
+
+The comparison exits with status 1 if a benchmark got slower than the threshold
+allows; benchmarks missing from either file are listed but do not fail it.
+"""
+
+import argparse
+import json
+import sys
+from typing import Dict, List, NamedTuple, Optional
+
+
+class Comparison(NamedTuple):
+    name: str
+    baseline: Optional[float]
+    current: Optional[float]
+    regressed: bool
+
+    @property
+    def change(self) -> Optional[float]:
+        if self.baseline is None or self.current is None or not self.baseline:
+            return None
+        return self.current / self.baseline - 1
+
+
+def load_results(path: str, stat: str = "median") -> Dict[str, float]:
+    """Load one statistic, in seconds, of every benchmark in a result file."""
+    with open(path) as fh:
+        results = json.load(fh)
+    return {
+        benchmark["fullname"]: benchmark["stats"][stat]
+        for benchmark in results["benchmarks"]
+    }
+
+
+def compare(
+    baseline: Dict[str, float], current: Dict[str, float], threshold: float
+) -> List[Comparison]:
+    """Compare results; a benchmark regressed if it got slower by more than `threshold`.
+
+    Args:
+        baseline: Timings of the baseline by benchmark name
+        current: Timings to check by benchmark name
+        threshold: Allowed slowdown as a fraction of the baseline, e.g. 0.1 for 10%
+    """
+    comparisons = []
+    for name in sorted(baseline.keys() | current.keys()):
+        base, cur = baseline.get(name), current.get(name)
+        regressed = base is not None and cur is not None
+        regressed = regressed and cur > base * (1 + threshold)
+        comparisons.append(Comparison(name, base, cur, regressed))
+    return comparisons
+
+
+def _format(seconds: Optional[float]) -> str:
+    return "-" if seconds is None else f"{seconds * 1e3:.3f} ms"
+
+
+def main(argv: Optional[List[str]] = None) -> int:
+    """Compare two result files from the command line."""
+    parser = argparse.ArgumentParser(
+        prog="python -m benchmarks.compare",
+        description="Compare benchmark results against a baseline.",
+    )
+    parser.add_argument("baseline", help="pytest-benchmark JSON of the baseline")
+    parser.add_argument("current", help="pytest-benchmark JSON to check")
+    parser.add_argument(
+        "--threshold",
+        type=float,
+        default=0.1,
+        help="allowed slowdown as a fraction of the baseline (default: 0.1)",
+    )
+    parser.add_argument(
+        "--stat",
+        default="median",
+        choices=["min", "max", "mean", "median"],
+        help="statistic to compare (default: median)",
+    )
+    args = parser.parse_args(argv)
+
+    comparisons = compare(
+        load_results(args.baseline, args.stat),
+        load_results(args.current, args.stat),
+        args.threshold,
+    )
+    for c in comparisons:
+        change = "" if c.change is None else f"{c.change:+.1%}"
+        flag = "REGRESSED" if c.regressed else ""
+        print(
+            f"{c.name:<70} {_format(c.baseline):>14} {_format(c.current):>14} "
+            f"{change:>8} {flag}"
+        )
+
+    regressions = sum(c.regressed for c in comparisons)
+    if regressions:
+        print(f"{regressions} benchmarks regressed by more than {args.threshold:.0%}")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,62 @@
+import json
+import pathlib
+from typing import List, Tuple
+
+import pytest
+
+# Database sizes every scaled benchmark runs at
+SCALES = [1_000, 10_000]
+
+
+def labeled_items(count: int) -> List[Tuple[str, str]]:
+    return [(f"item{i}", f"label{i:010d}") for i in range(count)]
+
+
+def unlabeled_items(count: int) -> List[str]:
+    return [f"item{i}" for i in range(count)]
+
+
+def queried_items(count: int) -> List[str]:
+    """Ten items of a database of the given size and one that is not in it."""
+    return [f"item{i}" for i in range(0, count, count // 10)] + ["unknown"]
+
+
+@pytest.fixture(scope="module", params=SCALES)
+def scale(request) -> int:
+    return request.param
+
+
+@pytest.fixture(scope="session")
+def apsi_params() -> str:
+    return json.dumps(
+        {
+            "table_params": {
+                "hash_func_count": 3,
+                "table_size": 512,
+                "max_items_per_bin": 92,
+            },
+            "item_params": {"felts_per_item": 8},
+            "query_params": {
+                "ps_low_degree": 0,
+                "query_powers": [1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46],
+            },
+            "seal_params": {
+                "plain_modulus": 40961,
+                "poly_modulus_degree": 4096,
+                "coeff_modulus_bits": [40, 32, 32],
+            },
+        }
+    )
+
+
+@pytest.fixture(scope="session")
+def csv_dbs(tmp_path_factory: pytest.TempPathFactory) -> dict:
+    """CSV files with labeled databases of every size in `SCALES`."""
+    directory = tmp_path_factory.mktemp("csv")
+    paths = {}
+    for scale in SCALES:
+        path: pathlib.Path = directory / f"db-{scale}.csv"
+        rows = labeled_items(scale)
+        path.write_text("".join(f"{item},{label}\n" for item, label in rows))
+        paths[scale] = str(path)
+    return paths
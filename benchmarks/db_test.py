@@ -0,0 +1,70 @@
+"""Building, saving and loading databases and batch ingestion."""
+
+import pathlib
+
+from apsi import LabeledServer, UnlabeledServer
+
+from .conftest import labeled_items, unlabeled_items
+
+# Rounds of the benchmarks that build a fresh server in every round
+BUILD_ROUNDS = 3
+
+
+def test_load_csv_db(benchmark, apsi_params: str, scale: int, csv_dbs: dict):
+    server = LabeledServer()
+    benchmark.pedantic(
+        server.load_csv_db, args=(csv_dbs[scale], apsi_params), rounds=BUILD_ROUNDS
+    )
+
+
+def test_load_csv_uid_db(benchmark, apsi_params: str, scale: int, csv_dbs: dict):
+    server = LabeledServer()
+    benchmark.pedantic(
+        server.load_csv_uid_db,
+        args=(csv_dbs[scale], apsi_params),
+        rounds=BUILD_ROUNDS,
+    )
+    assert len(server.uid_xored_label_table) == scale
+
+
+def test_save_db(
+    benchmark, apsi_params: str, scale: int, csv_dbs: dict, tmp_path: pathlib.Path
+):
+    server = LabeledServer()
+    server.load_csv_db(csv_dbs[scale], apsi_params)
+    benchmark(server.save_db, str(tmp_path / "db"))
+
+
+def test_load_db(
+    benchmark, apsi_params: str, scale: int, csv_dbs: dict, tmp_path: pathlib.Path
+):
+    server = LabeledServer()
+    server.load_csv_db(csv_dbs[scale], apsi_params)
+    server.save_db(str(tmp_path / "db"))
+    benchmark(LabeledServer().load_db, str(tmp_path / "db"))
+
+
+def test_add_labeled_items(benchmark, apsi_params: str, scale: int):
+    items = labeled_items(scale)
+
+    def setup():
+        server = LabeledServer()
+        server.init_db(apsi_params, max_label_length=16)
+        return (server,), {}
+
+    benchmark.pedantic(
+        lambda server: server.add_items(items), setup=setup, rounds=BUILD_ROUNDS
+    )
+
+
+def test_add_unlabeled_items(benchmark, apsi_params: str, scale: int):
+    items = unlabeled_items(scale)
+
+    def setup():
+        server = UnlabeledServer()
+        server.init_db(apsi_params)
+        return (server,), {}
+
+    benchmark.pedantic(
+        lambda server: server.add_items(items), setup=setup, rounds=BUILD_ROUNDS
+    )
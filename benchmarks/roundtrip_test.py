@@ -0,0 +1,80 @@
+"""Full client/server round trips and their individual steps."""
+
+import pytest
+from apsi import LabeledClient, LabeledServer, UnlabeledClient, UnlabeledServer
+
+from .conftest import labeled_items, queried_items, unlabeled_items
+
+
+@pytest.fixture(scope="module")
+def labeled_server(apsi_params: str, scale: int) -> LabeledServer:
+    server = LabeledServer()
+    server.init_db(apsi_params, max_label_length=16)
+    server.add_items(labeled_items(scale))
+    return server
+
+
+@pytest.fixture(scope="module")
+def unlabeled_server(apsi_params: str, scale: int) -> UnlabeledServer:
+    server = UnlabeledServer()
+    server.init_db(apsi_params)
+    server.add_items(unlabeled_items(scale))
+    return server
+
+
+def test_labeled_round_trip(benchmark, apsi_params: str, scale: int, labeled_server):
+    client = LabeledClient(apsi_params)
+    items = queried_items(scale)
+
+    def round_trip():
+        oprf_request = client.oprf_request(items)
+        query = client.build_query(labeled_server.handle_oprf_request(oprf_request))
+        return client.extract_result(labeled_server.handle_query(query))
+
+    assert len(benchmark(round_trip)) == len(items) - 1
+
+
+def test_unlabeled_round_trip(
+    benchmark, apsi_params: str, scale: int, unlabeled_server
+):
+    client = UnlabeledClient(apsi_params)
+    items = queried_items(scale)
+
+    def round_trip():
+        oprf_request = client.oprf_request(items)
+        query = client.build_query(unlabeled_server.handle_oprf_request(oprf_request))
+        return client.extract_result(unlabeled_server.handle_query(query))
+
+    assert len(benchmark(round_trip)) == len(items) - 1
+
+
+def test_handle_query(benchmark, apsi_params: str, scale: int, labeled_server):
+    client = LabeledClient(apsi_params)
+    oprf_request = client.oprf_request(queried_items(scale))
+    query = client.build_query(labeled_server.handle_oprf_request(oprf_request))
+
+    benchmark(labeled_server.handle_query, query)
+
+
+def test_labeled_extract_result(
+    benchmark, apsi_params: str, scale: int, labeled_server
+):
+    client = LabeledClient(apsi_params)
+    items = queried_items(scale)
+    oprf_request = client.oprf_request(items)
+    query = client.build_query(labeled_server.handle_oprf_request(oprf_request))
+    response = labeled_server.handle_query(query)
+
+    assert len(benchmark(client.extract_result, response)) == len(items) - 1
+
+
+def test_unlabeled_extract_result(
+    benchmark, apsi_params: str, scale: int, unlabeled_server
+):
+    client = UnlabeledClient(apsi_params)
+    items = queried_items(scale)
+    oprf_request = client.oprf_request(items)
+    query = client.build_query(unlabeled_server.handle_oprf_request(oprf_request))
+    response = unlabeled_server.handle_query(query)
+
+    assert len(benchmark(client.extract_result, response)) == len(items) - 1
@@ -0,0 +1,99 @@
+#include "change_journal.h"
+
+// STD
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+    constexpr uint32_t delta_magic = 0x44504150; // "PAPD"
+
+    // Delta header: magic, from version, to version, record count
+    struct DeltaHeader {
+        uint32_t magic;
+        uint32_t reserved;
+        uint64_t from_version;
+        uint64_t to_version;
+        uint64_t record_count;
+    };
+} // namespace
+
+void ChangeJournal::record(const vector<UpdateLog::Record> &records, uint64_t version)
+{
+    lock_guard<mutex> lock(mutex_);
+    for (auto &record : records) {
+        entries_[record.item] = Entry{ version, record.op, record.label };
+    }
+}
+
+string ChangeJournal::export_delta(uint64_t from_version, uint64_t to_version) const
+{
+    if (from_version > to_version) {
+        throw invalid_argument("the delta would end before it starts");
+    }
+
+    vector<UpdateLog::Record> records;
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (from_version < start_version_) {
+            throw out_of_range("changes before version " + to_string(start_version_) +
+                               " are not tracked");
+        }
+        for (auto &entry : entries_) {
+            if (entry.second.version > from_version && entry.second.version <= to_version) {
+                records.push_back({ entry.second.op, entry.first, entry.second.label });
+            }
+        }
+    }
+
+    DeltaHeader header{ delta_magic, 0, from_version, to_version, records.size() };
+    string delta(reinterpret_cast<const char *>(&header), sizeof(header));
+    UpdateLog::Serialize(records, delta);
+    return delta;
+}
+
+void ChangeJournal::discard(uint64_t version)
+{
+    lock_guard<mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end();) {
+        it = it->second.version <= version ? entries_.erase(it) : next(it);
+    }
+    start_version_ = max(start_version_, version);
+}
+
+size_t ChangeJournal::size() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return entries_.size();
+}
+
+void ChangeJournal::ParseDelta(
+    const string &delta,
+    uint64_t &from_version,
+    uint64_t &to_version,
+    vector<UpdateLog::Record> &records)
+{
+    DeltaHeader header;
+    if (delta.size() < sizeof(header)) {
+        throw runtime_error("delta is too short");
+    }
+    delta.copy(reinterpret_cast<char *>(&header), sizeof(header));
+    if (header.magic != delta_magic) {
+        throw runtime_error("invalid delta header");
+    }
+
+    istringstream in(delta.substr(sizeof(header)));
+    bool complete;
+    records.clear();
+    UpdateLog::Deserialize(
+        in, [&](const UpdateLog::Record &record) { records.push_back(record); }, complete);
+    if (!complete || records.size() != header.record_count) {
+        throw runtime_error("delta is truncated or corrupt");
+    }
+
+    from_version = header.from_version;
+    to_version = header.to_version;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+// STD
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Local
+#include "update_log.h"
+
+/**
+Keeps the latest change of every item together with the database version it was made in, so that
+the changes between an older version and the current one can be exported as a compact delta.
+Only the final state of each changed item is kept, so a delta never holds more records than
+there are distinct changed items.
+*/
+class ChangeJournal {
+public:
+    explicit ChangeJournal(std::uint64_t start_version) : start_version_(start_version)
+    {}
+
+    /**
+    The oldest version deltas can be exported from.
+    */
+    std::uint64_t start_version() const
+    {
+        return start_version_;
+    }
+
+    void record(const std::vector<UpdateLog::Record> &records, std::uint64_t version);
+
+    /**
+    Creates a delta from `from_version` to `to_version` holding the latest change of every item
+    changed after `from_version`.
+    */
+    std::string export_delta(std::uint64_t from_version, std::uint64_t to_version) const;
+
+    /**
+    Forgets all changes up to and including `version`; deltas can afterwards only be exported
+    from `version` on.
+    */
+    void discard(std::uint64_t version);
+
+    std::size_t size() const;
+
+    /**
+    Parses a delta created by export_delta.
+    */
+    static void ParseDelta(
+        const std::string &delta,
+        std::uint64_t &from_version,
+        std::uint64_t &to_version,
+        std::vector<UpdateLog::Record> &records);
+
+private:
+    struct Entry {
+        std::uint64_t version;
+        UpdateLog::Op op;
+        std::string label;
+    };
+
+    std::uint64_t start_version_;
+
+    std::unordered_map<std::string, Entry> entries_;
+
+    mutable std::mutex mutex_;
+}; // class ChangeJournal
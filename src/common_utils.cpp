@@ -4,8 +4,11 @@
 #include "common_utils.h"
 
 // STD
+#include <cerrno>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <stdexcept>
 #if defined(_MSC_VER)
 #include <windows.h>
 #endif
@@ -14,6 +17,10 @@
 #else
 #include <filesystem>
 #endif
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 // APSI
 #include <apsi/log.h>
@@ -142,3 +149,20 @@ void throw_if_file_invalid(const string &file_name)
         throw logic_error("invalid file");
     }
 }
+
+void sync_parent_directory(const string &file_name)
+{
+#ifndef _MSC_VER
+    fs::path dir = fs::absolute(fs::path(file_name)).parent_path();
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        throw runtime_error("failed to open directory `" + dir.string() + "`: " + strerror(errno));
+    }
+    int result = ::fsync(fd);
+    int error = errno;
+    ::close(fd);
+    if (result != 0) {
+        throw runtime_error("failed to sync directory `" + dir.string() + "`: " + strerror(error));
+    }
+#endif
+}
@@ -36,3 +36,9 @@ void print_timing_report(const apsi::util::Stopwatch &stopwatch);
 Throw an exception if the given file is invalid.
 */
 void throw_if_file_invalid(const std::string &file_name);
+
+/**
+Make the directory entry of the given file durable, e.g. after it was created or renamed. Throws
+std::runtime_error if the directory cannot be synced.
+*/
+void sync_parent_directory(const std::string &file_name);
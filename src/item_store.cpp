@@ -0,0 +1,117 @@
+#include "item_store.h"
+#include "serialization.h"
+
+// STD
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace apsi;
+
+void ItemStore::insert_or_assign(const string &item, const string &label)
+{
+    lock_guard<mutex> lock(mutex_);
+    items_[item] = label;
+}
+
+void ItemStore::remove(const string &item)
+{
+    lock_guard<mutex> lock(mutex_);
+    items_.erase(item);
+}
+
+bool ItemStore::contains(const string &item) const
+{
+    lock_guard<mutex> lock(mutex_);
+    return items_.count(item) > 0;
+}
+
+size_t ItemStore::size() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return items_.size();
+}
+
+void ItemStore::clear()
+{
+    lock_guard<mutex> lock(mutex_);
+    items_.clear();
+}
+
+void ItemStore::merge(const ItemStore &other)
+{
+    if (&other == this) {
+        return;
+    }
+    scoped_lock lock(mutex_, other.mutex_);
+    for (auto &item_label : other.items_) {
+        items_[item_label.first] = item_label.second;
+    }
+}
+
+void ItemStore::pad_labels(size_t byte_count)
+{
+    lock_guard<mutex> lock(mutex_);
+    for (auto &item_label : items_) {
+        auto &label = item_label.second;
+        if (label.size() < byte_count) {
+            label.insert(0, byte_count - label.size(), '\0');
+        }
+    }
+}
+
+CSVReader::DBData ItemStore::to_db_data(bool labeled) const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    if (!labeled) {
+        CSVReader::UnlabeledData data;
+        data.reserve(items_.size());
+        for (auto &item_label : items_) {
+            data.emplace_back(item_label.first);
+        }
+        return data;
+    }
+
+    CSVReader::LabeledData data;
+    data.reserve(items_.size());
+    for (auto &item_label : items_) {
+        auto &label = item_label.second;
+        data.emplace_back(Item(item_label.first), Label(label.begin(), label.end()));
+    }
+    return data;
+}
+
+void ItemStore::save(ostream &out) const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    uint64_t count = items_.size();
+    out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    for (auto &item_label : items_) {
+        write_string(out, item_label.first);
+        write_string(out, item_label.second);
+    }
+}
+
+void ItemStore::load(istream &in)
+{
+    uint64_t count = 0;
+    in.read(reinterpret_cast<char *>(&count), sizeof(count));
+    if (!in) {
+        throw runtime_error("failed to read item store");
+    }
+
+    unordered_map<string, string> items;
+    items.reserve(min<uint64_t>(count, max_reserved_count));
+    while (count--) {
+        string item = read_string(in, "failed to read item store");
+        items[move(item)] = read_string(in, "failed to read item store");
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    items_ = move(items);
+}
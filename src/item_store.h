@@ -0,0 +1,52 @@
+#pragma once
+
+// STD
+#include <cstddef>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "csv_reader.h"
+
+/**
+Raw items and labels of a server database. A SenderDB only keeps the OPRF hashes of its items,
+so operations that have to encode the data again (under other parameters, another OPRF key, or
+to repack it) need the original items retained next to it.
+*/
+class ItemStore {
+public:
+    void insert_or_assign(const std::string &item, const std::string &label);
+
+    void remove(const std::string &item);
+
+    bool contains(const std::string &item) const;
+
+    std::size_t size() const;
+
+    void clear();
+
+    /**
+    Adds all items of another store, replacing the labels of items that are in both.
+    */
+    void merge(const ItemStore &other);
+
+    /**
+    Pads all labels shorter than `byte_count` with leading zero bytes.
+    */
+    void pad_labels(std::size_t byte_count);
+
+    /**
+    Returns a copy of the stored data in the form expected by SenderDB::set_data.
+    */
+    CSVReader::DBData to_db_data(bool labeled) const;
+
+    void save(std::ostream &out) const;
+
+    void load(std::istream &in);
+
+private:
+    mutable std::mutex mutex_;
+
+    std::unordered_map<std::string, std::string> items_;
+}; // class ItemStore
@@ -0,0 +1,108 @@
+#include "label_dictionary.h"
+#include "serialization.h"
+
+// STD
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+
+using namespace std;
+
+LabelDictionary::LabelDictionary(vector<string> labels)
+{
+    sort(labels.begin(), labels.end());
+    labels.erase(unique(labels.begin(), labels.end()), labels.end());
+
+    code_byte_count_ = get_byte_count(labels.size());
+    labels_ = move(labels);
+    for (size_t i = 0; i < labels_.size(); i++) {
+        codes_.emplace(labels_[i], make_code(i));
+    }
+}
+
+size_t LabelDictionary::size() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return labels_.size();
+}
+
+vector<string> LabelDictionary::labels() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return labels_;
+}
+
+string LabelDictionary::encode(const string &label)
+{
+    lock_guard<mutex> lock(mutex_);
+    auto it = codes_.find(label);
+    if (it != codes_.end()) {
+        return it->second;
+    }
+
+    if (get_byte_count(labels_.size() + 1) > code_byte_count_) {
+        throw runtime_error(
+            "The label dictionary is full; new labels need wider codes, so the database has to "
+            "be loaded again");
+    }
+    labels_.push_back(label);
+    return codes_.emplace(label, make_code(labels_.size() - 1)).first->second;
+}
+
+bool LabelDictionary::operator==(const LabelDictionary &other) const
+{
+    if (&other == this) {
+        return true;
+    }
+    scoped_lock lock(mutex_, other.mutex_);
+    return code_byte_count_ == other.code_byte_count_ && labels_ == other.labels_;
+}
+
+string LabelDictionary::make_code(size_t index) const
+{
+    uint64_t code = index + 1;
+    string bytes(code_byte_count_, '\0');
+    for (size_t i = code_byte_count_; i-- > 0; code >>= 8) {
+        bytes[i] = static_cast<char>(code & 0xFF);
+    }
+    return bytes;
+}
+
+void LabelDictionary::save(ostream &out) const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    uint32_t code_byte_count = static_cast<uint32_t>(code_byte_count_);
+    uint64_t count = labels_.size();
+    out.write(reinterpret_cast<const char *>(&code_byte_count), sizeof(code_byte_count));
+    out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    for (auto &label : labels_) {
+        write_string(out, label);
+    }
+}
+
+void LabelDictionary::load(istream &in)
+{
+    uint32_t code_byte_count = 0;
+    uint64_t count = 0;
+    in.read(reinterpret_cast<char *>(&code_byte_count), sizeof(code_byte_count));
+    in.read(reinterpret_cast<char *>(&count), sizeof(count));
+    if (!in || code_byte_count == 0 || code_byte_count > sizeof(uint64_t)) {
+        throw runtime_error("failed to read label dictionary");
+    }
+
+    vector<string> labels;
+    labels.reserve(min<uint64_t>(count, max_reserved_count));
+    while (count--) {
+        labels.push_back(read_string(in, "failed to read label dictionary"));
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    code_byte_count_ = code_byte_count;
+    labels_ = move(labels);
+    codes_.clear();
+    for (size_t i = 0; i < labels_.size(); i++) {
+        codes_.emplace(labels_[i], make_code(i));
+    }
+}
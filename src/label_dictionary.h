@@ -0,0 +1,60 @@
+#pragma once
+
+// STD
+#include <cstddef>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+Maps the labels of a database to fixed-size integer codes. Labels from a small domain, e.g.
+categories, are stored in the SenderDB as their codes instead of their raw bytes, so that its label
+byte count, and with it the memory, query cost and response size, shrinks to the size of the codes.
+Clients decode the labels with a copy of the dictionary.
+
+Codes are big-endian and start at 1; the label with code `c` is `labels()[c - 1]`.
+*/
+class LabelDictionary {
+public:
+    LabelDictionary() = default;
+
+    /**
+    Creates a dictionary of the distinct given labels in sorted order, with codes just wide
+    enough for them.
+    */
+    explicit LabelDictionary(std::vector<std::string> labels);
+
+    std::size_t code_byte_count() const
+    {
+        return code_byte_count_;
+    }
+
+    std::size_t size() const;
+
+    std::vector<std::string> labels() const;
+
+    /**
+    Returns the code of a label. Labels not in the dictionary yet are added as long as the codes
+    have room for them; clients then need the updated dictionary to decode them.
+    */
+    std::string encode(const std::string &label);
+
+    bool operator==(const LabelDictionary &other) const;
+
+    void save(std::ostream &out) const;
+
+    void load(std::istream &in);
+
+private:
+    std::string make_code(std::size_t index) const;
+
+    mutable std::mutex mutex_;
+
+    std::size_t code_byte_count_ = 0;
+
+    std::vector<std::string> labels_;
+
+    std::unordered_map<std::string, std::string> codes_;
+}; // class LabelDictionary
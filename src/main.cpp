@@ -26,6 +26,7 @@
  */
 
 // STD
+#include <array>
 #include <sstream>
 #include <numeric>
 #include <random>
@@ -33,6 +34,13 @@
 #include <iostream>
 #include <fstream>
 #include <csignal>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <unordered_map>
 
 // pybind11
 #include <pybind11/pybind11.h>
@@ -44,10 +52,16 @@
 #include <apsi/receiver.h>
 #include <apsi/sender.h>
 #include <apsi/network/stream_channel.h>
+#include <apsi/oprf/ecpoint.h>
 #include <apsi/psi_params.h>
 #include <apsi/sender_db.h>
 #include <apsi/thread_pool_mgr.h>
 #include "sender.h"
+#include "change_journal.h"
+#include "memory_stats.h"
+#include "op_stats.h"
+#include "thread_budget.h"
+#include "update_log.h"
 
 using namespace std;
 using namespace apsi;
@@ -100,6 +114,71 @@ void set_log_level(const string &level)
     Log::SetLogLevel(ll);
 }
 
+// The counters of every kind of work, see OpScope
+py::dict get_op_stats_dict()
+{
+    py::dict stats;
+    auto op_stats = get_op_stats();
+    for (size_t i = 0; i < op_type_count; i++) {
+        py::dict op;
+        op["calls"] = op_stats[i].calls;
+        op["waiting"] = op_stats[i].waiting;
+        op["running"] = op_stats[i].running;
+        op["wait_seconds"] = op_stats[i].wait_seconds;
+        op["run_seconds"] = op_stats[i].run_seconds;
+        stats[to_string(static_cast<OpType>(i))] = op;
+    }
+    return stats;
+}
+
+// The auto-tuned thread count of every kind of work, see set_thread_auto_tune
+py::dict get_thread_tuning_dict()
+{
+    py::dict tuning;
+    auto thread_tuning = get_thread_tuning();
+    for (size_t i = 0; i < op_type_count; i++) {
+        py::dict op;
+        op["thread_count"] = thread_tuning[i].thread_count;
+        op["tuned"] = thread_tuning[i].tuned;
+        tuning[to_string(static_cast<OpType>(i))] = op;
+    }
+    return tuning;
+}
+
+py::dict to_dict(const MemoryUsage &usage)
+{
+    py::dict dict;
+    dict["rss_bytes"] = usage.rss_bytes;
+    dict["peak_rss_bytes"] = usage.peak_rss_bytes;
+    dict["heap_bytes"] = usage.heap_bytes;
+    dict["seal_pool_bytes"] = usage.seal_pool_bytes;
+    return dict;
+}
+
+py::dict get_memory_usage_dict()
+{
+    return to_dict(get_memory_usage());
+}
+
+// The memory of the database build stages recorded so far, see BuildStage
+py::list get_build_stage_stats_list()
+{
+    py::list stats;
+    for (auto &stage : get_build_stage_stats()) {
+        py::dict dict;
+        dict["stage"] = stage.stage;
+        dict["items"] = stage.items;
+        dict["seconds"] = stage.seconds;
+        dict["before"] = to_dict(stage.before);
+        dict["after"] = to_dict(stage.after);
+        stats.append(dict);
+    }
+    return stats;
+}
+
+// Items per chunk below which splitting up the OPRF work does not pay off
+constexpr size_t min_oprf_chunk_size = 64;
+
 /*
 Custom StreamChannel class that uses separate stringstream objects as the backing streams
 input and output and allows the buffers to be easily set (for input) and extracted (for output).
@@ -132,52 +211,130 @@ private:
 class APSIClient
 {
 public:
-    APSIClient(string &params_json) : _receiver(PSIParams::Load(params_json)) {}
+    APSIClient(string &params_json)
+        : _receiver(make_unique<Receiver>(PSIParams::Load(params_json)))
+    {}
 
     // TODO: use std::vector<str> in conjunction with "#include <pybind11/stl.h>" for auto conversion
     py::bytes oprf_request(const py::list &input_items)
     {
-        vector<Item> receiver_items;
+        vector<string> raw_items;
+        raw_items.reserve(py::len(input_items));
         for (py::handle item : input_items) {
-            receiver_items.push_back(item.cast<std::string>());
+            raw_items.push_back(item.cast<std::string>());
         }
 
-        _oprf_receiver = Receiver::CreateOPRFReceiver(receiver_items);
-        Request request = Receiver::CreateOPRFRequest(_oprf_receiver);
+        string request_string;
+        {
+            py::gil_scoped_release release;
+            OpScope scope(OpType::oprf);
+            lock_guard<mutex> lock(_mutex);
+            scope.start();
+
+            // Blind the items in chunks on the thread pool; the server answers the concatenated
+            // blinded items in order, so the response can be split up the same way.
+            _oprf_chunks = make_chunks(
+                raw_items.size(), ThreadPoolMgr::GetThreadCount(), min_oprf_chunk_size);
+            _oprf_receivers.clear();
+            _oprf_receivers.resize(_oprf_chunks.size() - 1);
+            vector<vector<unsigned char>> query_data(_oprf_receivers.size());
+            for_each_chunk(_oprf_chunks, [&](size_t chunk_idx, size_t begin, size_t end) {
+                vector<Item> receiver_items(raw_items.begin() + begin, raw_items.begin() + end);
+                _oprf_receivers[chunk_idx] = make_unique<oprf::OPRFReceiver>(receiver_items);
+                query_data[chunk_idx] = _oprf_receivers[chunk_idx]->query_data();
+            });
+
+            auto sop_oprf = make_unique<network::SenderOperationOPRF>();
+            sop_oprf->data.reserve(raw_items.size() * oprf::oprf_query_size);
+            for (auto &data : query_data) {
+                sop_oprf->data.insert(sop_oprf->data.end(), data.begin(), data.end());
+            }
+            _oprf_item_count = raw_items.size();
 
-        _channel.send(move(request));
-        return py::bytes(_channel.extract_out_buffer());
+            _channel.send(to_request(move(sop_oprf)));
+            request_string = _channel.extract_out_buffer();
+        }
+        return py::bytes(request_string);
     }
 
     py::bytes build_query(const string &oprf_response_string)
     {
-        _channel.set_in_buffer(oprf_response_string);
-        OPRFResponse oprf_response = to_oprf_response(_channel.receive_response());
-        tie(_hashed_recv_items, _label_keys) = Receiver::ExtractHashes(oprf_response, _oprf_receiver);
+        string query_string;
+        {
+            py::gil_scoped_release release;
+            OpScope scope(OpType::query);
+            lock_guard<mutex> lock(_mutex);
+            scope.start();
+
+            _channel.set_in_buffer(oprf_response_string);
+            OPRFResponse oprf_response = to_oprf_response(_channel.receive_response());
+            if (oprf_response->data.size() != _oprf_item_count * oprf::oprf_response_size) {
+                throw runtime_error("OPRF response does not match the OPRF request");
+            }
+
+            _hashed_recv_items.assign(_oprf_item_count, HashedItem());
+            _label_keys.assign(_oprf_item_count, LabelKey());
+            for_each_chunk(_oprf_chunks, [&](size_t chunk_idx, size_t begin, size_t end) {
+                _oprf_receivers[chunk_idx]->process_responses(
+                    gsl::span<const unsigned char>(
+                        oprf_response->data.data() + begin * oprf::oprf_response_size,
+                        (end - begin) * oprf::oprf_response_size),
+                    gsl::span<HashedItem>(_hashed_recv_items.data() + begin, end - begin),
+                    gsl::span<LabelKey>(_label_keys.data() + begin, end - begin));
+            });
 
-        // Create query and send
-        pair<Request, IndexTranslationTable> recv_query = _receiver.create_query(_hashed_recv_items);
-        _itt = make_shared<IndexTranslationTable>(move(recv_query.second));
+            // Create query and send
+            pair<Request, IndexTranslationTable> recv_query =
+                _receiver->create_query(_hashed_recv_items);
+            _itt = make_shared<IndexTranslationTable>(move(recv_query.second));
+            _query_label_keys = _label_keys;
 
-        _channel.send(move(recv_query.first));
-        return py::bytes(_channel.extract_out_buffer());
+            _channel.send(move(recv_query.first));
+            query_string = _channel.extract_out_buffer();
+        }
+        return py::bytes(query_string);
     }
 
-    py::list extract_unlabeled_result_from_query_response(const string &query_response_string)
+    // Builds a query for a subset of the items of the last OPRF request, reusing their OPRF
+    // hashes. Results of this query are reported in the order of the given indices.
+    py::bytes build_subquery(const vector<size_t> &item_indices)
     {
-        signal(SIGINT, sigint_handler);
+        string query_string;
+        {
+            py::gil_scoped_release release;
+            OpScope scope(OpType::query);
+            lock_guard<mutex> lock(_mutex);
+            scope.start();
 
-        _channel.set_in_buffer(query_response_string);
-        QueryResponse query_response = to_query_response(_channel.receive_response());
-        uint32_t package_count = query_response->package_count;
+            vector<HashedItem> hashed_items;
+            vector<LabelKey> label_keys;
+            hashed_items.reserve(item_indices.size());
+            label_keys.reserve(item_indices.size());
+            for (size_t idx : item_indices) {
+                if (idx >= _hashed_recv_items.size()) {
+                    throw out_of_range("item index out of range");
+                }
+                hashed_items.push_back(_hashed_recv_items[idx]);
+                label_keys.push_back(_label_keys[idx]);
+            }
 
-        vector<ResultPart> rps;
-        while (package_count--)
-        {
-            rps.push_back(_channel.receive_result(_receiver.get_seal_context()));
+            pair<Request, IndexTranslationTable> recv_query = _receiver->create_query(hashed_items);
+            _itt = make_shared<IndexTranslationTable>(move(recv_query.second));
+            _query_label_keys = move(label_keys);
+
+            _channel.send(move(recv_query.first));
+            query_string = _channel.extract_out_buffer();
         }
+        return py::bytes(query_string);
+    }
 
-        vector<MatchRecord> query_result = _receiver.process_result(_label_keys, *_itt, rps);
+    py::list extract_unlabeled_result_from_query_response(
+        const string &query_response_string, size_t thread_count)
+    {
+        signal(SIGINT, sigint_handler);
+
+        vector<MatchRecord> query_result =
+            process_query_response(query_response_string, thread_count);
 
         py::list matches;
         for (auto const &qr : query_result)
@@ -185,21 +342,13 @@ public:
         return matches;
     }
 
-    py::list extract_labeled_result_from_query_response(const std::string &query_response_string)
+    py::list extract_labeled_result_from_query_response(
+        const std::string &query_response_string, size_t thread_count)
     {
         signal(SIGINT, sigint_handler);
 
-        _channel.set_in_buffer(query_response_string);
-        QueryResponse query_response = to_query_response(_channel.receive_response());
-        uint32_t package_count = query_response->package_count;
-
-        std::vector<ResultPart> rps;
-        while (package_count--)
-        {
-            rps.push_back(_channel.receive_result(_receiver.get_seal_context()));
-        }
-
-        std::vector<MatchRecord> query_result = _receiver.process_result(_label_keys, *_itt, rps);
+        std::vector<MatchRecord> query_result =
+            process_query_response(query_response_string, thread_count);
 
         py::list labels;
         for (auto const &qr : query_result) {
@@ -209,10 +358,57 @@ public:
         return labels;
     }
 
+    // Unmasks the labels of a UID table (see APSIServer::load_csv_uid_db) for the items of the last
+    // OPRF request at the given indices
+    vector<py::bytes> unmask_uid_labels(
+        const vector<size_t> &item_indices, const vector<string> &masked_labels,
+        const string &mask_mode)
+    {
+        if (item_indices.size() != masked_labels.size()) {
+            throw invalid_argument("Every masked label needs an item index");
+        }
+        UIDMaskMode mode = uid_mask_mode_from_string(mask_mode);
+
+        vector<vector<uint8_t>> labels;
+        {
+            py::gil_scoped_release release;
+            vector<UIDMaskKey> keys;
+            keys.reserve(item_indices.size());
+            {
+                lock_guard<mutex> lock(_mutex);
+                for (size_t idx : item_indices) {
+                    if (idx >= _hashed_recv_items.size()) {
+                        throw out_of_range("item index out of range");
+                    }
+                    keys.push_back(uid_mask_key(_hashed_recv_items[idx]));
+                }
+            }
+            labels.reserve(masked_labels.size());
+            for (auto &masked : masked_labels) {
+                labels.emplace_back(masked.begin(), masked.end());
+            }
+            apply_uid_masks(mode, keys, labels);
+        }
+
+        vector<py::bytes> out;
+        out.reserve(labels.size());
+        for (auto &label : labels) {
+            out.emplace_back(reinterpret_cast<const char *>(label.data()), label.size());
+        }
+        return out;
+    }
+
     std::vector<py::bytes> get_prf_bytes_all() const {
+        vector<HashedItem> hashed_items;
+        {
+            py::gil_scoped_release release;
+            lock_guard<mutex> lock(_mutex);
+            hashed_items = _hashed_recv_items;
+        }
+
         std::vector<py::bytes> out;
-        out.reserve(_hashed_recv_items.size());
-        for (auto const &hi : _hashed_recv_items) {
+        out.reserve(hashed_items.size());
+        for (auto const &hi : hashed_items) {
             auto span = hi.get_as<uint8_t>();
             out.emplace_back(py::bytes(reinterpret_cast<const char*>(span.data()), span.size()));
         }
@@ -221,12 +417,62 @@ public:
 
 
 private:
+    vector<MatchRecord> process_query_response(
+        const string &query_response_string, size_t thread_count)
+    {
+        py::gil_scoped_release release;
+        OpScope scope(OpType::decrypt);
+        lock_guard<mutex> lock(_mutex);
+        ThreadBudget budget(OpType::decrypt, thread_count);
+        scope.start();
+
+        _channel.set_in_buffer(query_response_string);
+        QueryResponse query_response = to_query_response(_channel.receive_response());
+        uint32_t package_count = query_response->package_count;
+
+        vector<ResultPart> rps;
+        while (package_count--)
+        {
+            rps.push_back(_channel.receive_result(_receiver->get_seal_context()));
+        }
+        budget.set_work(rps.size());
+
+        // Decrypt the parts with as many workers as the budget allows. A server with a write
+        // buffer may answer an item from a database and from its buffer, when the buffer was
+        // moved into the database while the query ran; the buffer's parts come last and hold
+        // the state the query started with, so the last part finding an item wins.
+        vector<MatchRecord> match_records(_itt->item_count());
+        vector<size_t> match_parts(match_records.size(), 0);
+        mutex match_records_mutex;
+        for_each_chunk(
+            make_chunks(rps.size(), budget.thread_count()),
+            [&](size_t, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    vector<MatchRecord> part_records =
+                        _receiver->process_result_part(_query_label_keys, *_itt, rps[i]);
+                    lock_guard<mutex> lock(match_records_mutex);
+                    for (size_t j = 0; j < part_records.size(); j++) {
+                        if (part_records[j].found &&
+                            (!match_records[j].found || i > match_parts[j])) {
+                            match_records[j] = move(part_records[j]);
+                            match_parts[j] = i;
+                        }
+                    }
+                }
+            });
+        return match_records;
+    }
+
     shared_ptr<IndexTranslationTable> _itt;
-    Receiver _receiver;
-    oprf::OPRFReceiver _oprf_receiver = oprf::OPRFReceiver(vector<Item>());
+    unique_ptr<Receiver> _receiver;
+    vector<unique_ptr<oprf::OPRFReceiver>> _oprf_receivers;
+    vector<size_t> _oprf_chunks;
+    size_t _oprf_item_count = 0;
     vector<HashedItem> _hashed_recv_items;
     vector<LabelKey> _label_keys;
+    vector<LabelKey> _query_label_keys;
     StringStreamChannel _channel;
+    mutable mutex _mutex;
 };
 
 class APSIServer
@@ -236,51 +482,280 @@ public:
 
     void init_db(
         string &params_json, size_t label_byte_count,
-        size_t nonce_byte_count, bool compressed)
+        size_t nonce_byte_count, bool compressed, const string &oprf_key)
     {
+        auto lock = lock_after_rebuilds();
         db_label_byte_count = label_byte_count;
         auto params = PSIParams::Load(params_json);
-        _db = make_shared<SenderDB>(
-            params, label_byte_count, nonce_byte_count, compressed);
+        _dbs = DBSet();
+        reset_db_state();
+        if (oprf_key.empty()) {
+            _dbs.db = make_shared<SenderDB>(
+                params, label_byte_count, nonce_byte_count, compressed);
+        } else {
+            _dbs.db = make_shared<SenderDB>(
+                params, load_oprf_key(oprf_key), label_byte_count, nonce_byte_count, compressed);
+        }
+    }
+
+    // The OPRF key of the database, e.g. to build shards of it in other processes
+    py::bytes export_oprf_key() const
+    {
+        auto lock = lock_state();
+        string key(oprf::oprf_key_size, '\0');
+        _dbs.db->get_oprf_key().save(oprf::oprf_key_span_type(
+            reinterpret_cast<unsigned char *>(&key[0]), key.size()));
+        return py::bytes(key);
+    }
+
+    // Retains the raw items and labels next to the database so that it can be encoded again,
+    // e.g. under additional parameters.
+    void init_item_store()
+    {
+        auto lock = lock_for_update();
+        fold_write_buffer();
+        if (_dbs.db->get_item_count() > 0) {
+            throw runtime_error("The item store must be initialized before adding items");
+        }
+        _dbs.item_store = make_shared<ItemStore>();
+    }
+
+    bool has_item_store() const
+    {
+        auto lock = lock_state();
+        return static_cast<bool>(_dbs.item_store);
+    }
+
+    // Encodes the data of the database additionally under other parameters. All encodings share
+    // the OPRF key, so a client does the OPRF step once and then queries whichever encoding is
+    // cheapest for its query size. Returns the index to pass to handle_query.
+    size_t add_params(const string &params_json)
+    {
+        auto lock = lock_for_update();
+        require_no_rebuild();
+        fold_write_buffer();
+        auto params = PSIParams::Load(params_json);
+        auto &db = *_dbs.db;
+
+        shared_ptr<SenderDB> param_db;
+        if (db.get_item_count() == 0) {
+            param_db = make_shared<SenderDB>(
+                params, db.get_oprf_key(), db.get_label_byte_count(),
+                db.get_nonce_byte_count(), db.is_compressed());
+        } else if (_dbs.item_store) {
+            param_db = create_sender_db_with_key(
+                _dbs.item_store->to_db_data(db.is_labeled()), params, db.get_oprf_key(),
+                db.get_label_byte_count(), db.get_nonce_byte_count(), db.is_compressed());
+        } else {
+            throw runtime_error("Adding parameters to a non-empty database requires an item store");
+        }
+
+        if (!param_db) {
+            throw runtime_error("Failed to encode the database under the given parameters");
+        }
+        _dbs.param_dbs.push_back(move(param_db));
+        return _dbs.param_dbs.size();
+    }
+
+    // Encodes the primary database and its membership database again under other parameters,
+    // from the retained items and with the same OPRF key, so no source files are needed and
+    // clients only have to switch to the new parameters
+    void reparameterize(const string &params_json)
+    {
+        auto lock = lock_for_update();
+        require_no_rebuild();
+        if (!_dbs.item_store) {
+            throw runtime_error("Reparameterizing a database requires an item store");
+        }
+
+        auto params = PSIParams::Load(params_json);
+        fold_write_buffer();
+        _dbs = reparameterize_db_set(_dbs, params);
+        APSI_LOG_INFO("Reparameterized database with " << _dbs.db->get_item_count() << " items");
+    }
+
+    bool has_label_dictionary() const
+    {
+        auto lock = lock_state();
+        return static_cast<bool>(_dbs.label_dictionary);
+    }
+
+    // The labels whose codes are stored in the database, or None if it stores raw labels
+    py::object get_label_dictionary() const
+    {
+        auto lock = lock_state();
+        if (!_dbs.label_dictionary) {
+            return py::none();
+        }
+        py::list labels;
+        for (auto &label : _dbs.label_dictionary->labels()) {
+            labels.append(py::bytes(label));
+        }
+        return labels;
+    }
+
+    size_t get_params_count() const
+    {
+        auto lock = lock_state();
+        return _dbs.param_dbs.size() + 1;
+    }
+
+    // Keeps an unlabeled copy of the item set next to the labeled database. Clients can run a
+    // cheap membership query against it first and a labeled query only for the matches.
+    void init_membership_db()
+    {
+        auto lock = lock_for_update();
+        require_no_rebuild();
+        fold_write_buffer();
+        auto &db = *_dbs.db;
+        if (!db.is_labeled()) {
+            throw runtime_error("A membership database requires a labeled database");
+        }
+        if (db.get_item_count() > 0) {
+            throw runtime_error("The membership database must be initialized before adding items");
+        }
+        _dbs.membership_db = make_shared<SenderDB>(
+            db.get_params(), db.get_oprf_key(), 0, 0, db.is_compressed());
+    }
+
+    bool has_membership_db() const
+    {
+        auto lock = lock_state();
+        return static_cast<bool>(_dbs.membership_db);
     }
 
+    // Saves a snapshot of the databases; queries go on while it is written, see pin_db_snapshot
     void save_db(const string &db_file_path)
     {
+        DBSet dbs = pin_db_snapshot();
+        py::gil_scoped_release release;
         try
         {
-            ofstream ofs;
-            ofs.open(db_file_path, ios::binary);
-            _db->save(ofs);
-            ofs.close();
+            save_db_set_to_file(db_file_path, dbs);
         }
         catch (const exception &e)
         {
+            unpin_db_snapshot();
             throw runtime_error("Failed saving database");
         }
+        unpin_db_snapshot();
+    }
+
+    // Saves a snapshot of the databases like save_db, but on a background thread with low CPU
+    // and I/O priority that writes at most `max_bytes_per_second`, or without a limit for 0
+    void start_save(const string &db_file_path, size_t max_bytes_per_second)
+    {
+        auto lock = lock_state();
+        if (_snapshot_pinned) {
+            auto is_running = [](const auto &task) {
+                return task.valid() && task.wait_for(chrono::seconds(0)) != future_status::ready;
+            };
+            if (is_running(_save)) {
+                throw runtime_error("A save is already running");
+            }
+            if (is_running(_compaction)) {
+                throw runtime_error("A compaction is writing a snapshot; wait for it first");
+            }
+            throw runtime_error("A snapshot is being written by save_db; wait for it first");
+        }
+        fold_write_buffer();
+        _snapshot_pinned = true;
+        DBSet dbs = _dbs;
+        _save = async(
+            launch::async,
+            [this, dbs = move(dbs), db_file_path, max_bytes_per_second]() mutable {
+                DBSet snapshot = move(dbs);
+                lower_thread_priority();
+                try {
+                    save_db_set_to_file(db_file_path, snapshot, max_bytes_per_second);
+                } catch (...) {
+                    unpin_db_snapshot();
+                    throw;
+                }
+                unpin_db_snapshot();
+                APSI_LOG_INFO("Saved database to `" << db_file_path << "` in the background");
+            });
+    }
+
+    bool is_saving() const
+    {
+        auto lock = lock_state();
+        return _save.valid() && _save.wait_for(chrono::seconds(0)) != future_status::ready;
+    }
+
+    // Waits for the last save started with start_save and rethrows its error, if any
+    void wait_for_save()
+    {
+        shared_future<void> save;
+        {
+            auto lock = lock_state();
+            save = _save;
+        }
+        if (save.valid()) {
+            py::gil_scoped_release release;
+            save.get();
+        }
     }
 
     void load_db(const string &db_file_path)
     {
+        DBSet dbs;
         try
         {
-            ifstream ifs;
-            ifs.open(db_file_path, ios::binary);
-            auto [data, size] = SenderDB::Load(ifs);
-            _db = make_shared<SenderDB>(move(data));
-            ifs.close();
+            py::gil_scoped_release release;
+            dbs = load_db_set_from_file(db_file_path);
         }
         catch (const exception &e)
         {
             throw runtime_error("Failed loading database");
         }
+
+        {
+            auto lock = lock_after_rebuilds();
+            _dbs = move(dbs);
+            reset_db_state();
+            db_label_byte_count = _dbs.db->get_label_byte_count();
+        }
+        // The previous databases are gone now, too
+        py::gil_scoped_release release;
+        release_free_memory();
     }
 
-    void load_csv_db(const string &csv_db_file_path, const string &params_json, 
-                    size_t nonce_byte_count, bool compressed)
+    // Loads the items of the CSV files, or with `shard_count > 1` only those belonging to one
+    // shard. Shards built with the same parameters, OPRF key and label width can be served
+    // together. With `dictionary_labels`, labels are stored as codes of a dictionary, see
+    // LabelDictionary. A `label_byte_count` of 0 makes labels as wide as the longest one.
+    void load_csv_db(const vector<string> &csv_db_file_paths, const string &params_json, 
+                    size_t nonce_byte_count, bool compressed, bool membership_db,
+                    bool retain_items, const string &oprf_key, size_t shard_index,
+                    size_t shard_count, bool dictionary_labels, size_t label_byte_count)
     {
+        unique_ptr<oprf::OPRFKey> key;
+        if (!oprf_key.empty()) {
+            key = make_unique<oprf::OPRFKey>(load_oprf_key(oprf_key));
+        }
+
         try
         {
-            _db = try_load_csv_db(csv_db_file_path,params_json, nonce_byte_count, compressed);
+            DBSet dbs;
+            dbs.item_store = retain_items ? make_shared<ItemStore>() : nullptr;
+            {
+                py::gil_scoped_release release;
+                OpScope scope(OpType::db_build);
+                scope.start();
+                dbs.db = try_load_csv_db(
+                    csv_db_file_paths, params_json, nonce_byte_count, compressed,
+                    membership_db ? &dbs.membership_db : nullptr, dbs.item_store.get(),
+                    key.get(), shard_index, shard_count,
+                    dictionary_labels ? &dbs.label_dictionary : nullptr, label_byte_count);
+            }
+            if (!dbs.db) {
+                throw runtime_error("try_load_csv_db returned nullptr");
+            }
+            auto lock = lock_after_rebuilds();
+            _dbs = move(dbs);
+            reset_db_state();
+            db_label_byte_count = _dbs.db->get_label_byte_count();
         }
         catch(const exception &e)
         {
@@ -288,29 +763,78 @@ public:
         }
     }
 
+    // Loads databases built as shards of the same data and serves them together
+    void load_db_shards(const vector<string> &db_file_paths)
+    {
+        DBSet dbs;
+        {
+            py::gil_scoped_release release;
+            dbs = merge_db_shards(load_db_set_files(db_file_paths));
+        }
+        {
+            auto lock = lock_after_rebuilds();
+            _dbs = move(dbs);
+            reset_db_state();
+            db_label_byte_count = _dbs.db->get_label_byte_count();
+        }
+        py::gil_scoped_release release;
+        release_free_memory();
+    }
+
+    size_t get_shard_count() const
+    {
+        auto lock = lock_state();
+        return _dbs.shard_dbs.size() + 1;
+    }
+
+    // Combines shard files into a single database file that serves all of them
+    static void merge_db_shard_files(
+        const vector<string> &db_file_paths, const string &output_file_path)
+    {
+        py::gil_scoped_release release;
+        save_db_set_to_file(output_file_path, merge_db_shards(load_db_set_files(db_file_paths)));
+    }
+
     std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> uid_xored_label_table;
 
     void load_csv_uid_db(
         const std::string &csv_db_file_path,
         const std::string &params_json,
         size_t nonce_byte_count,
-        bool compressed)
+        bool compressed,
+        bool retain_items,
+        const std::string &mask_mode)
     {
         try {
-            uid_xored_label_table.clear();
-
-            _db = try_load_csv_uid_db(
-                csv_db_file_path,
-                params_json,
-                nonce_byte_count,
-                compressed,
-                uid_xored_label_table
-            );
+            std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> uid_table;
+            UIDMaskMode mode = uid_mask_mode_from_string(mask_mode);
+
+            DBSet dbs;
+            dbs.item_store = retain_items ? make_shared<ItemStore>() : nullptr;
+            dbs.uid_mask_mode = mode;
+            {
+                py::gil_scoped_release release;
+                OpScope scope(OpType::db_build);
+                scope.start();
+                dbs.db = try_load_csv_uid_db(
+                    csv_db_file_path,
+                    params_json,
+                    nonce_byte_count,
+                    compressed,
+                    uid_table,
+                    dbs.item_store.get(),
+                    mode
+                );
+            }
 
-            if (!_db) {
+            if (!dbs.db) {
                 throw std::runtime_error("try_load_csv_uid_db returned nullptr");
             }
-            db_label_byte_count = _db->get_label_byte_count();
+            auto lock = lock_after_rebuilds();
+            _dbs = move(dbs);
+            reset_db_state();
+            uid_xored_label_table = move(uid_table);
+            db_label_byte_count = _dbs.db->get_label_byte_count();
         }
         catch (const std::exception &e) {
             APSI_LOG_ERROR("load_csv_uid_db failed: " << e.what());
@@ -322,78 +846,1215 @@ public:
 
     void add_item(const string &input_item, const string &input_label)
     {
-        Item item(input_item);
-
-        if (input_label.length() > 0)
-        {
-            vector<unsigned char> label(input_label.begin(), input_label.end());
-            _db->insert_or_assign(make_pair(item, label));
-        }
-        else
-        {
-            _db->insert_or_assign(item);
-        }
+        OpScope scope(OpType::db_build);
+        auto lock = lock_for_update();
+        scope.start();
+        apply_updates({ { UpdateLog::Op::insert, input_item, input_label } });
     }
 
     void add_unlabeled_items(const py::list &input_items)
     {
-        vector<Item> items;
+        vector<UpdateLog::Record> records;
         for (py::handle item : input_items) {
-            items.push_back(item.cast<std::string>());
+            records.push_back({ UpdateLog::Op::insert, item.cast<std::string>(), string() });
         }
-        _db->insert_or_assign(items);
+        OpScope scope(OpType::db_build);
+        auto lock = lock_for_update();
+        scope.start();
+        apply_updates(records);
     }
 
     void add_labeled_items(const py::iterable &input_items_with_label)
     {
-        vector<pair<Item,Label>> items_with_label;
+        vector<UpdateLog::Record> records;
         for (py::handle handler : input_items_with_label){
             py::tuple py_tup = handler.cast<py::tuple>();
             if(py::len(py_tup)!=2){
                 throw runtime_error("data error, item_with_label should be a tuple with size 2.");
             }
-            string label_str = py_tup[1].cast<string>();
-            items_with_label.push_back(make_pair(
-                    Item(py_tup[0].cast<string>()),
-                    Label(label_str.begin(), label_str.end())
-            ));
+            records.push_back(
+                { UpdateLog::Op::insert, py_tup[0].cast<string>(), py_tup[1].cast<string>() });
+        }
+        OpScope scope(OpType::db_build);
+        auto lock = lock_for_update();
+        scope.start();
+        apply_updates(records);
+    }
+
+    // Adds items to a UID database (see load_csv_uid_db): every item gets the next UID and its
+    // label is masked into uid_xored_label_table. Only the new items are hashed and masked; the
+    // database is only rebuilt when the UIDs need another byte, which requires an item store.
+    // Neither the UID table rows nor a widening rebuild are update records, so appends are
+    // rejected while an update log or change tracking is active; save a new snapshot instead.
+    void append_uid_items(const py::iterable &input_items_with_label)
+    {
+        vector<pair<string, string>> rows;
+        for (py::handle handler : input_items_with_label) {
+            py::tuple py_tup = handler.cast<py::tuple>();
+            if (py::len(py_tup) != 2) {
+                throw runtime_error("data error, item_with_label should be a tuple with size 2.");
+            }
+            rows.emplace_back(py_tup[0].cast<string>(), py_tup[1].cast<string>());
+        }
+
+        OpScope scope(OpType::db_build);
+        auto lock = lock_for_update();
+        scope.start();
+        if (uid_xored_label_table.empty()) {
+            throw runtime_error("Not a UID database; load one with load_csv_uid_db");
+        }
+        if (_update_log || _journal) {
+            throw runtime_error(
+                "UID items are not recorded in update logs or deltas; append them before "
+                "opening an update log or starting change tracking, and save the database");
+        }
+        if (rows.empty()) {
+            return;
+        }
+        // A rebuild copies the UID table when it starts and replaces it when it is swapped in
+        require_no_rebuild();
+
+        size_t uid_byte_count = _dbs.db->get_label_byte_count();
+        if (get_byte_count(uid_xored_label_table.size() + rows.size()) > uid_byte_count) {
+            if (!_dbs.item_store) {
+                throw runtime_error(
+                    "The UIDs need another byte, which requires an item store; load the "
+                    "database with retain_items=True");
+            }
+            if (_retired_dbs) {
+                throw runtime_error("Retire the previous OPRF key before the UIDs get wider");
+            }
+            fold_write_buffer();
+
+            uid_byte_count = get_byte_count(uid_xored_label_table.size() + rows.size());
+            {
+                py::gil_scoped_release release;
+                _dbs = widen_uid_db_set(_dbs, uid_byte_count);
+            }
+            db_label_byte_count = uid_byte_count;
+            APSI_LOG_INFO("Widened UIDs to " << uid_byte_count << " bytes");
+        }
+
+        vector<vector<uint8_t>> uids;
+        {
+            py::gil_scoped_release release;
+            uids = append_uid_rows(
+                uid_xored_label_table, rows, _dbs.db->get_oprf_key(), uid_byte_count,
+                _dbs.uid_mask_mode);
+            if (_retired_dbs) {
+                // The tables have the same rows, so the new rows get the same UIDs in both
+                append_uid_rows(
+                    _retired_uid_table, rows, _retired_dbs->db->get_oprf_key(), uid_byte_count,
+                    _retired_dbs->uid_mask_mode);
+            }
+        }
+
+        vector<UpdateLog::Record> records;
+        records.reserve(rows.size());
+        for (size_t i = 0; i < rows.size(); i++) {
+            records.push_back(
+                { UpdateLog::Op::insert, rows[i].first, string(uids[i].begin(), uids[i].end()) });
+        }
+        apply_updates(records);
+    }
+
+    void remove_items(const py::list &input_items)
+    {
+        vector<UpdateLog::Record> records;
+        for (py::handle item : input_items) {
+            records.push_back({ UpdateLog::Op::remove, item.cast<std::string>(), string() });
+        }
+        OpScope scope(OpType::db_build);
+        auto lock = lock_for_update();
+        scope.start();
+        apply_updates(records);
+    }
+
+    // Appends all following updates to a log file, so that they are durable without saving the
+    // whole database. Records are synced to disk in batches of `sync_every`.
+    void open_update_log(const string &log_file_path, size_t sync_every)
+    {
+        auto lock = lock_state();
+        _update_log.reset();
+        _update_log = make_unique<UpdateLog>(log_file_path, sync_every);
+    }
+
+    void sync_update_log()
+    {
+        auto lock = lock_state();
+        if (_update_log) {
+            _update_log->sync();
+        }
+    }
+
+    void close_update_log()
+    {
+        auto lock = lock_state();
+        _update_log.reset();
+    }
+
+    // Applies the updates of a log file, e.g. on top of the snapshot it was written against.
+    size_t replay_update_log(const string &log_file_path)
+    {
+        auto lock = lock_for_update();
+        const size_t batch_size = 4096;
+        vector<UpdateLog::Record> batch;
+        size_t count = UpdateLog::Replay(log_file_path, [&](const UpdateLog::Record &record) {
+            batch.push_back(record);
+            if (batch.size() == batch_size) {
+                apply_updates(batch, false);
+                batch.clear();
+            }
+        });
+        apply_updates(batch, false);
+
+        APSI_LOG_INFO("Replayed " << count << " updates from `" << log_file_path << "`");
+        return count;
+    }
+
+    // Folds the update log into a new snapshot in the background. The log continues in a fresh
+    // file right away; its previous records are kept in `<log>.compacting` until the snapshot
+    // is written, so a crash at any point can be recovered by loading the latest snapshot and
+    // replaying `<log>.compacting` and `<log>`.
+    void start_compaction(const string &snapshot_path)
+    {
+        auto lock = lock_for_update();
+        if (!_update_log) {
+            throw runtime_error("No update log is open");
+        }
+        if (_compaction.valid() &&
+            _compaction.wait_for(chrono::seconds(0)) != future_status::ready) {
+            throw runtime_error("A compaction is already running");
+        }
+
+        string rotated_path = _update_log->path() + ".compacting";
+        _update_log->rotate(rotated_path);
+        fold_write_buffer();
+
+        // The snapshot has to match the rotated log exactly, so changes wait until it is
+        // written, see pin_db_snapshot
+        _snapshot_pinned = true;
+        DBSet dbs = _dbs;
+        _compaction = async(
+            launch::async, [this, dbs = move(dbs), snapshot_path, rotated_path]() mutable {
+                DBSet snapshot = move(dbs);
+                try {
+                    save_db_set_to_file(snapshot_path, snapshot);
+                } catch (...) {
+                    unpin_db_snapshot();
+                    throw;
+                }
+                // Before unpinning, as the next compaction rotates the log to the same path
+                remove(rotated_path.c_str());
+                unpin_db_snapshot();
+                APSI_LOG_INFO("Compacted update log into snapshot `" << snapshot_path << "`");
+            });
+    }
+
+    bool is_compacting() const
+    {
+        auto lock = lock_state();
+        return _compaction.valid() &&
+               _compaction.wait_for(chrono::seconds(0)) != future_status::ready;
+    }
+
+    // Waits for the compaction without the state lock, so that queries go on meanwhile
+    void wait_for_compaction()
+    {
+        future<void> compaction;
+        {
+            auto lock = lock_state();
+            compaction = move(_compaction);
+        }
+        if (compaction.valid()) {
+            py::gil_scoped_release release;
+            compaction.get();
         }
-        _db->insert_or_assign(items_with_label);
     }
 
-    py::bytes handle_oprf_request(const string &oprf_request_string)
+    // Keeps up to `max_items` newly inserted items in small databases of their own, which are
+    // encoded again for every update batch that changes them and published as a whole. Inserts
+    // then do not wait for running queries, except when the buffer is full and its items are
+    // moved into the databases. Changes to items already in the databases are applied to them
+    // directly. Those happen in place, so a query running meanwhile may find a moved item both
+    // in the databases and in the buffer it started with; APSIClient then takes the buffer's
+    // match. A size of 0 turns the buffer off.
+    void set_write_buffer_size(size_t max_items)
     {
-        _channel.set_in_buffer(oprf_request_string);
+        auto lock = lock_for_update();
+        if (!_dbs.shard_dbs.empty()) {
+            throw runtime_error("Sharded databases cannot be updated; rebuild the shards instead");
+        }
+        _write_buffer_size = max_items;
+        if (!max_items || (_write_buffer && _write_buffer->items.size() >= max_items)) {
+            fold_write_buffer();
+        }
+    }
 
-        OPRFRequest oprf_request2 = to_oprf_request(_channel.receive_operation(
-            nullptr,
-            network::SenderOperationType::sop_oprf));
-        Sender::RunOPRF(oprf_request2, _db->get_oprf_key(), _channel);
-        return py::bytes(_channel.extract_out_buffer());
+    size_t get_write_buffer_size() const
+    {
+        auto lock = lock_state();
+        return _write_buffer_size;
     }
 
-    py::bytes handle_query(const string &query_string)
+    size_t get_buffered_item_count() const
     {
-        _channel.set_in_buffer(query_string);
+        auto lock = lock_state();
+        return _write_buffer ? _write_buffer->items.size() : 0;
+    }
 
-        QueryRequest sender_query = to_query_request(_channel.receive_operation(
-            _db->get_seal_context(),
-            network::SenderOperationType::sop_query));
-        Query query(move(sender_query), _db);
+    // Moves the items of the write buffer into the databases. This waits for running queries on
+    // them to finish.
+    void flush_write_buffer()
+    {
+        auto lock = lock_for_update();
+        fold_write_buffer();
+    }
 
-        Sender::RunQuery(query, _channel);
-        return py::bytes(_channel.extract_out_buffer());
+    uint64_t get_db_version() const
+    {
+        auto lock = lock_state();
+        return _dbs.version;
     }
 
-public:
-    size_t db_label_byte_count;
+    // Keeps track of all following changes, so that replicas can be brought up to date with
+    // deltas instead of full copies of the database
+    void start_change_tracking()
+    {
+        auto lock = lock_state();
+        _journal = make_unique<ChangeJournal>(_dbs.version);
+    }
 
-private:
-    shared_ptr<SenderDB> _db;
-    StringStreamChannel _channel;
-};
+    bool is_tracking_changes() const
+    {
+        auto lock = lock_state();
+        return static_cast<bool>(_journal);
+    }
 
-PYBIND11_MODULE(_pyapsi, m)
+    py::bytes export_delta(uint64_t from_version)
+    {
+        auto lock = lock_state();
+        if (!_journal) {
+            throw runtime_error("Changes are not tracked");
+        }
+        if (from_version > _dbs.version) {
+            throw out_of_range("The version is newer than the database");
+        }
+        return py::bytes(_journal->export_delta(from_version, _dbs.version));
+    }
+
+    // Applies a delta exported by another server whose data this database is a copy of. Deltas
+    // carry the latest state of every changed item, so any delta starting at or before the
+    // version of this database brings it up to the delta's version. Returns false if the
+    // database already is at least as new as the delta.
+    bool apply_delta(const string &delta)
+    {
+        auto lock = lock_for_update();
+        uint64_t from_version, to_version;
+        vector<UpdateLog::Record> records;
+        ChangeJournal::ParseDelta(delta, from_version, to_version, records);
+
+        if (from_version > _dbs.version) {
+            throw runtime_error(
+                "The delta starts at version " + to_string(from_version) +
+                " but the database is at version " + to_string(_dbs.version));
+        }
+        if (to_version <= _dbs.version) {
+            return false;
+        }
+
+        apply_updates(records, true, to_version);
+        return true;
+    }
+
+    void discard_changes(uint64_t up_to_version)
+    {
+        auto lock = lock_state();
+        if (_journal) {
+            _journal->discard(up_to_version);
+        }
+    }
+
+    py::bytes handle_oprf_request(
+        const string &oprf_request_string, uint32_t key_version, size_t thread_count)
+    {
+        OpScope scope(OpType::oprf);
+        shared_ptr<SenderDB> db;
+        {
+            auto lock = lock_state();
+            db = get_db_set(key_version).db;
+        }
+        scope.start();
+        string response;
+        {
+            py::gil_scoped_release release;
+            ThreadBudget budget(
+                OpType::oprf, thread_count, oprf_request_string.size() / oprf::oprf_query_size);
+            oprf::OPRFKey oprf_key = db->get_oprf_key();
+            StringStreamChannel channel;
+            channel.set_in_buffer(oprf_request_string);
+
+            OPRFRequest oprf_request2 = to_oprf_request(channel.receive_operation(
+                nullptr,
+                network::SenderOperationType::sop_oprf));
+            auto response_oprf = make_unique<network::SenderOperationResponseOPRF>();
+            response_oprf->data =
+                process_oprf_queries(oprf_request2->data, oprf_key, budget.thread_count());
+            channel.send(move(response_oprf));
+            response = channel.extract_out_buffer();
+        }
+        return py::bytes(response);
+    }
+
+    py::bytes handle_query(const string &query_string, size_t params_index, uint32_t key_version)
+    {
+        OpScope scope(OpType::query);
+        auto dbs = get_query_dbs(key_version, params_index, false);
+        scope.start();
+        return run_query(query_string, dbs);
+    }
+
+    py::bytes handle_membership_query(const string &query_string, uint32_t key_version)
+    {
+        OpScope scope(OpType::query);
+        auto dbs = get_query_dbs(key_version, 0, true);
+        scope.start();
+        return run_query(query_string, dbs);
+    }
+
+    // Answers a query like handle_query but returns the number of result parts and their
+    // serialization without a response header, so that the parts of several servers holding
+    // shards of a database can be combined into one response, see query_response_header
+    py::tuple handle_query_parts(
+        const string &query_string, size_t params_index, uint32_t key_version)
+    {
+        OpScope scope(OpType::query);
+        auto dbs = get_query_dbs(key_version, params_index, false);
+        scope.start();
+        pair<uint32_t, vector<string>> parts;
+        {
+            py::gil_scoped_release release;
+            parts = run_query_parts(query_string, dbs);
+        }
+        return py::make_tuple(parts.first, join_buffers(parts.second));
+    }
+
+    static py::bytes query_response_header(uint32_t package_count)
+    {
+        return py::bytes(make_query_response_header(package_count));
+    }
+
+    uint32_t get_key_version() const
+    {
+        auto lock = lock_state();
+        return _dbs.key_version;
+    }
+
+    // Returns the key version still served next to the current one, or -1 if there is none
+    int64_t get_retired_key_version() const
+    {
+        auto lock = lock_state();
+        return _retired_dbs ? static_cast<int64_t>(_retired_dbs->key_version) : -1;
+    }
+
+    // Starts encoding all databases again under a new OPRF key in the background. Requests are
+    // answered with the current key until finish_key_rotation switches over; updates made in
+    // the meantime are applied to the new databases before that.
+    void start_key_rotation()
+    {
+        auto lock = lock_state();
+        if (!_dbs.item_store) {
+            throw runtime_error("Rotating the OPRF key requires an item store");
+        }
+        require_no_rebuild();
+
+        DBSet dbs = _dbs;
+        auto uid_table = make_shared<vector<pair<vector<uint8_t>, vector<uint8_t>>>>(
+            uid_xored_label_table);
+        _rebuild_backlog.clear();
+        UIDMaskMode mask_mode = _dbs.uid_mask_mode;
+        _key_rotation = async(launch::async, [dbs, uid_table, mask_mode]() {
+            OpScope scope(OpType::db_build);
+            scope.start();
+            RotatedDBSet rotated;
+            rotated.dbs = rebuild_db_set(dbs, oprf::OPRFKey());
+            if (!uid_table->empty()) {
+                remask_uid_table(
+                    *uid_table, dbs.item_store->to_db_data(true), dbs.db->get_oprf_key(),
+                    rotated.dbs.db->get_oprf_key(), mask_mode);
+            }
+            rotated.uid_table = uid_table;
+            return rotated;
+        }).share();
+    }
+
+    bool is_rotating_key() const
+    {
+        auto lock = lock_state();
+        return _key_rotation.valid();
+    }
+
+    bool is_key_rotation_ready() const
+    {
+        auto lock = lock_state();
+        return _key_rotation.valid() &&
+               _key_rotation.wait_for(chrono::seconds(0)) == future_status::ready;
+    }
+
+    // Waits for the background rebuild without the state lock and switches to the new OPRF key.
+    // The previous key keeps being served until retire_key, so that queries whose OPRF step used
+    // it complete.
+    void finish_key_rotation()
+    {
+        auto lock = lock_for_update_after(_key_rotation, "No key rotation is running");
+        RotatedDBSet rotated;
+        try {
+            rotated = _key_rotation.get();
+        } catch (...) {
+            _key_rotation = {};
+            _rebuild_backlog.clear();
+            throw;
+        }
+        _key_rotation = {};
+
+        apply_to_db_set(rotated.dbs, _rebuild_backlog);
+        _rebuild_backlog.clear();
+        fold_write_buffer();
+        rotated.dbs.version = _dbs.version;
+
+        _retired_dbs = make_unique<DBSet>(move(_dbs));
+        _dbs = move(rotated.dbs);
+        _retired_uid_table = move(uid_xored_label_table);
+        uid_xored_label_table = move(*rotated.uid_table);
+        APSI_LOG_INFO("Rotated OPRF key to version " << _dbs.key_version);
+    }
+
+    // Stops answering requests for the previous OPRF key
+    void retire_key()
+    {
+        auto lock = lock_state();
+        _retired_dbs.reset();
+        _retired_uid_table = {};
+    }
+
+    double get_packing_rate() const
+    {
+        auto lock = lock_state();
+        return _dbs.db->get_packing_rate();
+    }
+
+    // Packing statistics of the primary database for every bundle index
+    py::list get_bundle_stats() const
+    {
+        shared_ptr<SenderDB> db;
+        {
+            auto lock = lock_state();
+            db = _dbs.db;
+        }
+        vector<BundleIndexStats> stats;
+        {
+            py::gil_scoped_release release;
+            stats = ::get_bundle_stats(*db);
+        }
+
+        py::list result;
+        for (auto &index_stats : stats) {
+            py::dict d;
+            d["bundle_idx"] = index_stats.bundle_idx;
+            d["bundle_count"] = index_stats.bundle_count;
+            d["min_bundle_count"] = index_stats.min_bundle_count;
+            d["entry_count"] = index_stats.entry_count;
+            d["fill_rate"] = index_stats.fill_rate;
+            result.append(d);
+        }
+        return result;
+    }
+
+    // Starts encoding all databases again in the background, packing their items into as few
+    // bin bundles as possible. Requests are answered from the current databases until
+    // finish_repack swaps in the new ones; updates made in the meantime are applied to them
+    // before that.
+    void start_repack()
+    {
+        auto lock = lock_state();
+        if (!_dbs.item_store) {
+            throw runtime_error("Repacking a database requires an item store");
+        }
+        require_no_rebuild();
+
+        DBSet dbs = _dbs;
+        _rebuild_backlog.clear();
+        _repack = async(launch::async, [dbs]() {
+            OpScope scope(OpType::db_build);
+            scope.start();
+            return repack_db_set(dbs);
+        }).share();
+    }
+
+    bool is_repacking() const
+    {
+        auto lock = lock_state();
+        return _repack.valid();
+    }
+
+    bool is_repack_ready() const
+    {
+        auto lock = lock_state();
+        return _repack.valid() && _repack.wait_for(chrono::seconds(0)) == future_status::ready;
+    }
+
+    // Waits for the background rebuild without the state lock and swaps in the repacked
+    // databases. Queries that are running keep the databases they started with.
+    void finish_repack()
+    {
+        auto lock = lock_for_update_after(_repack, "No repack is running");
+        DBSet repacked;
+        try {
+            repacked = _repack.get();
+        } catch (...) {
+            _repack = {};
+            _rebuild_backlog.clear();
+            throw;
+        }
+        _repack = {};
+
+        apply_to_db_set(repacked, _rebuild_backlog);
+        _rebuild_backlog.clear();
+        repacked.version = _dbs.version;
+
+        // The item store the databases were encoded from holds the buffered items as well
+        _write_buffer.reset();
+        double packing_rate = _dbs.db->get_packing_rate();
+        _dbs = move(repacked);
+        APSI_LOG_INFO(
+            "Repacked database; packing rate: " << packing_rate << " -> "
+                                                << _dbs.db->get_packing_rate());
+    }
+
+    vector<pair<vector<uint8_t>, vector<uint8_t>>> get_uid_xored_label_table() const
+    {
+        auto lock = lock_state();
+        return uid_xored_label_table;
+    }
+
+    // The UID table masked for the OPRF key of a key version; during the window after a key
+    // rotation, clients whose OPRF step used the previous key need the table masked for it
+    vector<pair<vector<uint8_t>, vector<uint8_t>>> get_key_version_uid_table(
+        uint32_t key_version)
+    {
+        auto lock = lock_state();
+        return &get_db_set(key_version) == &_dbs ? uid_xored_label_table : _retired_uid_table;
+    }
+
+    void set_uid_xored_label_table(vector<pair<vector<uint8_t>, vector<uint8_t>>> table)
+    {
+        auto lock = lock_state();
+        require_no_rebuild();
+        uid_xored_label_table = move(table);
+    }
+
+    string get_uid_mask_mode() const
+    {
+        auto lock = lock_state();
+        return to_string(_dbs.uid_mask_mode);
+    }
+
+    size_t get_db_label_byte_count() const
+    {
+        auto lock = lock_state();
+        return db_label_byte_count;
+    }
+
+public:
+    size_t db_label_byte_count = 0;
+
+private:
+    // Newly inserted items kept in small databases of their own, see set_write_buffer_size.
+    // Every update batch publishes a new buffer, so queries keep the version they started with.
+    struct WriteBuffer {
+        DBSet dbs;
+        map<string, string> items;
+    };
+
+    // Applies a batch of updates to the primary database and everything kept next to it, and
+    // appends it to the update log if one is open. Only applied batches are logged, so that a
+    // rejected batch does not make the log fail on every replay.
+    void apply_updates(
+        const vector<UpdateLog::Record> &raw_records, bool log = true, uint64_t version = 0)
+    {
+        if (raw_records.empty()) {
+            return;
+        }
+        if (!_dbs.shard_dbs.empty()) {
+            throw runtime_error("Sharded databases cannot be updated; rebuild the shards instead");
+        }
+
+        // Logs and deltas carry the raw labels, the databases and the item store their codes
+        vector<UpdateLog::Record> encoded_records;
+        const auto &records = _dbs.label_dictionary
+                                  ? (encoded_records = encode_labels(raw_records))
+                                  : raw_records;
+        check_label_sizes(records);
+
+        apply_to_db_set(_dbs, _write_buffer_size ? buffer_updates(records) : records);
+        if (_retired_dbs) {
+            apply_to_db_set(*_retired_dbs, records);
+        }
+        if (_dbs.item_store) {
+            for (auto &record : records) {
+                if (record.op == UpdateLog::Op::insert) {
+                    _dbs.item_store->insert_or_assign(record.item, record.label);
+                } else {
+                    _dbs.item_store->remove(record.item);
+                }
+            }
+        }
+        if (_key_rotation.valid() || _repack.valid()) {
+            _rebuild_backlog.insert(_rebuild_backlog.end(), records.begin(), records.end());
+        }
+
+        if (log && _update_log) {
+            _update_log->append(raw_records);
+        }
+        _dbs.version = version ? version : _dbs.version + 1;
+        if (_journal) {
+            _journal->record(raw_records, _dbs.version);
+        }
+    }
+
+    // Rejects a batch with labels that do not fit the databases before any of it is applied
+    void check_label_sizes(const vector<UpdateLog::Record> &records) const
+    {
+        if (!_dbs.db->is_labeled()) {
+            return;
+        }
+        size_t label_byte_count = _dbs.db->get_label_byte_count();
+        for (auto &record : records) {
+            if (record.op == UpdateLog::Op::insert && record.label.size() > label_byte_count) {
+                throw invalid_argument(
+                    "Label of " + to_string(record.label.size()) + " bytes exceeds the " +
+                    to_string(label_byte_count) + " bytes of the database");
+            }
+        }
+    }
+
+    // Replaces the labels of inserts with their codes in the label dictionary
+    vector<UpdateLog::Record> encode_labels(const vector<UpdateLog::Record> &records)
+    {
+        vector<UpdateLog::Record> encoded = records;
+        for (auto &record : encoded) {
+            if (record.op == UpdateLog::Op::insert) {
+                record.label = _dbs.label_dictionary->encode(record.label);
+            }
+        }
+        return encoded;
+    }
+
+    // Takes inserts of new items and all changes to buffered items into a new write buffer and
+    // returns the remaining updates, which have to be applied to the databases themselves. Once
+    // the buffer is full, its items are returned as well and the buffer is emptied.
+    vector<UpdateLog::Record> buffer_updates(const vector<UpdateLog::Record> &records)
+    {
+        auto items = _write_buffer ? _write_buffer->items : map<string, string>();
+        bool changed = false;
+        vector<UpdateLog::Record> remaining;
+        for (auto &record : records) {
+            auto it = items.find(record.item);
+            if (it != items.end()) {
+                if (record.op == UpdateLog::Op::insert) {
+                    it->second = record.label;
+                } else {
+                    items.erase(it);
+                }
+                changed = true;
+            } else if (
+                record.op == UpdateLog::Op::insert && !_dbs.db->has_item(Item(record.item))) {
+                items.emplace(record.item, record.label);
+                changed = true;
+            } else {
+                remaining.push_back(record);
+            }
+        }
+
+        if (items.size() >= _write_buffer_size) {
+            for (auto &item : items) {
+                remaining.push_back({ UpdateLog::Op::insert, item.first, item.second });
+            }
+            items.clear();
+        }
+        // Batches that only change the databases keep the encoded buffer
+        if (changed || items.empty()) {
+            _write_buffer = items.empty() ? nullptr : make_write_buffer(_dbs, move(items));
+        }
+        return remaining;
+    }
+
+    // Encodes buffered items in empty databases like those of `dbs`. This costs time in the
+    // number of buffered items, which is why the buffer is kept small.
+    static shared_ptr<const WriteBuffer> make_write_buffer(
+        const DBSet &dbs, map<string, string> items)
+    {
+        auto empty_like = [](const SenderDB &db) {
+            return make_shared<SenderDB>(
+                db.get_params(), db.get_oprf_key(), db.get_label_byte_count(),
+                db.get_nonce_byte_count(), db.is_compressed());
+        };
+
+        auto buffer = make_shared<WriteBuffer>();
+        buffer->dbs.db = empty_like(*dbs.db);
+        if (dbs.membership_db) {
+            buffer->dbs.membership_db = empty_like(*dbs.membership_db);
+        }
+        for (auto &param_db : dbs.param_dbs) {
+            buffer->dbs.param_dbs.push_back(empty_like(*param_db));
+        }
+
+        vector<UpdateLog::Record> records;
+        for (auto &item : items) {
+            records.push_back({ UpdateLog::Op::insert, item.first, item.second });
+        }
+        apply_to_db_set(buffer->dbs, records);
+        buffer->items = move(items);
+        return buffer;
+    }
+
+    // Locks the state of the server. The GIL is released while waiting for the lock, as in
+    // APSIClient, so that the thread holding the lock can always get the GIL back; without a GIL,
+    // e.g. on free-threaded Python builds, the lock alone keeps concurrent calls apart.
+    unique_lock<mutex> lock_state() const
+    {
+        py::gil_scoped_release release;
+        return unique_lock<mutex>(_state_mutex);
+    }
+
+    // Locks the state of the server for changing the databases. While a snapshot of them is
+    // pinned, the change waits for it without holding the lock, so that queries go on.
+    unique_lock<mutex> lock_for_update()
+    {
+        py::gil_scoped_release release;
+        unique_lock<mutex> lock(_state_mutex);
+        _snapshot_unpinned.wait(lock, [this]() { return !_snapshot_pinned; });
+        return lock;
+    }
+
+    // Locks the state of the server for changing the databases once `rebuild` is done. The
+    // rebuild is waited for without the lock, so that queries go on meanwhile.
+    template <typename T>
+    unique_lock<mutex> lock_for_update_after(const shared_future<T> &rebuild, const char *error)
+    {
+        while (true) {
+            shared_future<T> running;
+            {
+                auto lock = lock_for_update();
+                if (!rebuild.valid()) {
+                    throw runtime_error(error);
+                }
+                if (rebuild.wait_for(chrono::seconds(0)) == future_status::ready) {
+                    return lock;
+                }
+                running = rebuild;
+            }
+            py::gil_scoped_release release;
+            running.wait();
+        }
+    }
+
+    // Locks the state of the server for replacing the databases once no rebuild of them is
+    // running anymore. As in lock_for_update_after, rebuilds are waited for without the lock.
+    unique_lock<mutex> lock_after_rebuilds()
+    {
+        auto is_done = [](const auto &rebuild) {
+            return !rebuild.valid() ||
+                   rebuild.wait_for(chrono::seconds(0)) == future_status::ready;
+        };
+        while (true) {
+            shared_future<RotatedDBSet> key_rotation;
+            shared_future<DBSet> repack;
+            {
+                auto lock = lock_state();
+                if (is_done(_key_rotation) && is_done(_repack)) {
+                    return lock;
+                }
+                key_rotation = _key_rotation;
+                repack = _repack;
+            }
+            py::gil_scoped_release release;
+            if (key_rotation.valid()) {
+                key_rotation.wait();
+            }
+            if (repack.valid()) {
+                repack.wait();
+            }
+        }
+    }
+
+    // Returns the databases, with the write buffer folded in, for saving them without the state
+    // lock. They are shared with the server, so changing them waits until the snapshot is
+    // unpinned, see lock_for_update. Only one snapshot is pinned at a time.
+    DBSet pin_db_snapshot()
+    {
+        auto lock = lock_for_update();
+        fold_write_buffer();
+        _snapshot_pinned = true;
+        return _dbs;
+    }
+
+    // Called without the GIL, possibly from a background thread
+    void unpin_db_snapshot()
+    {
+        {
+            lock_guard<mutex> lock(_state_mutex);
+            _snapshot_pinned = false;
+        }
+        _snapshot_unpinned.notify_all();
+    }
+
+    // Moves the items of the write buffer into the databases
+    void fold_write_buffer()
+    {
+        if (!_write_buffer) {
+            return;
+        }
+        vector<UpdateLog::Record> records;
+        for (auto &item : _write_buffer->items) {
+            records.push_back({ UpdateLog::Op::insert, item.first, item.second });
+        }
+        apply_to_db_set(_dbs, records);
+        _write_buffer.reset();
+    }
+
+    // Applies a batch of updates to the primary database of `dbs` and all databases kept next to
+    // it, but not to its item store
+    static void apply_to_db_set(DBSet &dbs, const vector<UpdateLog::Record> &records)
+    {
+        // Only the last update of every item counts, so that every item is changed at most once
+        // and the checks below see the state it had before the batch
+        unordered_map<string, size_t> last_update;
+        for (size_t i = 0; i < records.size(); i++) {
+            last_update[records[i].item] = i;
+        }
+
+        bool labeled = dbs.db->is_labeled();
+        vector<pair<Item, Label>> items_with_label;
+        vector<Item> items;
+        vector<Item> removed_items;
+        for (size_t i = 0; i < records.size(); i++) {
+            auto &record = records[i];
+            if (last_update[record.item] != i) {
+                continue;
+            }
+            Item item(record.item);
+            if (record.op == UpdateLog::Op::insert) {
+                if (labeled) {
+                    items_with_label.emplace_back(
+                        item, Label(record.label.begin(), record.label.end()));
+                }
+                items.push_back(item);
+            } else if (dbs.db->has_item(item)) {
+                // Removing an item that is not present is a no-op, so that logs can be replayed
+                // on top of snapshots that already contain some of their updates.
+                removed_items.push_back(item);
+            }
+        }
+
+        // Applies a change to the primary database and all of its encodings under other
+        // parameters. The removed and inserted items are distinct, so their order does not
+        // matter.
+        auto for_each_db = [&](auto &&fun) {
+            fun(*dbs.db);
+            for (auto &param_db : dbs.param_dbs) {
+                fun(*param_db);
+            }
+        };
+        if (!removed_items.empty()) {
+            for_each_db([&](SenderDB &db) { db.remove(removed_items); });
+            if (dbs.membership_db) {
+                dbs.membership_db->remove(removed_items);
+            }
+        }
+        if (labeled && !items_with_label.empty()) {
+            for_each_db([&](SenderDB &db) { db.insert_or_assign(items_with_label); });
+        }
+        if (!items.empty()) {
+            if (!labeled) {
+                for_each_db([&](SenderDB &db) { db.insert_or_assign(items); });
+            }
+            if (dbs.membership_db) {
+                dbs.membership_db->insert_or_assign(items);
+            }
+        }
+    }
+
+    // Drops everything that refers to the databases replaced by init_db or a load. Called with
+    // the lock from lock_after_rebuilds, so dropping the rebuilds does not wait for them.
+    void reset_db_state()
+    {
+        _key_rotation = {};
+        _repack = {};
+        _rebuild_backlog.clear();
+        _write_buffer.reset();
+        _retired_dbs.reset();
+        _retired_uid_table = {};
+        _journal.reset();
+    }
+
+    void require_no_rebuild() const
+    {
+        if (_key_rotation.valid()) {
+            throw runtime_error("The databases cannot be changed during a key rotation");
+        }
+        if (_repack.valid()) {
+            throw runtime_error("The databases cannot be changed during a repack");
+        }
+    }
+
+    // Returns the databases answering requests for an OPRF key version
+    DBSet &get_db_set(uint32_t key_version)
+    {
+        if (key_version == _dbs.key_version) {
+            return _dbs;
+        }
+        if (_retired_dbs && key_version == _retired_dbs->key_version) {
+            return *_retired_dbs;
+        }
+        throw invalid_argument("unknown OPRF key version " + to_string(key_version));
+    }
+
+    // The databases answering a query, including those of the write buffer. The returned
+    // pointers keep them alive, so the query can run without the GIL while updates publish new
+    // versions of the write buffer or replace the databases.
+    vector<shared_ptr<SenderDB>> get_query_dbs(
+        uint32_t key_version, size_t params_index, bool membership)
+    {
+        auto lock = lock_state();
+        auto &dbs = get_db_set(key_version);
+        auto query_dbs = select_dbs(dbs, params_index, membership);
+        if (_write_buffer && &dbs == &_dbs) {
+            auto buffer_dbs = select_dbs(_write_buffer->dbs, params_index, membership);
+            query_dbs.insert(query_dbs.end(), buffer_dbs.begin(), buffer_dbs.end());
+        }
+        return query_dbs;
+    }
+
+    static vector<shared_ptr<SenderDB>> select_dbs(
+        const DBSet &dbs, size_t params_index, bool membership)
+    {
+        if (membership) {
+            if (!dbs.membership_db) {
+                throw runtime_error("No membership database was initialized");
+            }
+            return { dbs.membership_db };
+        }
+        if (params_index > dbs.param_dbs.size()) {
+            throw out_of_range("params index out of range");
+        }
+        if (params_index) {
+            return { dbs.param_dbs[params_index - 1] };
+        }
+        return get_primary_dbs(dbs);
+    }
+
+    // Answers a query against one or more databases with the same parameters and OPRF key. Each
+    // database contributes the result parts of its own bin bundles; to the client they look like
+    // parts of further bin bundles, so they are all sent in a single response. The GIL is
+    // released while the query runs.
+    static py::bytes run_query(const string &query_string, const vector<shared_ptr<SenderDB>> &dbs)
+    {
+        vector<string> buffers;
+        {
+            py::gil_scoped_release release;
+            auto [package_count, parts] = run_query_parts(query_string, dbs);
+            buffers.reserve(parts.size() + 1);
+            buffers.push_back(make_query_response_header(package_count));
+            move(parts.begin(), parts.end(), back_inserter(buffers));
+        }
+        return join_buffers(buffers);
+    }
+
+    // Multiplies the blinded items of an OPRF request with the OPRF key, like APSI's
+    // OPRFSender::ProcessQueries, but with `thread_count` workers instead of one per thread of
+    // the pool
+    static vector<unsigned char> process_oprf_queries(
+        const vector<unsigned char> &queries, const oprf::OPRFKey &oprf_key, size_t thread_count)
+    {
+        if (queries.size() % oprf::oprf_query_size) {
+            throw invalid_argument("OPRF request has an invalid size");
+        }
+        size_t query_count = queries.size() / oprf::oprf_query_size;
+        array<unsigned char, oprf::oprf_key_size> key;
+        oprf_key.save(key);
+
+        vector<unsigned char> responses(query_count * oprf::oprf_response_size);
+        for_each_chunk(
+            make_chunks(query_count, thread_count, min_oprf_chunk_size),
+            [&](size_t, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    oprf::ECPoint point;
+                    point.load(oprf::ECPoint::point_save_span_const_type(
+                        queries.data() + i * oprf::oprf_query_size, oprf::oprf_query_size));
+                    if (!point.scalar_multiply(key, true)) {
+                        throw invalid_argument("OPRF request holds an invalid point");
+                    }
+                    point.save(oprf::ECPoint::point_save_span_type(
+                        responses.data() + i * oprf::oprf_response_size,
+                        oprf::oprf_response_size));
+                }
+            });
+        return responses;
+    }
+
+    // Runs a query against several databases and returns the number of result parts and their
+    // serializations, without the response header announcing them. The worker threads of
+    // RunQuery serialize their result parts into buffers of their own instead of writing them to
+    // a shared channel one at a time, so serialization runs in parallel with the other workers.
+    static pair<uint32_t, vector<string>> run_query_parts(
+        const string &query_string, const vector<shared_ptr<SenderDB>> &dbs)
+    {
+        StringStreamChannel channel;
+        uint32_t package_count = 0;
+        mutex parts_mutex;
+        vector<string> parts;
+        for (auto &db : dbs) {
+            // The query is bound to the SEAL context of the database it is deserialized for
+            channel.set_in_buffer(query_string);
+            QueryRequest sender_query = to_query_request(channel.receive_operation(
+                db->get_seal_context(),
+                network::SenderOperationType::sop_query));
+            Query query(move(sender_query), db);
+
+            Sender::RunQuery(
+                query,
+                channel,
+                [&](network::Channel &, Response response) {
+                    package_count += to_query_response(move(response))->package_count;
+                },
+                [&](network::Channel &, ResultPart result_part) {
+                    ostringstream out;
+                    result_part->save(out);
+                    string part = out.str();
+
+                    lock_guard<mutex> lock(parts_mutex);
+                    parts.push_back(move(part));
+                });
+        }
+        return { package_count, move(parts) };
+    }
+
+    // Concatenates buffers into a new bytes object, copying each of them once. The copying runs
+    // without the GIL; the object is not shared with Python before it is complete.
+    static py::bytes join_buffers(const vector<string> &buffers)
+    {
+        size_t size = 0;
+        for (auto &buffer : buffers) {
+            size += buffer.size();
+        }
+        auto bytes = py::reinterpret_steal<py::bytes>(
+            PyBytes_FromStringAndSize(nullptr, static_cast<Py_ssize_t>(size)));
+        if (!bytes) {
+            throw py::error_already_set();
+        }
+
+        char *out = PyBytes_AS_STRING(bytes.ptr());
+        {
+            py::gil_scoped_release release;
+            for (auto &buffer : buffers) {
+                copy(buffer.begin(), buffer.end(), out);
+                out += buffer.size();
+            }
+        }
+        return bytes;
+    }
+
+    static string make_query_response_header(uint32_t package_count)
+    {
+        StringStreamChannel channel;
+        auto response = make_unique<network::SenderOperationResponseQuery>();
+        response->package_count = package_count;
+        channel.send(move(response));
+        return channel.extract_out_buffer();
+    }
+
+    // The primary database and all of its shards
+    static vector<shared_ptr<SenderDB>> get_primary_dbs(const DBSet &dbs)
+    {
+        vector<shared_ptr<SenderDB>> primary_dbs{ dbs.db };
+        primary_dbs.insert(primary_dbs.end(), dbs.shard_dbs.begin(), dbs.shard_dbs.end());
+        return primary_dbs;
+    }
+
+    static oprf::OPRFKey load_oprf_key(const string &oprf_key)
+    {
+        if (oprf_key.size() != oprf::oprf_key_size) {
+            throw invalid_argument(
+                "OPRF keys have " + to_string(oprf::oprf_key_size) + " bytes");
+        }
+        oprf::OPRFKey key;
+        key.load(oprf::oprf_key_span_const_type(
+            reinterpret_cast<const unsigned char *>(oprf_key.data()), oprf_key.size()));
+        return key;
+    }
+
+    // Loads several database files in parallel
+    static vector<DBSet> load_db_set_files(const vector<string> &db_file_paths)
+    {
+        vector<future<DBSet>> futures;
+        for (auto &path : db_file_paths) {
+            futures.push_back(
+                async(launch::async, [path]() { return load_db_set_from_file(path); }));
+        }
+
+        vector<DBSet> dbs;
+        for (auto &f : futures) {
+            dbs.push_back(f.get());
+        }
+        return dbs;
+    }
+
+    struct RotatedDBSet {
+        DBSet dbs;
+        shared_ptr<vector<pair<vector<uint8_t>, vector<uint8_t>>>> uid_table;
+    };
+
+    DBSet _dbs;
+    unique_ptr<DBSet> _retired_dbs;
+
+    // The UID table masked for the OPRF key of _retired_dbs
+    vector<pair<vector<uint8_t>, vector<uint8_t>>> _retired_uid_table;
+
+    shared_future<RotatedDBSet> _key_rotation;
+    shared_future<DBSet> _repack;
+
+    // Updates made while a key rotation or repack rebuilds the databases in the background
+    vector<UpdateLog::Record> _rebuild_backlog;
+    unique_ptr<UpdateLog> _update_log;
+    unique_ptr<ChangeJournal> _journal;
+
+    shared_ptr<const WriteBuffer> _write_buffer;
+    size_t _write_buffer_size = 0;
+
+    // Set while a snapshot of the databases is saved, see pin_db_snapshot
+    bool _snapshot_pinned = false;
+
+    // Guards all of the above and the public members; queries only hold it to pick their
+    // databases and run without it
+    mutable mutex _state_mutex;
+
+    condition_variable _snapshot_unpinned;
+
+    // Declared last so that they are destroyed first: the destruction waits for a running
+    // compaction or background save, which still use the members above
+    future<void> _compaction;
+    shared_future<void> _save;
+};
+
+// The module does not rely on the GIL: all state is either local to a call or guarded by the
+// mutexes of APSIClient and APSIServer. Declaring this keeps free-threaded Python builds from
+// enabling the GIL again on import.
+#if PYBIND11_VERSION_HEX >= 0x020D0000
+PYBIND11_MODULE(_pyapsi, m, py::mod_gil_not_used())
+#else
+PYBIND11_MODULE(_pyapsi, m)
+#endif
 {
     py::module utils = m.def_submodule("utils", "APSI related utilities.");
     utils.def("_set_log_level", &set_log_level,
@@ -406,32 +2067,109 @@ PYBIND11_MODULE(_pyapsi, m)
               "Set thread count for parallelization.");
     utils.def("_get_thread_count", &ThreadPoolMgr::GetThreadCount,
               "Get thread count for parallelization.");
+    utils.def("_set_thread_auto_tune", &set_thread_auto_tune,
+              "Turn auto-tuning of the thread count per kind of work on or off.");
+    utils.def("_is_thread_auto_tune", &is_thread_auto_tune,
+              "Whether the thread count is auto-tuned.");
+    utils.def("_get_thread_tuning", &get_thread_tuning_dict,
+              "Get the auto-tuned thread count per kind of work.");
+    utils.def("_get_op_stats", &get_op_stats_dict,
+              "Get call counts and times per kind of work.");
+    utils.def("_reset_op_stats", &reset_op_stats,
+              "Reset call counts and times.");
+    utils.def("_get_process_cpu_seconds", &get_process_cpu_seconds,
+              "Get CPU time used by the process.");
+    utils.def("_get_memory_usage", &get_memory_usage_dict,
+              "Get memory usage of the process.");
+    utils.def("_set_memory_tracking", &set_memory_tracking,
+              "Turn recording of database build stages on or off.");
+    utils.def("_is_memory_tracking", &is_memory_tracking,
+              "Whether database build stages are recorded.");
+    utils.def("_get_build_stage_stats", &get_build_stage_stats_list,
+              "Get memory usage of the recorded database build stages.");
+    utils.def("_clear_build_stage_stats", &clear_build_stage_stats,
+              "Clear the recorded database build stages.");
 
     py::class_<APSIServer>(m, "APSIServer")
         .def(py::init())
         .def("_init_db", &APSIServer::init_db)
+        .def("_init_membership_db", &APSIServer::init_membership_db)
+        .def("_has_membership_db", &APSIServer::has_membership_db)
+        .def("_init_item_store", &APSIServer::init_item_store)
+        .def("_has_item_store", &APSIServer::has_item_store)
+        .def("_add_params", &APSIServer::add_params)
+        .def("_get_params_count", &APSIServer::get_params_count)
+        .def("_has_label_dictionary", &APSIServer::has_label_dictionary)
+        .def("_get_label_dictionary", &APSIServer::get_label_dictionary)
+        .def("_reparameterize", &APSIServer::reparameterize)
         .def("_save_db", &APSIServer::save_db)
+        .def("_start_save", &APSIServer::start_save)
+        .def("_is_saving", &APSIServer::is_saving)
+        .def("_wait_for_save", &APSIServer::wait_for_save)
         .def("_load_db", &APSIServer::load_db)
         .def("_load_csv_db", &APSIServer::load_csv_db)
+        .def("_export_oprf_key", &APSIServer::export_oprf_key)
+        .def("_load_db_shards", &APSIServer::load_db_shards)
+        .def("_get_shard_count", &APSIServer::get_shard_count)
+        .def_static("_merge_db_shard_files", &APSIServer::merge_db_shard_files)
+        .def("_handle_query_parts", &APSIServer::handle_query_parts)
+        .def("_set_write_buffer_size", &APSIServer::set_write_buffer_size)
+        .def("_get_write_buffer_size", &APSIServer::get_write_buffer_size)
+        .def("_get_buffered_item_count", &APSIServer::get_buffered_item_count)
+        .def("_flush_write_buffer", &APSIServer::flush_write_buffer)
+        .def_static("_query_response_header", &APSIServer::query_response_header)
         .def("_load_csv_uid_db",&APSIServer::load_csv_uid_db)
-        .def_readwrite("uid_xored_label_table",
-                       &APSIServer::uid_xored_label_table)
+        .def_property("uid_xored_label_table",
+                      &APSIServer::get_uid_xored_label_table,
+                      &APSIServer::set_uid_xored_label_table)
+        .def("_get_uid_mask_mode", &APSIServer::get_uid_mask_mode)
+        .def("_get_key_version_uid_table", &APSIServer::get_key_version_uid_table)
         .def("_add_item", &APSIServer::add_item)
         .def("_add_unlabeled_items", &APSIServer::add_unlabeled_items)
         .def("_add_labeled_items", &APSIServer::add_labeled_items)
+        .def("_append_uid_items", &APSIServer::append_uid_items)
+        .def("_remove_items", &APSIServer::remove_items)
+        .def("_get_db_version", &APSIServer::get_db_version)
+        .def("_start_change_tracking", &APSIServer::start_change_tracking)
+        .def("_is_tracking_changes", &APSIServer::is_tracking_changes)
+        .def("_export_delta", &APSIServer::export_delta)
+        .def("_apply_delta", &APSIServer::apply_delta)
+        .def("_discard_changes", &APSIServer::discard_changes)
+        .def("_get_key_version", &APSIServer::get_key_version)
+        .def("_get_retired_key_version", &APSIServer::get_retired_key_version)
+        .def("_start_key_rotation", &APSIServer::start_key_rotation)
+        .def("_is_rotating_key", &APSIServer::is_rotating_key)
+        .def("_is_key_rotation_ready", &APSIServer::is_key_rotation_ready)
+        .def("_finish_key_rotation", &APSIServer::finish_key_rotation)
+        .def("_get_packing_rate", &APSIServer::get_packing_rate)
+        .def("_get_bundle_stats", &APSIServer::get_bundle_stats)
+        .def("_start_repack", &APSIServer::start_repack)
+        .def("_is_repacking", &APSIServer::is_repacking)
+        .def("_is_repack_ready", &APSIServer::is_repack_ready)
+        .def("_finish_repack", &APSIServer::finish_repack)
+        .def("_retire_key", &APSIServer::retire_key)
+        .def("_open_update_log", &APSIServer::open_update_log)
+        .def("_sync_update_log", &APSIServer::sync_update_log)
+        .def("_close_update_log", &APSIServer::close_update_log)
+        .def("_replay_update_log", &APSIServer::replay_update_log)
+        .def("_start_compaction", &APSIServer::start_compaction)
+        .def("_is_compacting", &APSIServer::is_compacting)
+        .def("_wait_for_compaction", &APSIServer::wait_for_compaction)
         .def("_handle_oprf_request", &APSIServer::handle_oprf_request)
         .def("_handle_query", &APSIServer::handle_query)
-        // TODO: use def_property_readonly instead
-        .def_readwrite("_db_label_byte_count", &APSIServer::db_label_byte_count);
+        .def("_handle_membership_query", &APSIServer::handle_membership_query)
+        .def_property_readonly("_db_label_byte_count", &APSIServer::get_db_label_byte_count);
     py::class_<APSIClient>(m, "APSIClient")
         .def(py::init<string &>())
         .def("_oprf_request", &APSIClient::oprf_request)
         .def("_build_query", &APSIClient::build_query)
+        .def("_build_subquery", &APSIClient::build_subquery)
         .def("_extract_labeled_result_from_query_response",
              &APSIClient::extract_labeled_result_from_query_response)
         .def("_extract_unlabeled_result_from_query_response",
              &APSIClient::extract_unlabeled_result_from_query_response)
-        .def("_get_prf_bytes_all", &APSIClient::get_prf_bytes_all);
+        .def("_get_prf_bytes_all", &APSIClient::get_prf_bytes_all)
+        .def("_unmask_uid_labels", &APSIClient::unmask_uid_labels);
 
 #ifdef VERSION_INFO
     m.attr("__version__") = MACRO_STRINGIFY(VERSION_INFO);
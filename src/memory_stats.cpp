@@ -0,0 +1,137 @@
+#include "memory_stats.h"
+
+// STD
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <utility>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+#define PYAPSI_MALLINFO2 1
+#endif
+#endif
+
+// APSI
+#include <apsi/log.h>
+
+// SEAL
+#include <seal/memorymanager.h>
+
+using namespace std;
+
+namespace {
+    atomic<bool> tracking{ false };
+
+    mutex stages_mutex;
+
+    vector<BuildStageStats> stages;
+
+    // Reads the RSS and its peak from /proc/self/status, where they are given in kB
+    void read_proc_status(MemoryUsage &usage)
+    {
+        ifstream status("/proc/self/status");
+        string line;
+        while (getline(status, line)) {
+            istringstream fields(line);
+            string key;
+            size_t kb = 0;
+            fields >> key >> kb;
+            if (key == "VmRSS:") {
+                usage.rss_bytes = kb * 1024;
+            } else if (key == "VmHWM:") {
+                usage.peak_rss_bytes = kb * 1024;
+            }
+        }
+    }
+
+    void reset_peak_rss()
+    {
+        ofstream clear_refs("/proc/self/clear_refs");
+        clear_refs << "5";
+    }
+
+    string to_mb(size_t bytes)
+    {
+        ostringstream out;
+        out.precision(1);
+        out << fixed << static_cast<double>(bytes) / (1024 * 1024) << " MB";
+        return out.str();
+    }
+} // namespace
+
+MemoryUsage get_memory_usage()
+{
+    MemoryUsage usage;
+    read_proc_status(usage);
+#ifdef PYAPSI_MALLINFO2
+    struct mallinfo2 info = mallinfo2();
+    usage.heap_bytes = info.uordblks + info.hblkhd;
+#endif
+    usage.seal_pool_bytes = seal::MemoryManager::GetPool().alloc_byte_count();
+    return usage;
+}
+
+void release_free_memory()
+{
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+void set_memory_tracking(bool enabled)
+{
+    tracking = enabled;
+}
+
+bool is_memory_tracking()
+{
+    return tracking;
+}
+
+vector<BuildStageStats> get_build_stage_stats()
+{
+    lock_guard<mutex> lock(stages_mutex);
+    return stages;
+}
+
+void clear_build_stage_stats()
+{
+    lock_guard<mutex> lock(stages_mutex);
+    stages.clear();
+}
+
+BuildStage::BuildStage(string stage, size_t items) : tracking_(tracking)
+{
+    if (!tracking_) {
+        return;
+    }
+    stats_.stage = move(stage);
+    stats_.items = items;
+    reset_peak_rss();
+    stats_.before = get_memory_usage();
+    started_ = chrono::steady_clock::now();
+}
+
+BuildStage::~BuildStage()
+{
+    if (!tracking_) {
+        return;
+    }
+    stats_.after = get_memory_usage();
+    stats_.seconds =
+        chrono::duration<double>(chrono::steady_clock::now() - started_).count();
+
+    APSI_LOG_INFO(
+        "Build stage `" << stats_.stage << "` with " << stats_.items << " items took "
+                        << stats_.seconds << " s; RSS " << to_mb(stats_.before.rss_bytes)
+                        << " -> " << to_mb(stats_.after.rss_bytes) << " (peak "
+                        << to_mb(stats_.after.peak_rss_bytes) << "), heap "
+                        << to_mb(stats_.before.heap_bytes) << " -> "
+                        << to_mb(stats_.after.heap_bytes));
+
+    lock_guard<mutex> lock(stages_mutex);
+    stages.push_back(move(stats_));
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+// STD
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+Memory of the process at one point in time. RSS figures come from /proc and heap figures from
+glibc's allocator statistics; they are 0 where these are not available.
+*/
+struct MemoryUsage {
+    // Resident set size
+    std::size_t rss_bytes = 0;
+
+    // Highest resident set size so far, or since the start of the current build stage
+    std::size_t peak_rss_bytes = 0;
+
+    // Bytes of heap memory allocated with malloc and not freed yet
+    std::size_t heap_bytes = 0;
+
+    // Bytes allocated by SEAL's global memory pool; pools only grow
+    std::size_t seal_pool_bytes = 0;
+};
+
+MemoryUsage get_memory_usage();
+
+/**
+Returns free heap memory to the operating system, e.g. that of a database replaced by a load, so
+that it no longer counts towards the resident set size (glibc only).
+*/
+void release_free_memory();
+
+/**
+Memory of one stage of a database build, see BuildStage. `items` is the number of items the stage
+held in memory.
+*/
+struct BuildStageStats {
+    std::string stage;
+
+    std::size_t items = 0;
+
+    double seconds = 0.0;
+
+    MemoryUsage before;
+
+    MemoryUsage after;
+};
+
+/**
+Turns recording and logging of build stages on or off. While it is on, the start of every stage
+resets the peak RSS of the process (Linux only), so that each stage reports its own peak; this
+also affects the peak reported by getrusage.
+*/
+void set_memory_tracking(bool enabled);
+
+bool is_memory_tracking();
+
+/**
+The stages recorded since the last clear_build_stage_stats, in the order they finished.
+*/
+std::vector<BuildStageStats> get_build_stage_stats();
+
+void clear_build_stage_stats();
+
+/**
+Records the memory of a stage of a database build from construction to destruction, if memory
+tracking is on. Stages should not overlap, apart from parallel builds of shards.
+*/
+class BuildStage {
+public:
+    BuildStage(std::string stage, std::size_t items = 0);
+
+    ~BuildStage();
+
+    BuildStage(const BuildStage &) = delete;
+
+    BuildStage &operator=(const BuildStage &) = delete;
+
+    void set_items(std::size_t items)
+    {
+        stats_.items = items;
+    }
+
+private:
+    bool tracking_;
+
+    std::chrono::steady_clock::time_point started_;
+
+    BuildStageStats stats_;
+}; // class BuildStage
@@ -0,0 +1,122 @@
+#include "op_stats.h"
+
+// STD
+#include <atomic>
+#include <ctime>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+namespace {
+    struct OpCounters {
+        atomic<uint64_t> calls{ 0 };
+
+        atomic<uint64_t> waiting{ 0 };
+
+        atomic<uint64_t> running{ 0 };
+
+        atomic<uint64_t> wait_ns{ 0 };
+
+        atomic<uint64_t> run_ns{ 0 };
+    };
+
+    array<OpCounters, op_type_count> counters;
+
+    OpCounters &get_counters(OpType type)
+    {
+        return counters[static_cast<size_t>(type)];
+    }
+
+    uint64_t elapsed_ns(chrono::steady_clock::time_point since)
+    {
+        return static_cast<uint64_t>(
+            chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - since)
+                .count());
+    }
+} // namespace
+
+const char *to_string(OpType type)
+{
+    switch (type) {
+    case OpType::oprf:
+        return "oprf";
+    case OpType::query:
+        return "query";
+    case OpType::db_build:
+        return "db_build";
+    case OpType::decrypt:
+        return "decrypt";
+    }
+    return "unknown";
+}
+
+OpScope::OpScope(OpType type) : type_(type), created_(chrono::steady_clock::now())
+{
+    get_counters(type_).waiting++;
+}
+
+OpScope::~OpScope()
+{
+    auto &op_counters = get_counters(type_);
+    if (started_) {
+        op_counters.running--;
+        op_counters.run_ns += elapsed_ns(started_at_);
+        op_counters.calls++;
+    } else {
+        op_counters.waiting--;
+        op_counters.wait_ns += elapsed_ns(created_);
+    }
+}
+
+void OpScope::start()
+{
+    if (started_) {
+        return;
+    }
+    auto &op_counters = get_counters(type_);
+    started_ = true;
+    started_at_ = chrono::steady_clock::now();
+    op_counters.wait_ns += static_cast<uint64_t>(
+        chrono::duration_cast<chrono::nanoseconds>(started_at_ - created_).count());
+    op_counters.waiting--;
+    op_counters.running++;
+}
+
+array<OpStats, op_type_count> get_op_stats()
+{
+    array<OpStats, op_type_count> stats;
+    for (size_t i = 0; i < op_type_count; i++) {
+        stats[i].calls = counters[i].calls;
+        stats[i].waiting = counters[i].waiting;
+        stats[i].running = counters[i].running;
+        stats[i].wait_seconds = static_cast<double>(counters[i].wait_ns) * 1e-9;
+        stats[i].run_seconds = static_cast<double>(counters[i].run_ns) * 1e-9;
+    }
+    return stats;
+}
+
+void reset_op_stats()
+{
+    for (auto &op_counters : counters) {
+        op_counters.calls = 0;
+        op_counters.wait_ns = 0;
+        op_counters.run_ns = 0;
+    }
+}
+
+double get_process_cpu_seconds()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        auto seconds = [](const timeval &tv) {
+            return static_cast<double>(tv.tv_sec) + static_cast<double>(tv.tv_usec) * 1e-6;
+        };
+        return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+    }
+#endif
+    return static_cast<double>(clock()) / CLOCKS_PER_SEC;
+}
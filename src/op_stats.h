@@ -0,0 +1,71 @@
+#pragma once
+
+// STD
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/**
+Kinds of work that are counted and timed, see OpScope.
+*/
+enum class OpType : std::size_t { oprf = 0, query = 1, db_build = 2, decrypt = 3 };
+
+constexpr std::size_t op_type_count = 4;
+
+const char *to_string(OpType type);
+
+/**
+Counters of one kind of work. `waiting` and `running` are the calls in progress right now; the
+calls and times are summed over the calls finished since the last reset_op_stats.
+*/
+struct OpStats {
+    std::uint64_t calls = 0;
+
+    std::uint64_t waiting = 0;
+
+    std::uint64_t running = 0;
+
+    double wait_seconds = 0.0;
+
+    double run_seconds = 0.0;
+};
+
+/**
+Records one call: it counts as waiting, e.g. for a lock or for the thread pool, from construction
+until start, and as running from then on until it is destroyed. A call that is never started is
+only counted as waiting.
+*/
+class OpScope {
+public:
+    explicit OpScope(OpType type);
+
+    ~OpScope();
+
+    OpScope(const OpScope &) = delete;
+
+    OpScope &operator=(const OpScope &) = delete;
+
+    void start();
+
+private:
+    OpType type_;
+
+    bool started_ = false;
+
+    std::chrono::steady_clock::time_point created_;
+
+    std::chrono::steady_clock::time_point started_at_;
+}; // class OpScope
+
+std::array<OpStats, op_type_count> get_op_stats();
+
+/**
+Resets the call counts and times; calls in progress stay counted as waiting or running.
+*/
+void reset_op_stats();
+
+/**
+The CPU time used by all threads of the process so far.
+*/
+double get_process_cpu_seconds();
@@ -1,17 +1,129 @@
 #include "sender.h"
+#include "common_utils.h"
+#include "memory_stats.h"
+#include <apsi/thread_pool_mgr.h>
+#include <kuku/common.h>
+#include <kuku/locfunc.h>
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <future>
 #include <iomanip>
+#include <iterator>
+#include <thread>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace apsi;
 using namespace apsi::oprf;
 using namespace apsi::sender;
 
-unique_ptr<CSVReader::DBData> db_data_from_csv(const string &db_file)
+namespace {
+    // The items of labeled DB data without their labels
+    vector<Item> get_items(const CSVReader::LabeledData &labeled_db_data)
+    {
+        vector<Item> items;
+        items.reserve(labeled_db_data.size());
+        for (auto &item_label : labeled_db_data) {
+            items.push_back(item_label.first);
+        }
+        return items;
+    }
+
+    size_t get_item_count(const CSVReader::DBData &db_data)
+    {
+        return visit([](auto &data) { return data.size(); }, db_data);
+    }
+
+    // The size of the longest label
+    size_t get_label_byte_count(const CSVReader::LabeledData &labeled_db_data)
+    {
+        size_t label_byte_count = 0;
+        for (auto &item_label : labeled_db_data) {
+            label_byte_count = max(label_byte_count, item_label.second.size());
+        }
+        return label_byte_count;
+    }
+
+    const Item &get_item(const Item &item)
+    {
+        return item;
+    }
+
+    const Item &get_item(const pair<Item, Label> &item_label)
+    {
+        return item_label.first;
+    }
+
+    // Keeps only the items of one shard, together with their original strings if given
+    void filter_shard(
+        CSVReader::DBData &db_data,
+        vector<string> *orig_items,
+        size_t shard_index,
+        size_t shard_count)
+    {
+        visit(
+            [&](auto &data) {
+                size_t kept = 0;
+                for (size_t i = 0; i < data.size(); i++) {
+                    if (get_shard_index(get_item(data[i]), shard_count) != shard_index) {
+                        continue;
+                    }
+                    data[kept] = move(data[i]);
+                    if (orig_items) {
+                        (*orig_items)[kept] = move((*orig_items)[i]);
+                    }
+                    kept++;
+                }
+                data.resize(kept);
+                if (orig_items) {
+                    orig_items->resize(kept);
+                }
+            },
+            db_data);
+    }
+
+    // Replaces the labels with their codes in a dictionary of all labels
+    shared_ptr<LabelDictionary> encode_labels(CSVReader::LabeledData &labeled_db_data)
+    {
+        vector<string> labels;
+        labels.reserve(labeled_db_data.size());
+        for (auto &item_label : labeled_db_data) {
+            labels.emplace_back(item_label.second.begin(), item_label.second.end());
+        }
+
+        auto dictionary = make_shared<LabelDictionary>(move(labels));
+        for (auto &item_label : labeled_db_data) {
+            string code = dictionary->encode(
+                string(item_label.second.begin(), item_label.second.end()));
+            item_label.second.assign(code.begin(), code.end());
+        }
+        APSI_LOG_INFO(
+            "Encoded labels with a dictionary of " << dictionary->size() << " labels in "
+                                                   << dictionary->code_byte_count() << " bytes");
+        return dictionary;
+    }
+} // namespace
+
+size_t get_shard_index(const Item &item, size_t shard_count)
+{
+    // Items are already hashes of the original strings, so their low bits are uniform
+    return static_cast<size_t>(item.get_as<uint64_t>()[0] % shard_count);
+}
+
+unique_ptr<CSVReader::DBData> db_data_from_csv(const string &db_file, vector<string> *orig_items)
 {
      CSVReader::DBData db_data;
     try {
         CSVReader reader(db_file);
-        tie(db_data, ignore) = reader.read();
+        if (orig_items) {
+            tie(db_data, *orig_items) = reader.read();
+        } else {
+            tie(db_data, ignore) = reader.read();
+        }
     } catch (const exception &ex) {
         APSI_LOG_WARNING("Could not open or read file `" << db_file << "`: " << ex.what());
         return nullptr;
@@ -20,12 +132,87 @@ unique_ptr<CSVReader::DBData> db_data_from_csv(const string &db_file)
     return make_unique<CSVReader::DBData>(move(db_data));
 }
 
+unique_ptr<CSVReader::DBData> db_data_from_csv_files(
+    const vector<string> &db_files, vector<string> *orig_items)
+{
+    if (db_files.size() == 1) {
+        return db_data_from_csv(db_files[0], orig_items);
+    }
+
+    vector<unique_ptr<CSVReader::DBData>> parts(db_files.size());
+    vector<vector<string>> part_orig_items(db_files.size());
+    {
+        ThreadPoolMgr tpm;
+        vector<future<void>> futures;
+        for (size_t i = 0; i < db_files.size(); i++) {
+            futures.push_back(tpm.thread_pool().enqueue([&, i]() {
+                parts[i] = db_data_from_csv(db_files[i], orig_items ? &part_orig_items[i] : nullptr);
+            }));
+        }
+        for (auto &f : futures) {
+            f.get();
+        }
+    }
+
+    // Empty parts fit both kinds of data; all others have to agree
+    bool labeled = false;
+    size_t total = 0;
+    for (size_t i = 0; i < parts.size(); i++) {
+        if (!parts[i]) {
+            return nullptr;
+        }
+        size_t size = visit([](auto &data) { return data.size(); }, *parts[i]);
+        if (size && total && labeled != holds_alternative<CSVReader::LabeledData>(*parts[i])) {
+            APSI_LOG_ERROR("`" << db_files[i] << "` does not match the kind of the other files");
+            return nullptr;
+        }
+        if (size) {
+            labeled = holds_alternative<CSVReader::LabeledData>(*parts[i]);
+        }
+        total += size;
+    }
+
+    auto merge = [&](auto &&merged) {
+        using Data = decay_t<decltype(merged)>;
+        merged.reserve(total);
+        for (auto &part : parts) {
+            if (auto *data = get_if<Data>(part.get())) {
+                move(data->begin(), data->end(), back_inserter(merged));
+            }
+            part.reset();
+        }
+        return make_unique<CSVReader::DBData>(move(merged));
+    };
+    if (orig_items) {
+        orig_items->clear();
+        orig_items->reserve(total);
+        for (auto &part_items : part_orig_items) {
+            move(part_items.begin(), part_items.end(), back_inserter(*orig_items));
+        }
+    }
+
+    APSI_LOG_INFO("Read " << total << " items from " << db_files.size() << " CSV files");
+    return labeled ? merge(CSVReader::LabeledData()) : merge(CSVReader::UnlabeledData());
+}
+
 shared_ptr<SenderDB> try_load_csv_db(
-    const string &db_file_path,
+    const vector<string> &db_file_paths,
     const string &params_json, 
     size_t nonce_byte_count, 
-    bool compressed)
+    bool compressed,
+    shared_ptr<SenderDB> *membership_db,
+    ItemStore *item_store,
+    const OPRFKey *oprf_key,
+    size_t shard_index,
+    size_t shard_count,
+    shared_ptr<LabelDictionary> *label_dictionary,
+    size_t label_byte_count)
 {
+    if (shard_index >= shard_count) {
+        APSI_LOG_ERROR("Shard index " << shard_index << " is out of range");
+        return nullptr;
+    }
+
     unique_ptr<PSIParams> params;
     try {
         params = make_unique<PSIParams>(PSIParams::Load(params_json));
@@ -40,20 +227,91 @@ shared_ptr<SenderDB> try_load_csv_db(
     }
 
     unique_ptr<CSVReader::DBData> db_data;
-    if (db_file_path.empty() || !(db_data = db_data_from_csv(db_file_path))) {
-        APSI_LOG_DEBUG("Failed to load data from a CSV file");
-        return nullptr;
+    vector<string> orig_items;
+    {
+        BuildStage stage("parse");
+        if (db_file_paths.empty() ||
+            !(db_data =
+                  db_data_from_csv_files(db_file_paths, item_store ? &orig_items : nullptr))) {
+            APSI_LOG_DEBUG("Failed to load data from a CSV file");
+            return nullptr;
+        }
+        stage.set_items(get_item_count(*db_data));
+    }
+
+    // The dictionary is built before the data is split, so that all shards of the same input
+    // share it
+    if (label_dictionary) {
+        *label_dictionary = nullptr;
+        if (auto *labeled_db_data = get_if<CSVReader::LabeledData>(db_data.get())) {
+            *label_dictionary = encode_labels(*labeled_db_data);
+        }
+    }
+
+    // Labels are as wide as the longest one in the input unless a width is given; it is taken
+    // before the data is split as well, so that shards only agree on it if all of them are built
+    // from the complete input or with the same width
+    if (auto *labeled_db_data = get_if<CSVReader::LabeledData>(db_data.get())) {
+        size_t longest_label = get_label_byte_count(*labeled_db_data);
+        if (label_byte_count && longest_label > label_byte_count) {
+            APSI_LOG_ERROR(
+                "A label has " << longest_label << " bytes, more than the maximum of "
+                               << label_byte_count);
+            return nullptr;
+        }
+        label_byte_count = label_byte_count ? label_byte_count : longest_label;
+    } else {
+        label_byte_count = 0;
+    }
+
+    if (shard_count > 1) {
+        filter_shard(*db_data, item_store ? &orig_items : nullptr, shard_index, shard_count);
+    }
+
+    shared_ptr<SenderDB> sender_db;
+    {
+        // Hashing, inserting and encoding all happen within SenderDB::set_data
+        BuildStage stage("encode", get_item_count(*db_data));
+        if (oprf_key) {
+            sender_db = create_sender_db_with_key(
+                *db_data, *params, *oprf_key, label_byte_count,
+                label_byte_count ? nonce_byte_count : 0, compressed);
+        } else {
+            sender_db = create_sender_db(
+                *db_data, move(params), nonce_byte_count, compressed, label_byte_count);
+        }
+    }
+
+    if (sender_db && membership_db) {
+        BuildStage stage("membership", get_item_count(*db_data));
+        *membership_db = sender_db->is_labeled() ? create_membership_db(*db_data, *sender_db) : nullptr;
+    }
+
+    if (sender_db && item_store) {
+        BuildStage stage("item_store", orig_items.size());
+        item_store->clear();
+        if (holds_alternative<CSVReader::LabeledData>(*db_data)) {
+            auto &labeled_db_data = get<CSVReader::LabeledData>(*db_data);
+            for (size_t i = 0; i < orig_items.size(); ++i) {
+                auto &label = labeled_db_data[i].second;
+                item_store->insert_or_assign(orig_items[i], string(label.begin(), label.end()));
+            }
+        } else {
+            for (auto &orig_item : orig_items) {
+                item_store->insert_or_assign(orig_item, string());
+            }
+        }
     }
 
-    return create_sender_db(
-        *db_data, move(params), nonce_byte_count, compressed);
+    return sender_db;
 }
 
 shared_ptr<SenderDB> create_sender_db(
     const CSVReader::DBData &db_data,
     unique_ptr<PSIParams> psi_params,
     size_t nonce_byte_count,
-    bool compress)
+    bool compress,
+    size_t label_byte_count)
 {
     if (!psi_params) {
         APSI_LOG_ERROR("No PSI parameters were given");
@@ -76,10 +334,9 @@ shared_ptr<SenderDB> create_sender_db(
         try {
             auto &labeled_db_data = get<CSVReader::LabeledData>(db_data);
 
-            size_t label_byte_count =
-                max_element(labeled_db_data.begin(), labeled_db_data.end(), [](auto &a, auto &b) {
-                    return a.second.size() < b.second.size();
-                })->second.size();
+            if (!label_byte_count) {
+                label_byte_count = get_label_byte_count(labeled_db_data);
+            }
 
             sender_db = make_shared<SenderDB>(*psi_params, label_byte_count, nonce_byte_count, compress);
             sender_db->set_data(labeled_db_data);
@@ -105,12 +362,631 @@ shared_ptr<SenderDB> create_sender_db(
     return sender_db;
 }
 
+shared_ptr<SenderDB> create_sender_db_with_key(
+    const CSVReader::DBData &db_data,
+    const PSIParams &psi_params,
+    const OPRFKey &oprf_key,
+    size_t label_byte_count,
+    size_t nonce_byte_count,
+    bool compress)
+{
+    shared_ptr<SenderDB> sender_db;
+    try {
+        sender_db = make_shared<SenderDB>(
+            psi_params, oprf_key, label_byte_count, nonce_byte_count, compress);
+        if (holds_alternative<CSVReader::LabeledData>(db_data)) {
+            sender_db->set_data(get<CSVReader::LabeledData>(db_data));
+        } else {
+            sender_db->set_data(get<CSVReader::UnlabeledData>(db_data));
+        }
+    } catch (const exception &ex) {
+        APSI_LOG_ERROR("Failed to create SenderDB: " << ex.what());
+        return nullptr;
+    }
+
+    APSI_LOG_INFO(
+        "Created SenderDB with " << sender_db->get_item_count() << " items; packing rate: "
+                                 << sender_db->get_packing_rate());
+
+    return sender_db;
+}
+
+shared_ptr<SenderDB> create_membership_db(
+    const CSVReader::DBData &db_data,
+    const SenderDB &labeled_db)
+{
+    if (!holds_alternative<CSVReader::LabeledData>(db_data)) {
+        APSI_LOG_ERROR("Membership databases can only be created for labeled data");
+        return nullptr;
+    }
+
+    auto items = get_items(get<CSVReader::LabeledData>(db_data));
+
+    shared_ptr<SenderDB> membership_db;
+    try {
+        membership_db = make_shared<SenderDB>(
+            labeled_db.get_params(), labeled_db.get_oprf_key(), 0, 0, labeled_db.is_compressed());
+        membership_db->set_data(items);
+    } catch (const exception &ex) {
+        APSI_LOG_ERROR("Failed to create membership SenderDB: " << ex.what());
+        return nullptr;
+    }
+
+    APSI_LOG_INFO(
+        "Created membership SenderDB with " << membership_db->get_item_count() << " items");
+
+    return membership_db;
+}
+
+namespace {
+    // UIDs are the big-endian, 1-based indices into the UID table
+    vector<uint8_t> make_uid(uint64_t idx, size_t uid_byte_count)
+    {
+        vector<uint8_t> uid(uid_byte_count);
+        for (size_t b = 0; b < uid_byte_count; ++b) {
+            uid[uid_byte_count - 1 - b] = static_cast<uint8_t>((idx >> (8 * b)) & 0xFF);
+        }
+        return uid;
+    }
+
+    vector<UIDMaskKey> uid_mask_keys(const vector<HashedItem> &hashes)
+    {
+        vector<UIDMaskKey> keys;
+        keys.reserve(hashes.size());
+        for (auto &hash : hashes) {
+            keys.push_back(uid_mask_key(hash));
+        }
+        return keys;
+    }
+
+    /**
+    Sections that can follow the primary SenderDB in a saved database file.
+    */
+    enum class DBSection : uint32_t {
+        membership_db = 1,
+        item_store = 2,
+        params_db = 3,
+        version = 4,
+        key_version = 5,
+        shard_db = 6,
+        label_dictionary = 7,
+        uid_mask_mode = 8
+    };
+
+    constexpr uint32_t db_section_magic = 0x58504150; // "PAPX"
+
+    void save_db_section_header(ostream &out, DBSection section)
+    {
+        uint32_t header[2] = { db_section_magic, static_cast<uint32_t>(section) };
+        out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    }
+
+    // Reads the next section header; returns false at the end of the stream.
+    bool load_db_section_header(istream &in, DBSection &section)
+    {
+        if (in.peek() == char_traits<char>::eof()) {
+            return false;
+        }
+
+        uint32_t header[2];
+        in.read(reinterpret_cast<char *>(header), sizeof(header));
+        if (!in || header[0] != db_section_magic) {
+            throw runtime_error("invalid database section header");
+        }
+
+        section = static_cast<DBSection>(header[1]);
+        return true;
+    }
+
+    /**
+    Passes writes on to another stream buffer at no more than a given rate, by sleeping before
+    each chunk until the bytes written so far are due.
+    */
+    class ThrottledStreamBuf : public streambuf {
+    public:
+        ThrottledStreamBuf(streambuf *out, size_t bytes_per_second)
+            : out_(out), bytes_per_second_(static_cast<double>(bytes_per_second)),
+              started_(chrono::steady_clock::now())
+        {}
+
+    protected:
+        int_type overflow(int_type ch) override
+        {
+            if (traits_type::eq_int_type(ch, traits_type::eof())) {
+                return traits_type::not_eof(ch);
+            }
+            char c = traits_type::to_char_type(ch);
+            return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+        }
+
+        streamsize xsputn(const char *s, streamsize count) override
+        {
+            streamsize written = 0;
+            while (written < count) {
+                streamsize chunk = min<streamsize>(count - written, chunk_size);
+                written_ += static_cast<size_t>(chunk);
+                this_thread::sleep_until(
+                    started_ + chrono::duration_cast<chrono::steady_clock::duration>(
+                                   chrono::duration<double>(
+                                       static_cast<double>(written_) / bytes_per_second_)));
+
+                streamsize chunk_written = out_->sputn(s + written, chunk);
+                written += chunk_written;
+                if (chunk_written < chunk) {
+                    break;
+                }
+            }
+            return written;
+        }
+
+        int sync() override
+        {
+            return out_->pubsync();
+        }
+
+    private:
+        static constexpr streamsize chunk_size = 1 << 16;
+
+        streambuf *out_;
+
+        double bytes_per_second_;
+
+        size_t written_ = 0;
+
+        chrono::steady_clock::time_point started_;
+    };
+
+    shared_ptr<SenderDB> load_sender_db(istream &in)
+    {
+        auto [data, size] = SenderDB::Load(in);
+        return make_shared<SenderDB>(move(data));
+    }
+} // namespace
+
+void save_db_set(ostream &out, const DBSet &dbs)
+{
+    dbs.db->save(out);
+    if (dbs.membership_db) {
+        save_db_section_header(out, DBSection::membership_db);
+        dbs.membership_db->save(out);
+    }
+    for (auto &param_db : dbs.param_dbs) {
+        save_db_section_header(out, DBSection::params_db);
+        param_db->save(out);
+    }
+    for (auto &shard_db : dbs.shard_dbs) {
+        save_db_section_header(out, DBSection::shard_db);
+        shard_db->save(out);
+    }
+    if (dbs.item_store) {
+        save_db_section_header(out, DBSection::item_store);
+        dbs.item_store->save(out);
+    }
+    if (dbs.label_dictionary) {
+        save_db_section_header(out, DBSection::label_dictionary);
+        dbs.label_dictionary->save(out);
+    }
+    if (dbs.version) {
+        save_db_section_header(out, DBSection::version);
+        out.write(reinterpret_cast<const char *>(&dbs.version), sizeof(dbs.version));
+    }
+    if (dbs.key_version) {
+        save_db_section_header(out, DBSection::key_version);
+        out.write(reinterpret_cast<const char *>(&dbs.key_version), sizeof(dbs.key_version));
+    }
+    if (dbs.uid_mask_mode != UIDMaskMode::repeat) {
+        save_db_section_header(out, DBSection::uid_mask_mode);
+        auto mask_mode = static_cast<uint32_t>(dbs.uid_mask_mode);
+        out.write(reinterpret_cast<const char *>(&mask_mode), sizeof(mask_mode));
+    }
+}
+
+void save_db_set_to_file(const string &file_path, const DBSet &dbs, size_t max_bytes_per_second)
+{
+    string tmp_path = file_path + ".tmp";
+    {
+        ofstream ofs(tmp_path, ios::binary);
+        if (!ofs.is_open()) {
+            throw runtime_error("could not open `" + tmp_path + "` for writing");
+        }
+        if (max_bytes_per_second) {
+            ThrottledStreamBuf throttled(ofs.rdbuf(), max_bytes_per_second);
+            ostream out(&throttled);
+            save_db_set(out, dbs);
+            out.flush();
+            if (!out) {
+                throw runtime_error("failed writing `" + tmp_path + "`");
+            }
+        } else {
+            save_db_set(ofs, dbs);
+        }
+        ofs.close();
+        if (!ofs) {
+            throw runtime_error("failed writing `" + tmp_path + "`");
+        }
+    }
+
+    // The data and then its directory entry have to be on disk before the save is done
+    int fd = ::open(tmp_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("could not open `" + tmp_path + "` for syncing");
+    }
+    int sync_result = ::fsync(fd);
+    ::close(fd);
+    if (sync_result != 0) {
+        throw runtime_error("could not sync `" + tmp_path + "`");
+    }
+    if (rename(tmp_path.c_str(), file_path.c_str()) != 0) {
+        throw runtime_error("could not move `" + tmp_path + "` to `" + file_path + "`");
+    }
+    sync_parent_directory(file_path);
+}
+
+DBSet load_db_set_from_file(const string &file_path)
+{
+    ifstream ifs(file_path, ios::binary);
+    if (!ifs.is_open()) {
+        throw runtime_error("could not open `" + file_path + "`");
+    }
+    return load_db_set(ifs);
+}
+
+DBSet load_db_set(istream &in)
+{
+    DBSet dbs;
+    dbs.db = load_sender_db(in);
+
+    DBSection section;
+    while (load_db_section_header(in, section)) {
+        switch (section) {
+        case DBSection::membership_db:
+            dbs.membership_db = load_sender_db(in);
+            break;
+        case DBSection::params_db:
+            dbs.param_dbs.push_back(load_sender_db(in));
+            break;
+        case DBSection::shard_db:
+            dbs.shard_dbs.push_back(load_sender_db(in));
+            break;
+        case DBSection::item_store:
+            dbs.item_store = make_shared<ItemStore>();
+            dbs.item_store->load(in);
+            break;
+        case DBSection::label_dictionary:
+            dbs.label_dictionary = make_shared<LabelDictionary>();
+            dbs.label_dictionary->load(in);
+            break;
+        case DBSection::version:
+            if (!in.read(reinterpret_cast<char *>(&dbs.version), sizeof(dbs.version))) {
+                throw runtime_error("failed to read database version");
+            }
+            break;
+        case DBSection::key_version:
+            if (!in.read(reinterpret_cast<char *>(&dbs.key_version), sizeof(dbs.key_version))) {
+                throw runtime_error("failed to read OPRF key version");
+            }
+            break;
+        case DBSection::uid_mask_mode: {
+            uint32_t mask_mode;
+            if (!in.read(reinterpret_cast<char *>(&mask_mode), sizeof(mask_mode)) ||
+                mask_mode > static_cast<uint32_t>(UIDMaskMode::aes_ctr)) {
+                throw runtime_error("failed to read UID mask mode");
+            }
+            dbs.uid_mask_mode = static_cast<UIDMaskMode>(mask_mode);
+            break;
+        }
+        default:
+            throw runtime_error("unknown database section");
+        }
+    }
+
+    return dbs;
+}
+
+namespace {
+    /**
+    Encodes the items of the item store of `dbs` again, with all databases built in parallel.
+    The primary and membership databases use `params` if given; the databases for other
+    parameters are only rebuilt if `rebuild_param_dbs` is set and shared otherwise. Labeled
+    databases keep their label byte count unless another one is given.
+    */
+    DBSet rebuild_from_item_store(
+        const DBSet &dbs,
+        const OPRFKey &oprf_key,
+        const PSIParams *params,
+        bool rebuild_param_dbs,
+        size_t label_byte_count = 0)
+    {
+        if (!dbs.item_store) {
+            throw logic_error("rebuilding a database requires an item store");
+        }
+
+        auto &db = *dbs.db;
+        auto db_data = dbs.item_store->to_db_data(db.is_labeled());
+        auto rebuild = [&](const SenderDB &orig, const PSIParams &psi_params) {
+            return async(launch::async, [&, label_byte_count]() {
+                auto rebuilt = create_sender_db_with_key(
+                    db_data, psi_params, oprf_key,
+                    label_byte_count ? label_byte_count : orig.get_label_byte_count(),
+                    orig.get_nonce_byte_count(), orig.is_compressed());
+                if (!rebuilt) {
+                    throw runtime_error("failed to rebuild database");
+                }
+                return rebuilt;
+            });
+        };
+
+        const PSIParams &primary_params = params ? *params : db.get_params();
+        auto db_future = rebuild(db, primary_params);
+        future<shared_ptr<SenderDB>> membership_future;
+        if (dbs.membership_db) {
+            // Built like the primary database, but from the items only
+            membership_future = async(launch::async, [&]() {
+                auto membership_db = make_shared<SenderDB>(
+                    primary_params, oprf_key, 0, 0, dbs.membership_db->is_compressed());
+                membership_db->set_data(get_items(get<CSVReader::LabeledData>(db_data)));
+                return membership_db;
+            });
+        }
+        vector<future<shared_ptr<SenderDB>>> param_futures;
+        if (rebuild_param_dbs) {
+            for (auto &param_db : dbs.param_dbs) {
+                param_futures.push_back(rebuild(*param_db, param_db->get_params()));
+            }
+        }
+
+        DBSet rebuilt;
+        rebuilt.db = db_future.get();
+        if (membership_future.valid()) {
+            rebuilt.membership_db = membership_future.get();
+        }
+        if (rebuild_param_dbs) {
+            for (auto &f : param_futures) {
+                rebuilt.param_dbs.push_back(f.get());
+            }
+        } else {
+            rebuilt.param_dbs = dbs.param_dbs;
+        }
+        rebuilt.item_store = dbs.item_store;
+        rebuilt.label_dictionary = dbs.label_dictionary;
+        rebuilt.version = dbs.version;
+        rebuilt.key_version = dbs.key_version;
+        rebuilt.uid_mask_mode = dbs.uid_mask_mode;
+
+        return rebuilt;
+    }
+} // namespace
+
+DBSet merge_db_shards(vector<DBSet> shards)
+{
+    // Empty shards, e.g. of a small input split into many shards, need not be served
+    shards.erase(
+        remove_if(
+            shards.begin(), shards.end(),
+            [](const DBSet &shard) { return shard.db->get_item_count() == 0; }),
+        shards.end());
+    if (shards.empty()) {
+        throw invalid_argument("all shards are empty");
+    }
+
+    auto &first = *shards[0].db;
+    bool merge_item_stores = true;
+    for (auto &shard : shards) {
+        if (shard.membership_db || !shard.param_dbs.empty() || !shard.shard_dbs.empty()) {
+            throw invalid_argument("shards must only hold a primary database");
+        }
+        auto &db = *shard.db;
+        if (db.get_params().to_string() != first.get_params().to_string()) {
+            throw invalid_argument("shards were built with different parameters");
+        }
+        if (!(db.get_oprf_key() == first.get_oprf_key())) {
+            throw invalid_argument("shards were built with different OPRF keys");
+        }
+        if (db.is_labeled() != first.is_labeled()) {
+            throw invalid_argument("shards must all be labeled or all be unlabeled");
+        }
+        if (db.get_label_byte_count() != first.get_label_byte_count()) {
+            throw invalid_argument(
+                "shards were built with different label lengths; build them with the same "
+                "maximum label length");
+        }
+        auto &dictionary = shards[0].label_dictionary;
+        if (static_cast<bool>(shard.label_dictionary) != static_cast<bool>(dictionary) ||
+            (dictionary && !(*shard.label_dictionary == *dictionary))) {
+            throw invalid_argument("shards were built with different label dictionaries");
+        }
+        merge_item_stores = merge_item_stores && shard.item_store;
+    }
+
+    DBSet merged;
+    merged.db = shards[0].db;
+    merged.label_dictionary = shards[0].label_dictionary;
+    merged.uid_mask_mode = shards[0].uid_mask_mode;
+    for (size_t i = 1; i < shards.size(); i++) {
+        merged.shard_dbs.push_back(shards[i].db);
+    }
+    if (merge_item_stores) {
+        merged.item_store = shards[0].item_store;
+        for (size_t i = 1; i < shards.size(); i++) {
+            merged.item_store->merge(*shards[i].item_store);
+        }
+    }
+
+    return merged;
+}
+
+DBSet rebuild_db_set(const DBSet &dbs, const OPRFKey &oprf_key)
+{
+    DBSet rebuilt = rebuild_from_item_store(dbs, oprf_key, nullptr, true);
+    rebuilt.key_version++;
+    return rebuilt;
+}
+
+DBSet reparameterize_db_set(const DBSet &dbs, const PSIParams &params)
+{
+    return rebuild_from_item_store(dbs, dbs.db->get_oprf_key(), &params, false);
+}
+
+DBSet repack_db_set(const DBSet &dbs)
+{
+    return rebuild_from_item_store(dbs, dbs.db->get_oprf_key(), nullptr, true);
+}
+
+DBSet widen_uid_db_set(const DBSet &dbs, size_t uid_byte_count)
+{
+    if (!dbs.item_store) {
+        throw logic_error("rebuilding a database requires an item store");
+    }
+
+    DBSet widened = dbs;
+    widened.item_store = make_shared<ItemStore>();
+    widened.item_store->merge(*dbs.item_store);
+    widened.item_store->pad_labels(uid_byte_count);
+    DBSet rebuilt =
+        rebuild_from_item_store(widened, dbs.db->get_oprf_key(), nullptr, true, uid_byte_count);
+    rebuilt.item_store = widened.item_store;
+    return rebuilt;
+}
+
+vector<BundleIndexStats> get_bundle_stats(const SenderDB &db)
+{
+    auto &params = db.get_params();
+    uint32_t bundle_idx_count = params.bundle_idx_count();
+    uint32_t items_per_bundle = params.items_per_bundle();
+    uint32_t max_items_per_bin = params.table_params().max_items_per_bin;
+
+    vector<BundleIndexStats> stats(bundle_idx_count);
+    for (uint32_t bundle_idx = 0; bundle_idx < bundle_idx_count; bundle_idx++) {
+        stats[bundle_idx].bundle_idx = bundle_idx;
+        stats[bundle_idx].bundle_count = db.get_bin_bundle_count(bundle_idx);
+    }
+
+    // Items are stored at all of their cuckoo table locations, found with the same location
+    // functions as in SenderDB
+    vector<kuku::LocFunc> loc_funcs;
+    for (uint32_t i = 0; i < params.table_params().hash_func_count; i++) {
+        loc_funcs.emplace_back(params.table_params().table_size, kuku::make_item(i, 0));
+    }
+    vector<uint32_t> bin_loads(params.table_params().table_size, 0);
+    {
+        auto lock = db.get_reader_lock();
+        for (auto &item : db.get_hashed_items()) {
+            unordered_set<kuku::location_type> locations;
+            for (auto &loc_func : loc_funcs) {
+                locations.insert(loc_func(item.get_as<kuku::item_type>()[0]));
+            }
+            for (auto location : locations) {
+                bin_loads[location]++;
+            }
+        }
+    }
+
+    for (size_t location = 0; location < bin_loads.size(); location++) {
+        auto &index_stats = stats[location / items_per_bundle];
+        index_stats.entry_count += bin_loads[location];
+        index_stats.min_bundle_count = max<size_t>(
+            index_stats.min_bundle_count,
+            (bin_loads[location] + max_items_per_bin - 1) / max_items_per_bin);
+    }
+    for (auto &index_stats : stats) {
+        uint64_t capacity = static_cast<uint64_t>(index_stats.bundle_count) * items_per_bundle *
+                            max_items_per_bin;
+        index_stats.fill_rate =
+            capacity ? static_cast<double>(index_stats.entry_count) / capacity : 0.0;
+    }
+    return stats;
+}
+
+UIDMaskKey uid_mask_key(const HashedItem &hash)
+{
+    auto words = hash.get_as<uint64_t>();
+    UIDMaskKey key{};
+    for (size_t w = 0; w < words.size() && w < key.size() / sizeof(uint64_t); ++w) {
+        for (size_t b = 0; b < sizeof(uint64_t); ++b) {
+            key[w * sizeof(uint64_t) + b] = uint8_t((words[w] >> (8 * b)) & 0xFF);
+        }
+    }
+    return key;
+}
+
+vector<vector<uint8_t>> append_uid_rows(
+    vector<pair<vector<uint8_t>, vector<uint8_t>>> &table,
+    const vector<pair<string, string>> &rows,
+    const OPRFKey &oprf_key,
+    size_t uid_byte_count,
+    UIDMaskMode mask_mode)
+{
+    if (get_byte_count(table.size() + rows.size()) > uid_byte_count) {
+        throw invalid_argument("UIDs do not fit into the given byte count");
+    }
+
+    for (auto &row : table) {
+        if (row.first.size() < uid_byte_count) {
+            row.first.insert(row.first.begin(), uid_byte_count - row.first.size(), 0);
+        }
+    }
+
+    vector<Item> items;
+    vector<vector<uint8_t>> masked;
+    items.reserve(rows.size());
+    masked.reserve(rows.size());
+    for (auto &row : rows) {
+        items.emplace_back(row.first);
+        masked.emplace_back(row.second.begin(), row.second.end());
+    }
+    apply_uid_masks(
+        mask_mode, uid_mask_keys(oprf::OPRFSender::ComputeHashes(items, oprf_key)), masked);
+
+    vector<vector<uint8_t>> uids;
+    uids.reserve(rows.size());
+    table.reserve(table.size() + rows.size());
+    for (auto &label : masked) {
+        uids.push_back(make_uid(table.size() + 1, uid_byte_count));
+        table.emplace_back(uids.back(), move(label));
+    }
+    return uids;
+}
+
+void remask_uid_table(
+    vector<pair<vector<uint8_t>, vector<uint8_t>>> &table,
+    const CSVReader::DBData &uid_data,
+    const OPRFKey &old_key,
+    const OPRFKey &new_key,
+    UIDMaskMode mask_mode)
+{
+    if (!holds_alternative<CSVReader::LabeledData>(uid_data)) {
+        throw invalid_argument("UID data must be labeled");
+    }
+    auto &labeled = get<CSVReader::LabeledData>(uid_data);
+
+    auto items = get_items(labeled);
+    auto old_hashes = oprf::OPRFSender::ComputeHashes(items, old_key);
+    auto new_hashes = oprf::OPRFSender::ComputeHashes(items, new_key);
+
+    for (size_t i = 0; i < labeled.size(); ++i) {
+        // UIDs are the big-endian, 1-based indices into the table
+        uint64_t idx = 0;
+        for (auto b : labeled[i].second) {
+            idx = (idx << 8) | b;
+        }
+        if (idx == 0 || idx > table.size()) {
+            continue;
+        }
+
+        auto &masked = table[idx - 1].second;
+        apply_uid_mask(mask_mode, uid_mask_key(old_hashes[i]), masked.data(), masked.size());
+        apply_uid_mask(mask_mode, uid_mask_key(new_hashes[i]), masked.data(), masked.size());
+    }
+}
+
 shared_ptr<SenderDB> try_load_csv_uid_db(
     const string &csv_file_path,
     const string &params_json,
     size_t nonce_byte_count,
     bool compressed,
-    vector<pair<vector<uint8_t>, vector<uint8_t>>> &out_table)
+    vector<pair<vector<uint8_t>, vector<uint8_t>>> &out_table,
+    ItemStore *item_store,
+    UIDMaskMode mask_mode)
 {
     unique_ptr<PSIParams> params;
     try {
@@ -120,7 +996,13 @@ shared_ptr<SenderDB> try_load_csv_uid_db(
         return nullptr;
     }
 
-    auto dbptr = db_data_from_csv(csv_file_path);
+    vector<string> orig_items;
+    unique_ptr<CSVReader::DBData> dbptr;
+    {
+        BuildStage stage("parse");
+        dbptr = db_data_from_csv(csv_file_path, item_store ? &orig_items : nullptr);
+        stage.set_items(dbptr ? get_item_count(*dbptr) : 0);
+    }
     if (!dbptr || !holds_alternative<CSVReader::LabeledData>(*dbptr)) {
         APSI_LOG_ERROR("Failed to load labeled CSV data");
         return nullptr;
@@ -132,8 +1014,7 @@ shared_ptr<SenderDB> try_load_csv_uid_db(
         return nullptr;
     }
 
-    size_t uid_bytes = static_cast<size_t>(ceil(log2(double(total) + 1) / 8.0));
-    uid_bytes = max<size_t>(1, uid_bytes);
+    size_t uid_bytes = get_byte_count(total);
     APSI_LOG_INFO("try_load_csv_uid_db: total_items=" << total
                   << ", uid_bytes=" << uid_bytes);
 
@@ -144,51 +1025,57 @@ shared_ptr<SenderDB> try_load_csv_uid_db(
         compressed);
 
     vector<pair<Item, Label>> db_vec;
-    db_vec.reserve(total);
-    out_table.clear();
-    out_table.reserve(total);
+    {
+        BuildStage stage("assign", total);
+        db_vec.reserve(total);
+        out_table.clear();
+        out_table.reserve(total);
 
-    for (size_t i = 0; i < total; ++i) {
-        const auto &item_str    = labeled[i].first;
-        const auto &orig_label  = labeled[i].second;
+        for (size_t i = 0; i < total; ++i) {
+            const auto &item_str = labeled[i].first;
 
-        vector<uint8_t> uid_raw(uid_bytes);
-        uint64_t idx = uint64_t(i) + 1;
-        for (size_t b = 0; b < uid_bytes; ++b) {
-            uid_raw[uid_bytes - 1 - b] =
-                static_cast<uint8_t>((idx >> (8 * b)) & 0xFF);
-        }
+            vector<uint8_t> uid_raw = make_uid(uint64_t(i) + 1, uid_bytes);
 
-        db_vec.emplace_back(Item(item_str), Label(uid_raw));
+            db_vec.emplace_back(Item(item_str), Label(uid_raw));
 
-        out_table.emplace_back(uid_raw, vector<uint8_t>{});
-    }
+            out_table.emplace_back(uid_raw, vector<uint8_t>{});
+        }
 
-    sender_db->set_data(db_vec);
+        if (item_store) {
+            item_store->clear();
+            for (size_t i = 0; i < total; ++i) {
+                auto &uid = db_vec[i].second;
+                item_store->insert_or_assign(orig_items[i], string(uid.begin(), uid.end()));
+            }
+        }
+    }
+    {
+        BuildStage stage("encode", total);
+        sender_db->set_data(db_vec);
+    }
 
     auto oprf_key = sender_db->get_oprf_key();
 
-    vector<Item> all_items;
-    all_items.reserve(total);
-    for (auto &p : db_vec) all_items.push_back(p.first);
-    auto all_hashes = oprf::OPRFSender::ComputeHashes(all_items, oprf_key);
+    vector<HashedItem> all_hashes;
+    {
+        BuildStage stage("hash", total);
+        vector<Item> all_items;
+        all_items.reserve(total);
+        for (auto &p : db_vec) all_items.push_back(p.first);
+        all_hashes = oprf::OPRFSender::ComputeHashes(all_items, oprf_key);
+    }
 
+    // The labels are masked in one batch, with the keystream implementation picked once
+    BuildStage mask_stage("mask", total);
+    vector<vector<uint8_t>> masked;
+    masked.reserve(total);
     for (size_t i = 0; i < total; ++i) {
-        auto words = all_hashes[i].get_as<uint64_t>();
-        vector<uint8_t> prf;
-        prf.reserve(words.size() * sizeof(uint64_t));
-        for (auto w : words) {
-            for (size_t b = 0; b < sizeof(w); ++b) {
-                prf.push_back(uint8_t((w >> (8 * b)) & 0xFF));
-            }
-        }
-
         const auto &orig_lbl = labeled[i].second;
-        auto &masked = out_table[i].second;
-        masked.resize(orig_lbl.size());
-        for (size_t j = 0; j < orig_lbl.size(); ++j) {
-            masked[j] = orig_lbl[j] ^ prf[j % prf.size()];
-        }
+        masked.emplace_back(orig_lbl.begin(), orig_lbl.end());
+    }
+    apply_uid_masks(mask_mode, uid_mask_keys(all_hashes), masked);
+    for (size_t i = 0; i < total; ++i) {
+        out_table[i].second = move(masked[i]);
     }
 
     APSI_LOG_INFO("Loaded UID‐labeled DB: " << total << " entries");
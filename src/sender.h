@@ -1,3 +1,4 @@
+#include <cstdint>
 #include <iostream>
 #include <memory>
 #include <apsi/psi_params.h>
@@ -5,26 +6,209 @@
 #include <apsi/oprf/oprf_sender.h>
 
 #include "csv_reader.h"
+#include "item_store.h"
+#include "label_dictionary.h"
+#include "serialization.h"
+#include "uid_mask.h"
 
 
 
-std::unique_ptr<CSVReader::DBData> db_data_from_csv(const std::string &db_file);
+std::unique_ptr<CSVReader::DBData> db_data_from_csv(
+    const std::string &db_file,
+    std::vector<std::string> *orig_items = nullptr);
+
+/**
+Read several CSV files of the same kind, e.g. the parts of a partitioned export, into a single
+DBData. The files are parsed concurrently on the APSI thread pool, one reader per file, and
+concatenated in the given order.
+*/
+std::unique_ptr<CSVReader::DBData> db_data_from_csv_files(
+    const std::vector<std::string> &db_files,
+    std::vector<std::string> *orig_items = nullptr);
 
 std::shared_ptr<apsi::sender::SenderDB> try_load_csv_db(
-    const std::string &db_file_path,
+    const std::vector<std::string> &db_file_paths,
     const std::string &params_json, 
     size_t nonce_byte_count, 
-    bool compressed);
+    bool compressed,
+    std::shared_ptr<apsi::sender::SenderDB> *membership_db = nullptr,
+    ItemStore *item_store = nullptr,
+    const apsi::oprf::OPRFKey *oprf_key = nullptr,
+    size_t shard_index = 0,
+    size_t shard_count = 1,
+    std::shared_ptr<LabelDictionary> *label_dictionary = nullptr,
+    size_t label_byte_count = 0);
+
+/**
+The shard an item belongs to when the data is split into `shard_count` shards.
+*/
+size_t get_shard_index(const apsi::Item &item, size_t shard_count);
 
 std::shared_ptr<apsi::sender::SenderDB> create_sender_db(
     const CSVReader::DBData &db_data,
     std::unique_ptr<apsi::PSIParams> psi_params,
     size_t nonce_byte_count,
+    bool compress,
+    size_t label_byte_count = 0);
+
+/**
+Create a SenderDB for the given data that uses an existing OPRF key.
+*/
+std::shared_ptr<apsi::sender::SenderDB> create_sender_db_with_key(
+    const CSVReader::DBData &db_data,
+    const apsi::PSIParams &psi_params,
+    const apsi::oprf::OPRFKey &oprf_key,
+    size_t label_byte_count,
+    size_t nonce_byte_count,
     bool compress);
 
+/**
+Create an unlabeled SenderDB holding the same items as a labeled one. It shares the OPRF key
+of the labeled SenderDB so that one OPRF round trip serves queries against both.
+*/
+std::shared_ptr<apsi::sender::SenderDB> create_membership_db(
+    const CSVReader::DBData &db_data,
+    const apsi::sender::SenderDB &labeled_db);
+
+/**
+The primary SenderDB of a server together with the databases and data kept next to it.
+*/
+struct DBSet {
+    std::shared_ptr<apsi::sender::SenderDB> db;
+    std::shared_ptr<apsi::sender::SenderDB> membership_db;
+    std::vector<std::shared_ptr<apsi::sender::SenderDB>> param_dbs;
+    std::shared_ptr<ItemStore> item_store;
+
+    // Set if the labels in the databases and the item store are codes of this dictionary
+    std::shared_ptr<LabelDictionary> label_dictionary;
+
+    // Further shards of the primary database; they hold disjoint items under the same
+    // parameters and OPRF key and are queried together with it
+    std::vector<std::shared_ptr<apsi::sender::SenderDB>> shard_dbs;
+
+    // Counts the update batches applied to the databases; see ChangeJournal
+    std::uint64_t version = 0;
+
+    // Counts the rotations of the OPRF key
+    std::uint32_t key_version = 0;
+
+    // How the labels of the UID table of a UID database are masked, see try_load_csv_uid_db
+    UIDMaskMode uid_mask_mode = UIDMaskMode::repeat;
+};
+
+/**
+Encode the items of the item store of a DBSet again for all of its databases, under another OPRF
+key. The result shares the item store with the given DBSet and has the next key version.
+*/
+DBSet rebuild_db_set(const DBSet &dbs, const apsi::oprf::OPRFKey &oprf_key);
+
+/**
+Encode the items of the item store of a DBSet again for its primary and membership databases,
+under other parameters but with the same OPRF key. The databases for other parameters are shared
+with the given DBSet.
+*/
+DBSet reparameterize_db_set(const DBSet &dbs, const apsi::PSIParams &params);
+
+/**
+Encode the items of the item store of a DBSet again for all of its databases, with the same
+parameters and OPRF key. A fresh encoding packs the items into as few bin bundles as possible, so
+this restores the packing rate after many updates.
+*/
+DBSet repack_db_set(const DBSet &dbs);
+
+/**
+Packing statistics of the bin bundles at one bundle index of a SenderDB.
+*/
+struct BundleIndexStats {
+    std::uint32_t bundle_idx;
+
+    // The number of bin bundles at the bundle index
+    std::size_t bundle_count;
+
+    // The fewest bin bundles that could hold the items at the bundle index, given the fullest of
+    // its bins
+    std::size_t min_bundle_count;
+
+    // The number of item entries at the bundle index, and their share of the capacity of its
+    // bin bundles
+    std::uint64_t entry_count;
+    double fill_rate;
+};
+
+/**
+Compute the packing statistics of every bundle index of a SenderDB from its hashed items.
+*/
+std::vector<BundleIndexStats> get_bundle_stats(const apsi::sender::SenderDB &db);
+
+/**
+Combine DBSets built separately from disjoint parts of the data, with the same parameters and OPRF
+key, into one DBSet serving all of them. The shards must only hold a primary database and possibly
+an item store and a label dictionary; the item stores are merged if every shard has one, and the
+label dictionaries must be the same.
+*/
+DBSet merge_db_shards(std::vector<DBSet> shards);
+
+/**
+Rebuild a DBSet with UIDs (see try_load_csv_uid_db) `uid_byte_count` bytes wide. The UIDs in its
+item store are padded with leading zero bytes, which keeps their values.
+*/
+DBSet widen_uid_db_set(const DBSet &dbs, std::size_t uid_byte_count);
+
+/**
+Append the items of `rows` with their labels to a UID table: every item gets the next UID,
+`uid_byte_count` bytes wide, and its label masked with its OPRF hash under `oprf_key`. Only the new
+rows are hashed and masked; the UIDs of existing rows are padded to the width if needed. Returns the
+UIDs of the new rows.
+*/
+std::vector<std::vector<uint8_t>> append_uid_rows(
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &table,
+    const std::vector<std::pair<std::string, std::string>> &rows,
+    const apsi::oprf::OPRFKey &oprf_key,
+    std::size_t uid_byte_count,
+    UIDMaskMode mask_mode);
+
+/**
+The key that the UID label of an item is masked with: the bytes of its OPRF hash.
+*/
+UIDMaskKey uid_mask_key(const apsi::HashedItem &hash);
+
+/**
+Mask the labels of a UID table (see try_load_csv_uid_db) with the OPRF hashes under `new_key`
+instead of those under `old_key`. `uid_data` holds the items with their UIDs as labels.
+*/
+void remask_uid_table(
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &table,
+    const CSVReader::DBData &uid_data,
+    const apsi::oprf::OPRFKey &old_key,
+    const apsi::oprf::OPRFKey &new_key,
+    UIDMaskMode mask_mode = UIDMaskMode::repeat);
+
+/**
+Save a DBSet. The primary SenderDB comes first so that the result can still be read with
+SenderDB::Load; everything else follows in optional sections.
+*/
+void save_db_set(std::ostream &out, const DBSet &dbs);
+
+DBSet load_db_set(std::istream &in);
+
+/**
+Save a DBSet to a file. The data is written to a temporary file first and then moved into
+place, so that an existing file at the path is only replaced by a complete one. With
+`max_bytes_per_second`, writing is slowed down to at most that rate.
+*/
+void save_db_set_to_file(
+    const std::string &file_path, const DBSet &dbs, std::size_t max_bytes_per_second = 0);
+
+/**
+Load a DBSet from a file.
+*/
+DBSet load_db_set_from_file(const std::string &file_path);
+
 std::shared_ptr<apsi::sender::SenderDB> try_load_csv_uid_db(
     const std::string &csv_file_path,
     const std::string &params_json,
     size_t nonce_byte_count,
     bool compressed,
-    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &out_table);
\ No newline at end of file
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &out_table,
+    ItemStore *item_store = nullptr,
+    UIDMaskMode mask_mode = UIDMaskMode::repeat);
\ No newline at end of file
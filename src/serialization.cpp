@@ -0,0 +1,39 @@
+#include "serialization.h"
+
+// STD
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+size_t get_byte_count(uint64_t max_value)
+{
+    size_t byte_count = 1;
+    while (byte_count < sizeof(uint64_t) && (max_value >> (8 * byte_count))) {
+        byte_count++;
+    }
+    return byte_count;
+}
+
+void write_string(ostream &out, const string &str)
+{
+    uint32_t size = static_cast<uint32_t>(str.size());
+    out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    out.write(str.data(), static_cast<streamsize>(str.size()));
+}
+
+string read_string(istream &in, const char *error_message)
+{
+    uint32_t size = 0;
+    in.read(reinterpret_cast<char *>(&size), sizeof(size));
+    string str;
+    while (in && str.size() < size) {
+        size_t offset = str.size();
+        str.resize(offset + min<size_t>(size - offset, max_reserved_count));
+        in.read(&str[offset], static_cast<streamsize>(str.size() - offset));
+    }
+    if (!in) {
+        throw runtime_error(error_message);
+    }
+    return str;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+// STD
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+/**
+The most records reserved for up front when loading a count of them from a stream. Counts and sizes
+read from a stream are only trusted as far as it holds data, so a corrupt file fails to load
+instead of allocating what it claims.
+*/
+constexpr std::size_t max_reserved_count = std::size_t(1) << 16;
+
+/**
+The number of bytes of the big-endian integers up to `max_value`, at least 1.
+*/
+std::size_t get_byte_count(std::uint64_t max_value);
+
+/**
+Write a string preceded by its 32-bit size.
+*/
+void write_string(std::ostream &out, const std::string &str);
+
+/**
+Read a string written by write_string. The string grows as its bytes are read, so a corrupt size
+does not allocate more than the stream holds. Throws std::runtime_error with `error_message` if the
+stream ends first.
+*/
+std::string read_string(std::istream &in, const char *error_message);
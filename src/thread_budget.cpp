@@ -0,0 +1,196 @@
+#include "thread_budget.h"
+
+// STD
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// APSI
+#include <apsi/log.h>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace apsi;
+
+namespace {
+    // Calls measured per thread count while tuning
+    constexpr size_t samples_per_count = 3;
+
+    // How much faster per unit of work more threads need to be to be chosen
+    constexpr double min_speedup = 1.1;
+
+    struct Tuner {
+        // Thread counts to try, in increasing order
+        vector<size_t> counts;
+
+        // The count being tried
+        size_t count_idx = 0;
+
+        size_t samples = 0;
+
+        double seconds_per_work = 0.0;
+
+        size_t best_idx = 0;
+
+        double best_seconds_per_work = 0.0;
+
+        bool tuned = false;
+
+        size_t thread_count() const
+        {
+            return counts[tuned ? best_idx : count_idx];
+        }
+
+        void add_sample(size_t count, double seconds, size_t work)
+        {
+            // Samples of a previous tuning run or of another count are ignored
+            if (tuned || count != counts[count_idx]) {
+                return;
+            }
+            seconds_per_work += seconds / static_cast<double>(max<size_t>(work, 1));
+            if (++samples < samples_per_count) {
+                return;
+            }
+
+            double mean = seconds_per_work / samples_per_count;
+            if (!count_idx || mean * min_speedup <= best_seconds_per_work) {
+                best_idx = count_idx;
+                best_seconds_per_work = mean;
+            } else {
+                // Efficiency dropped; more threads will not pay off either
+                tuned = true;
+            }
+            if (++count_idx == counts.size()) {
+                tuned = true;
+            }
+            samples = 0;
+            seconds_per_work = 0.0;
+        }
+    };
+
+    atomic<bool> auto_tune{ false };
+
+    mutex tuners_mutex;
+
+    array<Tuner, op_type_count> tuners;
+
+    Tuner &get_tuner(OpType type)
+    {
+        return tuners[static_cast<size_t>(type)];
+    }
+
+#ifdef __linux__
+    // From linux/ioprio.h, which not all C libraries ship
+    constexpr int ioprio_who_process = 1;
+
+    constexpr int ioprio_class_be = 2;
+
+    constexpr int ioprio_class_shift = 13;
+#endif
+} // namespace
+
+ThreadBudget::ThreadBudget(OpType type, size_t thread_count, size_t work)
+    : type_(type), work_(work)
+{
+    if (!thread_count && auto_tune) {
+        lock_guard<mutex> lock(tuners_mutex);
+        thread_count = get_tuner(type_).thread_count();
+        tuning_ = true;
+    }
+    thread_count_ = thread_count ? thread_count : ThreadPoolMgr::GetThreadCount();
+    started_ = chrono::steady_clock::now();
+}
+
+ThreadBudget::~ThreadBudget()
+{
+    if (!tuning_) {
+        return;
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started_).count();
+    lock_guard<mutex> lock(tuners_mutex);
+    auto &tuner = get_tuner(type_);
+    bool was_tuned = tuner.tuned;
+    tuner.add_sample(thread_count_, seconds, work_);
+    if (!was_tuned && tuner.tuned) {
+        APSI_LOG_INFO(
+            "Tuned thread count for " << to_string(type_) << " to " << tuner.thread_count());
+    }
+}
+
+vector<size_t> make_chunks(size_t count, size_t thread_count, size_t min_chunk_size)
+{
+    size_t chunk_count =
+        max<size_t>(1, min<size_t>(thread_count, count / max<size_t>(min_chunk_size, 1)));
+    vector<size_t> bounds;
+    for (size_t i = 0; i <= chunk_count; i++) {
+        bounds.push_back(count * i / chunk_count);
+    }
+    return bounds;
+}
+
+void set_thread_auto_tune(bool enabled, size_t max_thread_count)
+{
+    if (!enabled) {
+        auto_tune = false;
+        return;
+    }
+
+    if (!max_thread_count) {
+        max_thread_count = max<size_t>(thread::hardware_concurrency(), 1);
+    }
+    vector<size_t> counts;
+    for (size_t count = 1; count < max_thread_count; count *= 2) {
+        counts.push_back(count);
+    }
+    counts.push_back(max_thread_count);
+
+    lock_guard<mutex> lock(tuners_mutex);
+    for (auto &tuner : tuners) {
+        tuner = Tuner();
+        tuner.counts = counts;
+    }
+    auto_tune = true;
+}
+
+bool is_thread_auto_tune()
+{
+    return auto_tune;
+}
+
+array<ThreadTuning, op_type_count> get_thread_tuning()
+{
+    array<ThreadTuning, op_type_count> tuning;
+    lock_guard<mutex> lock(tuners_mutex);
+    for (size_t i = 0; i < op_type_count; i++) {
+        if (!tuners[i].counts.empty()) {
+            tuning[i].thread_count = tuners[i].thread_count();
+            tuning[i].tuned = tuners[i].tuned;
+        }
+    }
+    return tuning;
+}
+
+void lower_thread_priority()
+{
+#ifdef __linux__
+    // On Linux, both priorities apply to a single thread when given its thread ID
+    auto tid = static_cast<id_t>(syscall(SYS_gettid));
+    if (setpriority(PRIO_PROCESS, tid, 19) != 0) {
+        APSI_LOG_WARNING("Failed to lower the CPU priority of a background thread");
+    }
+#ifdef SYS_ioprio_set
+    if (syscall(
+            SYS_ioprio_set, ioprio_who_process, tid,
+            (ioprio_class_be << ioprio_class_shift) | 7) != 0) {
+        APSI_LOG_WARNING("Failed to lower the I/O priority of a background thread");
+    }
+#endif
+#endif
+}
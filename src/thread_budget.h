@@ -0,0 +1,123 @@
+#pragma once
+
+// STD
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <future>
+#include <utility>
+#include <vector>
+
+// APSI
+#include <apsi/thread_pool_mgr.h>
+
+// PyAPSI
+#include "op_stats.h"
+
+/**
+The number of workers of one call. APSI's thread pool is shared by the whole process and is never
+resized for a call; instead, a call with a budget splits its work into at most that many tasks of
+the pool, see make_chunks and for_each_chunk. So a budget only applies to work scheduled by
+PyAPSI itself, and calls with and without budgets run side by side.
+
+A budget of 0 stands for the thread count of the pool, unless auto-tuning is on, see
+set_thread_auto_tune; then the tuner picks the worker count for the kind of work and learns from
+the time the call took per unit of work, e.g. per item or per result part.
+*/
+class ThreadBudget {
+public:
+    ThreadBudget(OpType type, std::size_t thread_count, std::size_t work = 1);
+
+    ~ThreadBudget();
+
+    ThreadBudget(const ThreadBudget &) = delete;
+
+    ThreadBudget &operator=(const ThreadBudget &) = delete;
+
+    std::size_t thread_count() const
+    {
+        return thread_count_;
+    }
+
+    // Sets the amount of work, if it is only known once the call is done
+    void set_work(std::size_t work)
+    {
+        work_ = work;
+    }
+
+private:
+    OpType type_;
+
+    std::size_t work_;
+
+    bool tuning_ = false;
+
+    std::size_t thread_count_ = 0;
+
+    std::chrono::steady_clock::time_point started_;
+}; // class ThreadBudget
+
+/**
+Splits `count` items into at most `thread_count` chunks of at least `min_chunk_size` items, but at
+least one chunk; returns the chunk boundaries.
+*/
+std::vector<std::size_t> make_chunks(
+    std::size_t count, std::size_t thread_count, std::size_t min_chunk_size = 1);
+
+/**
+Runs fun(chunk index, begin, end) for all chunks of make_chunks as tasks of APSI's thread pool; a
+single chunk runs on the calling thread. The first exception of a chunk is rethrown once all
+chunks are done.
+*/
+template <typename F>
+void for_each_chunk(const std::vector<std::size_t> &bounds, F &&fun)
+{
+    std::size_t chunk_count = bounds.size() - 1;
+    if (chunk_count == 1) {
+        fun(0, bounds[0], bounds[1]);
+        return;
+    }
+
+    apsi::ThreadPoolMgr tpm;
+    std::vector<std::future<void>> futures;
+    for (std::size_t i = 0; i < chunk_count; i++) {
+        futures.push_back(tpm.thread_pool().enqueue(
+            [&fun, &bounds, i]() { fun(i, bounds[i], bounds[i + 1]); }));
+    }
+    for (auto &f : futures) {
+        f.wait();
+    }
+    for (auto &f : futures) {
+        f.get();
+    }
+}
+
+/**
+Turns auto-tuning of the thread count per kind of work on or off. Turning it on starts the tuning
+over: calls without a budget try 1, 2, 4, ... threads up to `max_thread_count` (0 for the
+hardware concurrency) a few calls each, and every kind of work settles on the last thread count
+that was still at least 10% faster per unit of work than the one before. Calls that overlap slow
+each other down, so the tuning is most accurate while they do not. Turning it off keeps the
+tuning results.
+*/
+void set_thread_auto_tune(bool enabled, std::size_t max_thread_count = 0);
+
+bool is_thread_auto_tune();
+
+/**
+The state of auto-tuning for one kind of work. While `tuned` is false, `thread_count` is the count
+being tried.
+*/
+struct ThreadTuning {
+    std::size_t thread_count = 0;
+
+    bool tuned = false;
+};
+
+std::array<ThreadTuning, op_type_count> get_thread_tuning();
+
+/**
+Lowers the CPU and I/O priority of the calling thread to the lowest best-effort levels, e.g. for
+background work that should not slow down queries (Linux only).
+*/
+void lower_thread_priority();
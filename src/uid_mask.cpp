@@ -0,0 +1,269 @@
+#include "uid_mask.h"
+
+// STD
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define PYAPSI_AESNI 1
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+    constexpr size_t block_size = 16;
+
+    // Keystream blocks generated at once; enough to keep the AES units of a core busy
+    constexpr size_t blocks_per_batch = 8;
+
+    // Counter blocks are the big-endian block index in the last 8 bytes
+    void make_counter_blocks(uint64_t first, size_t count, uint8_t *out)
+    {
+        memset(out, 0, count * block_size);
+        for (size_t i = 0; i < count; i++) {
+            uint64_t counter = first + i;
+            for (size_t b = block_size; b-- > block_size - sizeof(counter); counter >>= 8) {
+                out[i * block_size + b] = static_cast<uint8_t>(counter & 0xFF);
+            }
+        }
+    }
+
+    void xor_bytes(uint8_t *data, const uint8_t *stream, size_t size)
+    {
+        for (size_t i = 0; i < size; i++) {
+            data[i] ^= stream[i];
+        }
+    }
+
+    void apply_repeat_mask(const UIDMaskKey &key, uint8_t *label, size_t label_size)
+    {
+        for (size_t i = 0; i < label_size; i++) {
+            label[i] ^= key[i % key.size()];
+        }
+    }
+
+    // Portable AES-128, used where AES-NI is not available
+
+    constexpr uint8_t sbox[256] = {
+        0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab,
+        0x76, 0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4,
+        0x72, 0xc0, 0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71,
+        0xd8, 0x31, 0x15, 0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2,
+        0xeb, 0x27, 0xb2, 0x75, 0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6,
+        0xb3, 0x29, 0xe3, 0x2f, 0x84, 0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb,
+        0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf, 0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45,
+        0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8, 0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+        0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2, 0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44,
+        0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73, 0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a,
+        0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb, 0xe0, 0x32, 0x3a, 0x0a, 0x49,
+        0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79, 0xe7, 0xc8, 0x37, 0x6d,
+        0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08, 0xba, 0x78, 0x25,
+        0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a, 0x70, 0x3e,
+        0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e, 0xe1,
+        0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+        0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb,
+        0x16
+    };
+
+    constexpr uint8_t rcon[10] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+
+    using RoundKeys = array<uint8_t, 11 * block_size>;
+
+    RoundKeys expand_key(const UIDMaskKey &key)
+    {
+        RoundKeys round_keys;
+        copy(key.begin(), key.end(), round_keys.begin());
+        for (size_t i = 4; i < 44; i++) {
+            uint8_t word[4];
+            memcpy(word, &round_keys[(i - 1) * 4], 4);
+            if (i % 4 == 0) {
+                uint8_t first = word[0];
+                word[0] = static_cast<uint8_t>(sbox[word[1]] ^ rcon[i / 4 - 1]);
+                word[1] = sbox[word[2]];
+                word[2] = sbox[word[3]];
+                word[3] = sbox[first];
+            }
+            for (size_t b = 0; b < 4; b++) {
+                round_keys[i * 4 + b] = round_keys[(i - 4) * 4 + b] ^ word[b];
+            }
+        }
+        return round_keys;
+    }
+
+    uint8_t xtime(uint8_t x)
+    {
+        return static_cast<uint8_t>((x << 1) ^ ((x >> 7) * 0x1b));
+    }
+
+    void encrypt_block(const RoundKeys &round_keys, uint8_t *block)
+    {
+        xor_bytes(block, round_keys.data(), block_size);
+        for (size_t round = 1; round <= 10; round++) {
+            // SubBytes and ShiftRows; byte `r + 4c` is row r of column c
+            uint8_t state[block_size];
+            for (size_t c = 0; c < 4; c++) {
+                for (size_t r = 0; r < 4; r++) {
+                    state[r + 4 * c] = sbox[block[r + 4 * ((c + r) % 4)]];
+                }
+            }
+            if (round < 10) {
+                for (size_t c = 0; c < 4; c++) {
+                    uint8_t *col = state + 4 * c;
+                    uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+                    uint8_t first = col[0];
+                    col[0] ^= all ^ xtime(col[0] ^ col[1]);
+                    col[1] ^= all ^ xtime(col[1] ^ col[2]);
+                    col[2] ^= all ^ xtime(col[2] ^ col[3]);
+                    col[3] ^= all ^ xtime(col[3] ^ first);
+                }
+            }
+            for (size_t i = 0; i < block_size; i++) {
+                block[i] = state[i] ^ round_keys[round * block_size + i];
+            }
+        }
+    }
+
+    void apply_aes_ctr_mask_portable(const UIDMaskKey &key, uint8_t *label, size_t label_size)
+    {
+        RoundKeys round_keys = expand_key(key);
+        uint8_t stream[block_size];
+        for (uint64_t counter = 0; label_size; counter++) {
+            make_counter_blocks(counter, 1, stream);
+            encrypt_block(round_keys, stream);
+            size_t size = min(label_size, block_size);
+            xor_bytes(label, stream, size);
+            label += size;
+            label_size -= size;
+        }
+    }
+
+#ifdef PYAPSI_AESNI
+#define PYAPSI_AESNI_TARGET __attribute__((target("aes,sse2")))
+
+    template <int round_constant>
+    PYAPSI_AESNI_TARGET __m128i expand_round_key(__m128i key)
+    {
+        __m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(key, round_constant), 0xff);
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        return _mm_xor_si128(key, assist);
+    }
+
+    PYAPSI_AESNI_TARGET void apply_aes_ctr_mask_aesni(
+        const UIDMaskKey &key, uint8_t *label, size_t label_size)
+    {
+        __m128i round_keys[11];
+        round_keys[0] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key.data()));
+        round_keys[1] = expand_round_key<0x01>(round_keys[0]);
+        round_keys[2] = expand_round_key<0x02>(round_keys[1]);
+        round_keys[3] = expand_round_key<0x04>(round_keys[2]);
+        round_keys[4] = expand_round_key<0x08>(round_keys[3]);
+        round_keys[5] = expand_round_key<0x10>(round_keys[4]);
+        round_keys[6] = expand_round_key<0x20>(round_keys[5]);
+        round_keys[7] = expand_round_key<0x40>(round_keys[6]);
+        round_keys[8] = expand_round_key<0x80>(round_keys[7]);
+        round_keys[9] = expand_round_key<0x1b>(round_keys[8]);
+        round_keys[10] = expand_round_key<0x36>(round_keys[9]);
+
+        alignas(16) uint8_t counters[blocks_per_batch * block_size];
+        __m128i blocks[blocks_per_batch];
+        for (uint64_t counter = 0; label_size; counter += blocks_per_batch) {
+            size_t size = min(label_size, blocks_per_batch * block_size);
+            size_t count = (size + block_size - 1) / block_size;
+
+            // The blocks are independent, so the rounds of all of them are interleaved
+            make_counter_blocks(counter, count, counters);
+            for (size_t i = 0; i < count; i++) {
+                blocks[i] = _mm_xor_si128(
+                    _mm_load_si128(reinterpret_cast<const __m128i *>(counters) + i),
+                    round_keys[0]);
+            }
+            for (size_t round = 1; round < 10; round++) {
+                for (size_t i = 0; i < count; i++) {
+                    blocks[i] = _mm_aesenc_si128(blocks[i], round_keys[round]);
+                }
+            }
+            for (size_t i = 0; i < count; i++) {
+                blocks[i] = _mm_aesenclast_si128(blocks[i], round_keys[10]);
+            }
+
+            size_t full = size / block_size;
+            for (size_t i = 0; i < full; i++) {
+                __m128i *data = reinterpret_cast<__m128i *>(label) + i;
+                _mm_storeu_si128(data, _mm_xor_si128(_mm_loadu_si128(data), blocks[i]));
+            }
+            if (size % block_size) {
+                alignas(16) uint8_t stream[block_size];
+                _mm_store_si128(reinterpret_cast<__m128i *>(stream), blocks[full]);
+                xor_bytes(label + full * block_size, stream, size % block_size);
+            }
+
+            label += size;
+            label_size -= size;
+        }
+    }
+
+#undef PYAPSI_AESNI_TARGET
+#endif
+
+    using MaskFunction = void (*)(const UIDMaskKey &, uint8_t *, size_t);
+
+    MaskFunction get_aes_ctr_mask_function()
+    {
+#ifdef PYAPSI_AESNI
+        if (__builtin_cpu_supports("aes")) {
+            return apply_aes_ctr_mask_aesni;
+        }
+#endif
+        return apply_aes_ctr_mask_portable;
+    }
+
+    MaskFunction get_mask_function(UIDMaskMode mode)
+    {
+        static const MaskFunction aes_ctr_mask = get_aes_ctr_mask_function();
+        switch (mode) {
+        case UIDMaskMode::repeat:
+            return apply_repeat_mask;
+        case UIDMaskMode::aes_ctr:
+            return aes_ctr_mask;
+        }
+        throw invalid_argument("Unknown UID mask mode");
+    }
+} // namespace
+
+UIDMaskMode uid_mask_mode_from_string(const string &mode)
+{
+    if (mode == "repeat") {
+        return UIDMaskMode::repeat;
+    }
+    if (mode == "aes_ctr") {
+        return UIDMaskMode::aes_ctr;
+    }
+    throw invalid_argument("Unknown UID mask mode `" + mode + "`");
+}
+
+string to_string(UIDMaskMode mode)
+{
+    return mode == UIDMaskMode::aes_ctr ? "aes_ctr" : "repeat";
+}
+
+void apply_uid_mask(UIDMaskMode mode, const UIDMaskKey &key, uint8_t *label, size_t label_size)
+{
+    get_mask_function(mode)(key, label, label_size);
+}
+
+void apply_uid_masks(
+    UIDMaskMode mode, const vector<UIDMaskKey> &keys, vector<vector<uint8_t>> &labels)
+{
+    if (keys.size() != labels.size()) {
+        throw invalid_argument("Every UID label needs a mask key");
+    }
+    MaskFunction mask = get_mask_function(mode);
+    for (size_t i = 0; i < labels.size(); i++) {
+        mask(keys[i], labels[i].data(), labels[i].size());
+    }
+}
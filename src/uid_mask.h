@@ -0,0 +1,40 @@
+#pragma once
+
+// STD
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+How the labels of a UID database (see try_load_csv_uid_db) are masked with the OPRF hashes of their
+items. Masking and unmasking are the same operation: an XOR with a keystream derived from the hash.
+
+- `repeat` XORs the label with the 16 bytes of the hash, repeated over the length of the label.
+- `aes_ctr` uses the hash as an AES-128 key and XORs the label with the AES-CTR keystream under it,
+  so no key material is reused for labels longer than the hash. AES-NI is used when the CPU has it.
+*/
+enum class UIDMaskMode : std::uint32_t { repeat = 0, aes_ctr = 1 };
+
+constexpr std::size_t uid_mask_key_size = 16;
+
+using UIDMaskKey = std::array<std::uint8_t, uid_mask_key_size>;
+
+UIDMaskMode uid_mask_mode_from_string(const std::string &mode);
+
+std::string to_string(UIDMaskMode mode);
+
+/**
+Masks, or unmasks, `label_size` bytes at `label` in place with the keystream of `key`.
+*/
+void apply_uid_mask(
+    UIDMaskMode mode, const UIDMaskKey &key, std::uint8_t *label, std::size_t label_size);
+
+/**
+Masks, or unmasks, every label in place with the keystream of the key at the same index.
+*/
+void apply_uid_masks(
+    UIDMaskMode mode,
+    const std::vector<UIDMaskKey> &keys,
+    std::vector<std::vector<std::uint8_t>> &labels);
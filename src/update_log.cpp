@@ -0,0 +1,280 @@
+#include "update_log.h"
+
+// STD
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+// POSIX
+#include <fcntl.h>
+#include <unistd.h>
+
+// APSI
+#include <apsi/log.h>
+
+#include "common_utils.h"
+
+using namespace std;
+
+namespace {
+    // Larger sizes can only come from a corrupt record
+    constexpr uint32_t max_field_size = 1u << 28;
+
+    uint32_t checksum(const string &data)
+    {
+        // FNV-1a
+        uint32_t hash = 2166136261u;
+        for (unsigned char c : data) {
+            hash = (hash ^ c) * 16777619u;
+        }
+        return hash;
+    }
+
+    void put_u32(string &out, uint32_t value)
+    {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    bool get_u32(istream &in, uint32_t &value)
+    {
+        return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(value)));
+    }
+
+    void throw_errno(const string &what)
+    {
+        throw runtime_error(what + ": " + strerror(errno));
+    }
+
+    // Cuts the log file at `path` down to its first `size` bytes and makes that durable
+    void truncate_log(const string &path, uint64_t size)
+    {
+        int fd = ::open(path.c_str(), O_WRONLY);
+        if (fd < 0) {
+            throw_errno("failed to open update log `" + path + "`");
+        }
+        if (::ftruncate(fd, static_cast<off_t>(size)) != 0 || ::fsync(fd) != 0) {
+            int error = errno;
+            ::close(fd);
+            errno = error;
+            throw_errno("failed to truncate update log `" + path + "`");
+        }
+        ::close(fd);
+    }
+} // namespace
+
+UpdateLog::UpdateLog(const string &path, size_t sync_every)
+    : path_(path), sync_every_(max<size_t>(sync_every, 1))
+{
+    open();
+}
+
+UpdateLog::~UpdateLog()
+{
+    try {
+        sync();
+    } catch (const exception &ex) {
+        APSI_LOG_ERROR("Failed to sync update log `" << path_ << "`: " << ex.what());
+    }
+    close();
+}
+
+void UpdateLog::open()
+{
+    fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd_ < 0) {
+        throw_errno("failed to open update log `" + path_ + "`");
+    }
+}
+
+void UpdateLog::close()
+{
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+void UpdateLog::append(const vector<Record> &records)
+{
+    string buffer;
+    Serialize(records, buffer);
+
+    lock_guard<mutex> lock(mutex_);
+    const char *data = buffer.data();
+    size_t remaining = buffer.size();
+    while (remaining) {
+        ssize_t written = ::write(fd_, data, remaining);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw_errno("failed to write update log");
+        }
+        data += written;
+        remaining -= static_cast<size_t>(written);
+    }
+
+    unsynced_ += records.size();
+    if (unsynced_ >= sync_every_) {
+        if (::fsync(fd_) != 0) {
+            throw_errno("failed to sync update log");
+        }
+        unsynced_ = 0;
+    }
+}
+
+void UpdateLog::sync()
+{
+    lock_guard<mutex> lock(mutex_);
+    if (unsynced_ && fd_ >= 0) {
+        if (::fsync(fd_) != 0) {
+            throw_errno("failed to sync update log");
+        }
+        unsynced_ = 0;
+    }
+}
+
+void UpdateLog::rotate(const string &rotated_path)
+{
+    lock_guard<mutex> lock(mutex_);
+    if (::fsync(fd_) != 0) {
+        throw_errno("failed to sync update log");
+    }
+    unsynced_ = 0;
+
+    if (::access(rotated_path.c_str(), F_OK) != 0) {
+        close();
+        if (::rename(path_.c_str(), rotated_path.c_str()) != 0) {
+            throw_errno("failed to rotate update log");
+        }
+        open();
+        // Both the rotated and the new log file have to survive a crash
+        sync_parent_directory(path_);
+        return;
+    }
+
+    // An earlier rotated file is still around, e.g. because its compaction failed. Its records
+    // are not covered by any snapshot yet, so append the current ones instead of replacing it,
+    // after any torn record at its end that would hide them on replay.
+    {
+        ifstream in(rotated_path, ios::binary);
+        bool complete;
+        uint64_t valid_size = 0;
+        Deserialize(in, [](const Record &) {}, complete, &valid_size);
+        if (!complete) {
+            in.close();
+            truncate_log(rotated_path, valid_size);
+        }
+    }
+    {
+        ifstream in(path_, ios::binary);
+        ofstream out(rotated_path, ios::binary | ios::app);
+        out << in.rdbuf();
+        out.flush();
+        if (!out) {
+            throw runtime_error("failed to rotate update log");
+        }
+    }
+    int rotated_fd = ::open(rotated_path.c_str(), O_RDONLY);
+    if (rotated_fd < 0) {
+        throw_errno("failed to open rotated update log");
+    }
+    if (::fsync(rotated_fd) != 0) {
+        int error = errno;
+        ::close(rotated_fd);
+        errno = error;
+        throw_errno("failed to sync rotated update log");
+    }
+    ::close(rotated_fd);
+    if (::ftruncate(fd_, 0) != 0) {
+        throw_errno("failed to truncate update log");
+    }
+}
+
+void UpdateLog::Serialize(const vector<Record> &records, string &out)
+{
+    // Record layout: op, item size, item, label size, label, checksum of everything before
+    for (auto &record : records) {
+        size_t start = out.size();
+        out.push_back(static_cast<char>(record.op));
+        put_u32(out, static_cast<uint32_t>(record.item.size()));
+        out.append(record.item);
+        put_u32(out, static_cast<uint32_t>(record.label.size()));
+        out.append(record.label);
+        put_u32(out, checksum(out.substr(start)));
+    }
+}
+
+size_t UpdateLog::Deserialize(
+    istream &in,
+    const function<void(const Record &)> &apply,
+    bool &complete,
+    uint64_t *valid_size)
+{
+    complete = true;
+    size_t count = 0;
+    uint64_t size_read = 0;
+    while (in.peek() != char_traits<char>::eof()) {
+        string raw(1, static_cast<char>(in.get()));
+        Record record{ static_cast<Op>(raw[0]), {}, {} };
+
+        uint32_t size = 0;
+        bool ok = get_u32(in, size) && size <= max_field_size;
+        if (ok) {
+            put_u32(raw, size);
+            record.item.resize(size);
+            ok = static_cast<bool>(in.read(record.item.data(), size));
+        }
+        if (ok) {
+            raw.append(record.item);
+            ok = get_u32(in, size) && size <= max_field_size;
+        }
+        if (ok) {
+            put_u32(raw, size);
+            record.label.resize(size);
+            ok = static_cast<bool>(in.read(record.label.data(), size));
+        }
+        uint32_t expected = 0;
+        if (ok) {
+            raw.append(record.label);
+            ok = get_u32(in, expected) && expected == checksum(raw) &&
+                 (record.op == Op::insert || record.op == Op::remove);
+        }
+        if (!ok) {
+            complete = false;
+            break;
+        }
+
+        apply(record);
+        count++;
+        size_read += raw.size() + sizeof(expected);
+    }
+
+    if (valid_size) {
+        *valid_size = size_read;
+    }
+    return count;
+}
+
+size_t UpdateLog::Replay(const string &path, const function<void(const Record &)> &apply)
+{
+    ifstream in(path, ios::binary);
+    if (!in.is_open()) {
+        return 0;
+    }
+
+    bool complete;
+    uint64_t valid_size = 0;
+    size_t count = Deserialize(in, apply, complete, &valid_size);
+    if (!complete) {
+        APSI_LOG_WARNING(
+            "Update log `" << path << "` ends with an incomplete record after " << count
+                           << " records; cutting it off");
+        in.close();
+        truncate_log(path, valid_size);
+    }
+
+    return count;
+}
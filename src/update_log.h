@@ -0,0 +1,90 @@
+#pragma once
+
+// STD
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+Append-only log of database updates. Records are appended to a file and made durable with
+fsync once `sync_every` records have accumulated or sync() is called, so that frequent small
+updates can be persisted without rewriting the whole database.
+*/
+class UpdateLog {
+public:
+    enum class Op : std::uint8_t { insert = 1, remove = 2 };
+
+    struct Record {
+        Op op;
+        std::string item;
+        std::string label;
+    };
+
+    UpdateLog(const std::string &path, std::size_t sync_every);
+
+    UpdateLog(const UpdateLog &) = delete;
+
+    UpdateLog &operator=(const UpdateLog &) = delete;
+
+    ~UpdateLog();
+
+    const std::string &path() const
+    {
+        return path_;
+    }
+
+    void append(const std::vector<Record> &records);
+
+    void sync();
+
+    /**
+    Moves the records of the current log file to `rotated_path` and continues with an empty
+    log. Records appended before the call end up in the rotated file, all later ones in the
+    log file. If `rotated_path` already exists, the records are appended to it.
+    */
+    void rotate(const std::string &rotated_path);
+
+    /**
+    Calls `apply` for every record of the log file at `path` in order. A truncated or corrupt
+    record at the end of the file, e.g. from a crash during a write, ends the replay and is cut
+    off the file, so that records appended to it later are not hidden behind it. Returns the
+    number of replayed records.
+    */
+    static std::size_t Replay(const std::string &path, const std::function<void(const Record &)> &apply);
+
+    /**
+    Appends the log representation of `records` to `out`.
+    */
+    static void Serialize(const std::vector<Record> &records, std::string &out);
+
+    /**
+    Reads records in log representation from `in` until the end of the stream and calls `apply`
+    for each of them. Returns the number of records read; `complete` is set to false if the
+    stream ends with a truncated or corrupt record. If given, `valid_size` is set to the number
+    of bytes of the records read, i.e. the offset at which a truncated or corrupt record starts.
+    */
+    static std::size_t Deserialize(
+        std::istream &in,
+        const std::function<void(const Record &)> &apply,
+        bool &complete,
+        std::uint64_t *valid_size = nullptr);
+
+private:
+    void open();
+
+    void close();
+
+    std::string path_;
+
+    std::size_t sync_every_;
+
+    std::size_t unsynced_ = 0;
+
+    int fd_ = -1;
+
+    std::mutex mutex_;
+}; // class UpdateLog
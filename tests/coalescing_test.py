@@ -0,0 +1,85 @@
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import pytest
+from apsi import (
+    LabeledClient,
+    LabeledServer,
+    QueryCoalescer,
+    UnlabeledClient,
+    UnlabeledServer,
+)
+
+
+class _CountingServer:
+    def __init__(self, server):
+        self.server = server
+        self.query_count = 0
+
+    def handle_oprf_request(self, oprf_request: bytes) -> bytes:
+        return self.server.handle_oprf_request(oprf_request)
+
+    def handle_query(self, query: bytes) -> bytes:
+        self.query_count += 1
+        return self.server.handle_query(query)
+
+
+def test_labeled_lookups_are_coalesced_into_one_query(apsi_params: str):
+    server = LabeledServer()
+    server.init_db(apsi_params, max_label_length=10)
+    server.add_items([("item", "1234567890"), ("abc", "123")])
+    counting_server = _CountingServer(server)
+
+    client = LabeledClient(apsi_params)
+    with QueryCoalescer(client, counting_server, max_delay=1.0, max_items=3) as co:
+        futures = [co.lookup(item) for item in ["item", "unknown", "abc"]]
+        results = [f.result(timeout=30) for f in futures]
+
+    assert results == [b"1234567890", None, b"123"]
+    assert counting_server.query_count == 1
+
+
+def test_unlabeled_lookups_from_many_threads(apsi_params: str):
+    server = UnlabeledServer()
+    server.init_db(apsi_params)
+    server.add_items(["item", "meti", "time"])
+
+    client = UnlabeledClient(apsi_params)
+    items = ["item", "meti", "unknown", "item", "time", "other"]
+    with QueryCoalescer(client, server, max_delay=0.01, max_items=4) as coalescer:
+        with ThreadPoolExecutor(max_workers=len(items)) as pool:
+            futures = list(pool.map(coalescer.lookup, items))
+        results = [f.result(timeout=30) for f in futures]
+
+    assert results == [True, True, False, True, True, False]
+
+
+def test_lookup_after_close_fails(apsi_params: str):
+    server = UnlabeledServer()
+    server.init_db(apsi_params)
+    coalescer = QueryCoalescer(UnlabeledClient(apsi_params), server)
+    coalescer.close()
+
+    with pytest.raises(RuntimeError):
+        coalescer.lookup("item")
+
+
+def test_cancelled_lookups_are_skipped(apsi_params: str):
+    server = UnlabeledServer()
+    server.init_db(apsi_params)
+    server.add_items(["item", "meti"])
+
+    client = UnlabeledClient(apsi_params)
+    with QueryCoalescer(client, server, max_delay=1.0, max_items=4) as coalescer:
+        found = coalescer.lookup("item")
+        cancelled = coalescer.lookup("unknown")
+        assert cancelled.cancel()
+        assert found.result(timeout=30)
+        assert cancelled.cancelled()
+
+
+    # A batch of only cancelled lookups does not stop the coalescer either
+    with QueryCoalescer(client, server, max_delay=0.01) as coalescer:
+        assert coalescer.lookup("other").cancel()
+        time.sleep(0.1)
+        assert coalescer.lookup("meti").result(timeout=30)
@@ -0,0 +1,61 @@
+import pathlib
+import threading
+
+import pytest
+from apsi import LabeledClient, LabeledServer
+from apsi.coordinator import ShardCoordinator, ShardWorker
+from apsi.sharding import build_shard, new_oprf_key
+
+
+@pytest.fixture
+def socket_paths(apsi_params: str, tmp_path: pathlib.Path):
+    csv_path = tmp_path / "db.csv"
+    csv_path.write_text("".join(f"item{i},{i:010d}\n" for i in range(30)))
+
+    key = new_oprf_key(apsi_params)
+    workers, paths = [], []
+    for shard_index in range(3):
+        db_path = str(tmp_path / f"shard-{shard_index}.db")
+        build_shard(str(csv_path), apsi_params, key, shard_index, 3, db_path)
+        server = LabeledServer()
+        server.load_db(db_path)
+
+        socket_path = str(tmp_path / f"shard-{shard_index}.sock")
+        worker = ShardWorker(server, socket_path)
+        threading.Thread(target=worker.serve_forever, daemon=True).start()
+        workers.append(worker)
+        paths.append(socket_path)
+
+    yield paths
+
+    for worker in workers:
+        worker.shutdown()
+        worker.server_close()
+
+
+def test_coordinator_answers_queries_from_all_shards(
+    apsi_params: str, socket_paths: list
+):
+    client = LabeledClient(apsi_params)
+    items = [f"item{i}" for i in range(0, 30, 4)] + ["unknown"]
+    with ShardCoordinator(socket_paths) as coordinator:
+        for _ in range(2):
+            oprf_response = coordinator.handle_oprf_request(client.oprf_request(items))
+            query = client.build_query(oprf_response)
+            assert client.extract_result(coordinator.handle_query(query)) == {
+                f"item{i}": f"{i:010d}".encode() for i in range(0, 30, 4)
+            }
+
+
+def test_coordinator_reports_worker_errors(apsi_params: str, socket_paths: list):
+    client = LabeledClient(apsi_params)
+    with ShardCoordinator(socket_paths) as coordinator:
+        oprf_response = coordinator.handle_oprf_request(client.oprf_request(["item1"]))
+        query = client.build_query(oprf_response)
+        with pytest.raises(RuntimeError):
+            coordinator.handle_query(query, params_index=1)
+
+        # The connections stay usable after a failed query
+        assert client.extract_result(coordinator.handle_query(query)) == {
+            "item1": b"0000000001"
+        }
@@ -1,9 +1,11 @@
 import json
 import pathlib
+from concurrent.futures import ThreadPoolExecutor
 from typing import Dict, List, Union
 
 import pytest
 from apsi import LabeledClient, LabeledServer, UnlabeledClient, UnlabeledServer
+from apsi.utils import get_thread_count, set_thread_count
 
 
 def _query(
@@ -47,6 +49,56 @@ def test_labeled_client_server_integration_with_shorter_labels(apsi_params: str)
     assert result == {"long_item": "1234567890", "short_item": "321"}
 
 
+def _two_phase_query(
+    client: LabeledClient, server: LabeledServer, items: List[str]
+) -> Dict[str, str]:
+    oprf_request = client.oprf_request(items)
+    oprf_response = server.handle_oprf_request(oprf_request)
+    query = client.build_query(oprf_response)
+    membership_response = server.handle_membership_query(query)
+    matches = client.extract_matches(membership_response)
+    if not matches:
+        return {}
+    labeled_query = client.build_labeled_query(matches)
+    response = server.handle_query(labeled_query)
+    return client.extract_result(response)
+
+
+def test_two_phase_labeled_query(apsi_params: str):
+    server = LabeledServer()
+    server.init_db(apsi_params, max_label_length=10, membership_db=True)
+    server.add_item("item", "1234567890")
+    server.add_items([("meti", "0987654321"), ("time", "1010101010")])
+
+    client = LabeledClient(apsi_params)
+
+    assert _two_phase_query(client, server, ["unknown", "meti", "other", "item"]) == {
+        "item": b"1234567890",
+        "meti": b"0987654321",
+    }
+    assert _two_phase_query(client, server, ["unknown"]) == {}
+
+
+def test_save_and_load_db_with_membership_db(apsi_params: str, tmp_path: pathlib.Path):
+    db_file_path = str(tmp_path / "apsi.db")
+
+    orig_server = LabeledServer()
+    orig_server.init_db(apsi_params, max_label_length=10, membership_db=True)
+    orig_server.add_item("item", "1234567890")
+    orig_server.save_db(db_file_path)
+
+    new_server = LabeledServer()
+    new_server.load_db(db_file_path)
+    assert new_server.has_membership_db
+    assert new_server.max_label_length == 10
+
+    client = LabeledClient(apsi_params)
+
+    assert _two_phase_query(client, new_server, ["item", "unknown"]) == {
+        "item": b"1234567890"
+    }
+
+
 def test_adding_too_long_label_to_labeled_server_raises_error(apsi_params: str):
     server = LabeledServer()
     server.init_db(apsi_params, max_label_length=4)
@@ -89,6 +141,549 @@ def test_save_and_load_db(apsi_params: str, tmp_path: pathlib.Path):
     assert _query(client, new_server, ["item", "unknown"]) == ["item"]
 
 
+def test_save_db_async(apsi_params: str, tmp_path: pathlib.Path):
+    db_file_path = str(tmp_path / "apsi.db")
+
+    orig_server = UnlabeledServer()
+    orig_server.init_db(apsi_params)
+    orig_server.add_item("item")
+
+    # Write the snapshot over about a second
+    orig_server.save_db(str(tmp_path / "sync.db"))
+    db_size = (tmp_path / "sync.db").stat().st_size
+
+    client = UnlabeledClient(apsi_params)
+    future = orig_server.save_db_async(db_file_path, max_bytes_per_second=db_size)
+    # Changes wait for the snapshot to be written, queries do not
+    with ThreadPoolExecutor(max_workers=1) as executor:
+        added = executor.submit(orig_server.add_item, "time")
+        assert "item" in _query(client, orig_server, ["item"])
+        future.result(timeout=60)
+        added.result(timeout=60)
+    assert not orig_server.saving
+    assert _query(client, orig_server, ["item", "time"]) == ["item", "time"]
+
+    new_server = UnlabeledServer()
+    new_server.load_db(db_file_path)
+    assert _query(client, new_server, ["item", "time"]) == ["item"]
+
+
+def test_remove_items(apsi_params: str):
+    server = UnlabeledServer()
+    server.init_db(apsi_params)
+    server.add_items(["item", "meti", "time"])
+    server.remove_items(["meti", "unknown"])
+
+    client = UnlabeledClient(apsi_params)
+
+    assert _query(client, server, ["item", "meti", "time"]) == ["item", "time"]
+
+
+def test_repeated_updates_of_an_item_in_one_batch(
+    apsi_params: str, tmp_path: pathlib.Path
+):
+    db_file_path = str(tmp_path / "apsi.db")
+    log_file_path = str(tmp_path / "apsi.log")
+
+    server = LabeledServer()
+    server.init_db(apsi_params, max_label_length=10)
+    server.add_items([("item", "1234567890"), ("meti", "0987654321")])
+    server.save_db(db_file_path)
+
+    server.open_update_log(log_file_path)
+    server.remove_items(["item", "item"])
+    server.add_items([("time", "1"), ("time", "2"), ("emit", "3")])
+    server.remove_item("emit")
+    server.close_update_log()
+
+    client = LabeledClient(apsi_params)
+    expected = {"meti": b"0987654321", "time": b"2"}
+    items = ["item", "meti", "time", "emit"]
+    assert _query(client, server, items) == expected
+
+    # A replay applies all of these updates in a single batch
+    new_server = LabeledServer()
+    assert new_server.recover_db(db_file_path, log_file_path) == 6
+    assert _query(client, new_server, items) == expected
+
+
+def test_recover_db_from_update_log(apsi_params: str, tmp_path: pathlib.Path):
+    db_file_path = str(tmp_path / "apsi.db")
+    log_file_path = str(tmp_path / "apsi.log")
+
+    orig_server = LabeledServer()
+    orig_server.init_db(apsi_params, max_label_length=10)
+    orig_server.add_item("item", "1234567890")
+    orig_server.save_db(db_file_path)
+
+    orig_server.open_update_log(log_file_path, sync_every=1)
+    orig_server.add_items([("meti", "0987654321"), ("time", "1010101010")])
+    orig_server.remove_item("item")
+    orig_server.close_update_log()
+
+    new_server = LabeledServer()
+    assert new_server.recover_db(db_file_path, log_file_path) == 3
+
+    client = LabeledClient(apsi_params)
+
+    assert _query(client, new_server, ["item", "meti", "time"]) == {
+        "meti": b"0987654321",
+        "time": b"1010101010",
+    }
+
+
+def test_rejected_update_leaves_update_log_replayable(
+    apsi_params: str, tmp_path: pathlib.Path
+):
+    db_file_path = str(tmp_path / "apsi.db")
+    log_file_path = str(tmp_path / "apsi.log")
+
+    source = LabeledServer()
+    source.init_db(apsi_params, max_label_length=10)
+    source.start_change_tracking()
+    source.add_item("meti", "0987654321")
+    source.add_item("time", "1010101010")
+
+    server = LabeledServer()
+    server.init_db(apsi_params, max_label_length=4)
+    server.save_db(db_file_path)
+    server.open_update_log(log_file_path, sync_every=1)
+    server.add_item("item", "1234")
+    # The labels of the delta do not fit the replica
+    with pytest.raises(ValueError):
+        server.apply_delta(source.export_delta(0))
+    server.close_update_log()
+
+    new_server = LabeledServer()
+    assert new_server.recover_db(db_file_path, log_file_path) == 1
+    assert _query(LabeledClient(apsi_params), new_server, ["item", "meti"]) == {
+        "item": b"1234"
+    }
+
+
+def test_recover_db_ignores_torn_log_tail(apsi_params: str, tmp_path: pathlib.Path):
+    db_file_path = str(tmp_path / "apsi.db")
+    log_file_path = tmp_path / "apsi.log"
+
+    orig_server = UnlabeledServer()
+    orig_server.init_db(apsi_params)
+    orig_server.save_db(db_file_path)
+    orig_server.open_update_log(str(log_file_path))
+    orig_server.add_item("item")
+    orig_server.add_item("meti")
+    orig_server.close_update_log()
+
+    with open(log_file_path, "r+b") as f:
+        f.truncate(log_file_path.stat().st_size - 1)
+
+    new_server = UnlabeledServer()
+    assert new_server.recover_db(db_file_path, str(log_file_path)) == 1
+
+    client = UnlabeledClient(apsi_params)
+
+    assert _query(client, new_server, ["item", "meti"]) == ["item"]
+
+    # Updates logged after the recovery are not hidden behind the torn record
+    new_server.open_update_log(str(log_file_path))
+    new_server.add_item("time")
+    new_server.close_update_log()
+
+    recovered_server = UnlabeledServer()
+    assert recovered_server.recover_db(db_file_path, str(log_file_path)) == 2
+    assert _query(client, recovered_server, ["item", "meti", "time"]) == [
+        "item",
+        "time",
+    ]
+
+
+def test_compaction(apsi_params: str, tmp_path: pathlib.Path):
+    db_file_path = str(tmp_path / "apsi.db")
+    log_file_path = str(tmp_path / "apsi.log")
+
+    orig_server = UnlabeledServer()
+    orig_server.init_db(apsi_params)
+    orig_server.open_update_log(log_file_path)
+    orig_server.add_item("item")
+    orig_server.compact(db_file_path)
+    orig_server.add_item("meti")
+    orig_server.wait_for_compaction()
+    orig_server.close_update_log()
+
+    assert not orig_server.compacting
+    assert not (tmp_path / "apsi.log.compacting").exists()
+
+    new_server = UnlabeledServer()
+    new_server.recover_db(db_file_path, log_file_path)
+
+    client = UnlabeledClient(apsi_params)
+
+    assert _query(client, new_server, ["item", "meti", "time"]) == ["item", "meti"]
+
+
+def test_delta_replication(apsi_params: str, tmp_path: pathlib.Path):
+    db_file_path = str(tmp_path / "apsi.db")
+
+    builder = LabeledServer()
+    builder.init_db(apsi_params, max_label_length=10)
+    builder.add_item("item", "1234567890")
+    builder.save_db(db_file_path)
+    builder.start_change_tracking()
+
+    replica = LabeledServer()
+    replica.load_db(db_file_path)
+    assert replica.db_version == builder.db_version
+
+    snapshot_version = builder.db_version
+    builder.add_item("meti", "0987654321")
+    builder.add_items([("time", "1010101010"), ("meti", "1111111111")])
+    builder.remove_item("item")
+
+    assert replica.apply_delta(builder.export_delta(snapshot_version))
+    assert replica.db_version == builder.db_version
+    assert not replica.apply_delta(builder.export_delta(snapshot_version))
+
+    client = LabeledClient(apsi_params)
+
+    assert _query(client, replica, ["item", "meti", "time"]) == {
+        "meti": b"1111111111",
+        "time": b"1010101010",
+    }
+
+
+def test_apply_delta_with_missing_changes_fails(apsi_params: str):
+    builder = UnlabeledServer()
+    builder.init_db(apsi_params)
+    builder.start_change_tracking()
+    builder.add_item("item")
+    version = builder.db_version
+    builder.add_item("meti")
+
+    replica = UnlabeledServer()
+    replica.init_db(apsi_params)
+
+    with pytest.raises(RuntimeError):
+        replica.apply_delta(builder.export_delta(version))
+
+    builder.discard_changes(version)
+    with pytest.raises(IndexError):
+        builder.export_delta(0)
+
+
+def test_write_buffer(apsi_params: str, tmp_path: pathlib.Path):
+    server = LabeledServer()
+    server.init_db(apsi_params, max_label_length=10)
+    server.add_items([("item", "1234567890"), ("meti", "0987654321")])
+    server.set_write_buffer_size(4)
+
+    server.add_items([("new1", "1111111111"), ("item", "2222222222")])
+    assert server.buffered_item_count == 1
+    server.add_items([("new2", "3333333333"), ("new1", "4444444444")])
+    server.remove_items(["new2", "meti"])
+    assert server.buffered_item_count == 1
+
+    client = LabeledClient(apsi_params)
+    expected = {"item": b"2222222222", "new1": b"4444444444"}
+    assert _query(client, server, ["item", "meti", "new1", "new2"]) == expected
+
+    server.add_items([(f"new{i}", f"{i:010d}") for i in range(3, 6)])
+    assert server.buffered_item_count == 0
+    expected.update({f"new{i}": f"{i:010d}".encode() for i in range(3, 6)})
+    assert _query(client, server, list(expected)) == expected
+
+    server.add_item("new6", "6666666666")
+    db_path = str(tmp_path / "apsi.db")
+    server.save_db(db_path)
+    assert server.buffered_item_count == 0
+    loaded = LabeledServer()
+    loaded.load_db(db_path)
+    assert _query(client, loaded, ["new6"]) == {"new6": b"6666666666"}
+
+
+def test_queries_during_buffered_inserts(apsi_params: str):
+    server = LabeledServer()
+    server.init_db(apsi_params, max_label_length=10)
+    server.add_items([(f"item{i}", f"{i:010d}") for i in range(10)])
+    server.set_write_buffer_size(16)
+
+    def query() -> Dict[str, str]:
+        return _query(LabeledClient(apsi_params), server, ["item0", "item9"])
+
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        futures = [executor.submit(query) for _ in range(8)]
+        for i in range(10, 50):
+            server.add_item(f"item{i}", f"{i:010d}")
+        results = [f.result() for f in futures]
+
+    assert all(r == {"item0": b"0000000000", "item9": b"0000000009"} for r in results)
+    assert _query(LabeledClient(apsi_params), server, ["item49"]) == {
+        "item49": b"0000000049"
+    }
+
+
+def test_concurrent_queries_and_updates(apsi_params: str, tmp_path: pathlib.Path):
+    server = LabeledServer()
+    server.init_db(apsi_params, max_label_length=10)
+    server.add_items([(f"item{i}", f"{i:010d}") for i in range(10)])
+
+    def query() -> Dict[str, str]:
+        return _query(LabeledClient(apsi_params), server, ["item0", "item9"])
+
+    def update(thread: int) -> None:
+        for i in range(100 + 10 * thread, 110 + 10 * thread):
+            server.add_item(f"item{i}", f"{i:010d}")
+            server.remove_items([f"item{i}"])
+
+    def inspect(thread: int) -> None:
+        for _ in range(5):
+            server.packing_rate
+            server.save_db(str(tmp_path / f"db{thread}"))
+
+    with ThreadPoolExecutor(max_workers=8) as executor:
+        queries = [executor.submit(query) for _ in range(8)]
+        others = [executor.submit(update, t) for t in range(4)]
+        others += [executor.submit(inspect, t) for t in range(2)]
+        results = [f.result() for f in queries]
+        for f in others:
+            f.result()
+
+    assert all(r == {"item0": b"0000000000", "item9": b"0000000009"} for r in results)
+    assert _query(LabeledClient(apsi_params), server, ["item100", "item9"]) == {
+        "item9": b"0000000009"
+    }
+
+
+def test_query_with_parallel_oprf(apsi_params: str):
+    items = [f"item{i}" for i in range(300)]
+    server = UnlabeledServer()
+    server.init_db(apsi_params)
+    server.add_items(items[::2])
+
+    thread_count = get_thread_count()
+    set_thread_count(4)
+    try:
+        client = UnlabeledClient(apsi_params)
+        assert _query(client, server, items) == items[::2]
+    finally:
+        set_thread_count(thread_count)
+
+
+def test_oprf_key_rotation(apsi_params: str):
+    server = LabeledServer()
+    server.init_db(apsi_params, max_label_length=10, retain_items=True)
+    server.add_item("item", "1234567890")
+    old_version = server.oprf_key_version
+
+    client = LabeledClient(apsi_params)
+    oprf_response = server.handle_oprf_request(client.oprf_request(["item", "meti"]))
+
+    server.rotate_oprf_key()
+    server.add_item("meti", "0987654321")
+    server.finish_key_rotation()
+
+    assert server.oprf_key_version != old_version
+    assert server.retired_oprf_key_version == old_version
+
+    # A query whose OPRF step used the old key is still answered during the window
+    query = client.build_query(oprf_response)
+    response = server.handle_query(query, key_version=old_version)
+    assert client.extract_result(response) == {
+        "item": b"1234567890",
+        "meti": b"0987654321",
+    }
+
+    assert _query(client, server, ["item", "meti"]) == {
+        "item": b"1234567890",
+        "meti": b"0987654321",
+    }
+
+    server.retire_oprf_key()
+    assert server.retired_oprf_key_version is None
+    with pytest.raises(ValueError):
+        server.handle_oprf_request(client.oprf_request(["item"]), old_version)
+
+
+def test_oprf_key_rotation_requires_item_store(apsi_params: str):
+    server = UnlabeledServer()
+    server.init_db(apsi_params)
+
+    with pytest.raises(RuntimeError):
+        server.rotate_oprf_key()
+
+
+def test_repack_after_removals(apsi_params: str):
+    server = UnlabeledServer()
+    server.init_db(apsi_params, retain_items=True)
+    server.add_items([f"item{i}" for i in range(20000)])
+    server.remove_items([f"item{i}" for i in range(20000) if i % 20])
+
+    stats = server.bundle_stats
+    bundle_count = sum(s["bundle_count"] for s in stats)
+    assert sum(s["min_bundle_count"] for s in stats) < bundle_count
+    assert sum(s["entry_count"] for s in stats) >= 1000
+    packing_rate = server.packing_rate
+
+    server.repack()
+    assert server.repacking
+    server.add_item("item20000")
+    server.remove_item("item0")
+    server.finish_repack()
+    assert not server.repacking
+
+    assert sum(s["bundle_count"] for s in server.bundle_stats) < bundle_count
+    assert server.packing_rate > packing_rate
+
+    client = UnlabeledClient(apsi_params)
+    items = ["item0", "item20", "item21", "item20000"]
+    assert _query(client, server, items) == ["item20", "item20000"]
+
+
+@pytest.mark.parametrize("mask_mode", ["repeat", "aes_ctr"])
+def test_uid_labels(apsi_params: str, tmp_path: pathlib.Path, mask_mode: str):
+    labels = {"item": "a" * 100, "meti": "short", "time": "0123456789abcdefg"}
+    db_file = tmp_path / "db.csv"
+    db_file.write_text("".join(f"{item},{label}\n" for item, label in labels.items()))
+
+    server = LabeledServer()
+    server.load_csv_uid_db(str(db_file), apsi_params, mask_mode=mask_mode)
+    assert server.uid_mask_mode == mask_mode
+
+    client = LabeledClient(apsi_params)
+    uids = _query(client, server, ["item", "time", "unknown"])
+    table = server.uid_xored_label_table
+    masked = [bytes(table[int.from_bytes(uids[i], "big") - 1][1]) for i in uids]
+    assert masked[0] != labels["item"].encode()
+
+    unmasked = client.unmask_uid_labels(list(uids), masked, mask_mode)
+    assert unmasked == [labels[item].encode() for item in uids]
+
+    # The mask mode is saved with the database
+    server.save_db(str(tmp_path / "apsi.db"))
+    restored = LabeledServer()
+    restored.load_db(str(tmp_path / "apsi.db"))
+    assert restored.uid_mask_mode == mask_mode
+
+
+def test_append_uid_items(apsi_params: str, tmp_path: pathlib.Path):
+    db_file = tmp_path / "db.csv"
+    db_file.write_text("".join(f"item{i},label{i}\n" for i in range(254)))
+
+    server = LabeledServer()
+    server.load_csv_uid_db(str(db_file), apsi_params, retain_items=True)
+    client = LabeledClient(apsi_params)
+
+    def lookup(items: List[str]) -> List[bytes]:
+        uids = _query(client, server, items)
+        table = server.uid_xored_label_table
+        masked = [bytes(table[int.from_bytes(uids[i], "big") - 1][1]) for i in uids]
+        return client.unmask_uid_labels(list(uids), masked)
+
+    # UID 255 still fits into one byte, UID 256 needs another one
+    server.append_uid_items([("new0", "first")])
+    assert server._db_label_byte_count == 1
+    server.append_uid_items([("new1", "second")])
+    assert server._db_label_byte_count == 2
+    assert len(server.uid_xored_label_table) == 256
+
+    assert lookup(["item0", "new0", "new1"]) == [b"label0", b"first", b"second"]
+
+    server = LabeledServer()
+    server.load_csv_uid_db(str(db_file), apsi_params)
+    server.append_uid_items([("new0", "first")])
+    with pytest.raises(RuntimeError):
+        server.append_uid_items([("new1", "second")])
+
+    # UID rows cannot be replayed, so appends are rejected while updates are logged
+    server.open_update_log(str(tmp_path / "updates.log"))
+    with pytest.raises(RuntimeError):
+        server.append_uid_items([("new1", "second")])
+    server.close_update_log()
+    server.start_change_tracking()
+    with pytest.raises(RuntimeError):
+        server.append_uid_items([("new1", "second")])
+    assert len(server.uid_xored_label_table) == 255
+
+
+def test_uid_labels_during_key_rotation(apsi_params: str, tmp_path: pathlib.Path):
+    db_file = tmp_path / "db.csv"
+    db_file.write_text("item,first\nmeti,second\n")
+
+    server = LabeledServer()
+    server.load_csv_uid_db(str(db_file), apsi_params, retain_items=True)
+    old_version = server.oprf_key_version
+    client = LabeledClient(apsi_params)
+    oprf_response = server.handle_oprf_request(client.oprf_request(["item", "time"]))
+
+    # The rotation replaces the UID table with the copy it started from
+    server.rotate_oprf_key()
+    with pytest.raises(RuntimeError):
+        server.append_uid_items([("time", "third")])
+    server.finish_key_rotation()
+    server.append_uid_items([("time", "third")])
+
+    # A query whose OPRF step used the old key needs the table masked for it
+    query = client.build_query(oprf_response)
+    uids = client.extract_result(server.handle_query(query, key_version=old_version))
+    table = server.get_uid_xored_label_table(old_version)
+    masked = [bytes(table[int.from_bytes(uids[i], "big") - 1][1]) for i in uids]
+    assert client.unmask_uid_labels(list(uids), masked) == [b"first", b"third"]
+
+    uids = _query(client, server, ["item", "time"])
+    table = server.uid_xored_label_table
+    masked = [bytes(table[int.from_bytes(uids[i], "big") - 1][1]) for i in uids]
+    assert client.unmask_uid_labels(list(uids), masked) == [b"first", b"third"]
+
+    server.retire_oprf_key()
+    with pytest.raises(ValueError):
+        server.get_uid_xored_label_table(old_version)
+
+
+def test_load_csv_db_from_multiple_files(apsi_params: str, tmp_path: pathlib.Path):
+    (tmp_path / "part-0.csv").write_text("item,1234567890\nmeti,0987654321\n")
+    (tmp_path / "part-1.csv").write_text("time,1010101010\n")
+
+    client = LabeledClient(apsi_params)
+    expected = {"item": b"1234567890", "time": b"1010101010"}
+
+    server = LabeledServer()
+    server.load_csv_db(str(tmp_path / "part-*.csv"), apsi_params)
+    assert _query(client, server, ["item", "time", "unknown"]) == expected
+
+    server = LabeledServer()
+    server.load_csv_db(
+        [str(tmp_path / "part-0.csv"), str(tmp_path / "part-1.csv")], apsi_params
+    )
+    assert _query(client, server, ["item", "time", "unknown"]) == expected
+
+    with pytest.raises(FileNotFoundError):
+        server.load_csv_db(str(tmp_path / "missing-*.csv"), apsi_params)
+
+
+def test_dictionary_encoded_labels(apsi_params: str, tmp_path: pathlib.Path):
+    categories = ["bronze-customer", "silver-customer", "gold-customer"]
+    csv_path = tmp_path / "db.csv"
+    csv_path.write_text(
+        "".join(f"item{i},{categories[i % 3]}\n" for i in range(30)),
+    )
+
+    server = LabeledServer()
+    server.load_csv_db(str(csv_path), apsi_params, dictionary_labels=True)
+    assert server.max_label_length == 1
+    assert sorted(server.label_dictionary) == sorted(c.encode() for c in categories)
+
+    server.add_item("item30", "platinum-customer")
+    db_path = str(tmp_path / "apsi.db")
+    server.save_db(db_path)
+    server = LabeledServer()
+    server.load_db(db_path)
+
+    client = LabeledClient(apsi_params, label_dictionary=server.label_dictionary)
+    assert _query(client, server, ["item1", "item5", "item30", "unknown"]) == {
+        "item1": b"silver-customer",
+        "item5": b"gold-customer",
+        "item30": b"platinum-customer",
+    }
+
+
 def test_load_non_existent_db_fails():
     server = UnlabeledServer()
 
@@ -0,0 +1,94 @@
+import json
+
+import pytest
+from apsi import LabeledClient, LabeledServer
+from apsi.planning import MultiParamsClient, QueryPlanner
+
+
+@pytest.fixture
+def large_apsi_params(apsi_params: str) -> str:
+    params = json.loads(apsi_params)
+    params["table_params"]["table_size"] = 2048
+    return json.dumps(params)
+
+
+def test_planner_selects_cheapest_params_that_fit(
+    apsi_params: str, large_apsi_params: str
+):
+    planner = QueryPlanner([large_apsi_params, apsi_params], db_item_count=10000)
+
+    # A cuckoo table with 3 hash functions reliably holds 85% of its size
+    assert planner.capacity(1) == 435
+    assert planner.select(1) == 1
+    assert planner.select(435) == 1
+    assert planner.select(436) == 0
+    with pytest.raises(ValueError):
+        planner.select(2048)
+
+
+def test_client_rejects_queries_beyond_capacity(apsi_params: str):
+    client = LabeledClient(apsi_params)
+    assert client.max_query_items == 435
+    with pytest.raises(ValueError):
+        client.oprf_request([f"item{i}" for i in range(436)])
+
+
+def test_multi_params_query_against_server_with_added_params(
+    apsi_params: str, large_apsi_params: str
+):
+    server = LabeledServer()
+    server.init_db(apsi_params, max_label_length=10, retain_items=True)
+    server.add_items([("item", "1234567890"), ("meti", "0987654321")])
+    assert server.add_params(large_apsi_params) == 1
+    server.add_item("time", "1010101010")
+
+    client = MultiParamsClient([apsi_params, large_apsi_params])
+
+    def query(items):
+        oprf_request = client.oprf_request(items)
+        oprf_response = server.handle_oprf_request(oprf_request)
+        query = client.build_query(oprf_response)
+        response = server.handle_query(query, client.params_index)
+        return client.extract_result(response)
+
+    assert query(["item", "unknown"]) == {"item": b"1234567890"}
+    assert client.params_index == 0
+
+    items = ["meti", "time"] + [f"unknown{i}" for i in range(600)]
+    assert query(items) == {"meti": b"0987654321", "time": b"1010101010"}
+    assert client.params_index == 1
+
+
+def test_adding_params_to_non_empty_db_requires_item_store(
+    apsi_params: str, large_apsi_params: str
+):
+    server = LabeledServer()
+    server.init_db(apsi_params, max_label_length=10)
+    server.add_item("item", "1234567890")
+
+    with pytest.raises(RuntimeError):
+        server.add_params(large_apsi_params)
+
+
+def test_reparameterize(apsi_params: str, large_apsi_params: str):
+    server = LabeledServer()
+    server.init_db(
+        apsi_params, max_label_length=10, membership_db=True, retain_items=True
+    )
+    server.add_items([("item", "1234567890"), ("meti", "0987654321")])
+    server.reparameterize(large_apsi_params)
+
+    client = LabeledClient(large_apsi_params)
+    oprf_response = server.handle_oprf_request(client.oprf_request(["item", "time"]))
+    query = client.build_query(oprf_response)
+    assert client.extract_matches(server.handle_membership_query(query)) == ["item"]
+    response = server.handle_query(client.build_labeled_query(["item"]))
+    assert client.extract_result(response) == {"item": b"1234567890"}
+
+
+def test_reparameterize_requires_item_store(apsi_params: str, large_apsi_params: str):
+    server = LabeledServer()
+    server.init_db(apsi_params, max_label_length=10)
+
+    with pytest.raises(RuntimeError):
+        server.reparameterize(large_apsi_params)
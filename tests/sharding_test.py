@@ -0,0 +1,118 @@
+import pathlib
+
+import pytest
+from apsi import LabeledClient, LabeledServer
+from apsi.sharding import (
+    build_shard,
+    merge_shards,
+    new_oprf_key,
+    read_manifest,
+    write_manifest,
+)
+
+
+@pytest.fixture
+def shard_paths(apsi_params: str, tmp_path: pathlib.Path) -> list:
+    csv_path = tmp_path / "db.csv"
+    csv_path.write_text(
+        "".join(f"item{i},{i:010d}\n" for i in range(30)),
+    )
+
+    key = new_oprf_key(apsi_params)
+    paths = []
+    for shard_index in range(3):
+        path = str(tmp_path / f"shard-{shard_index}.db")
+        build_shard(str(csv_path), apsi_params, key, shard_index, 3, path)
+        paths.append(path)
+    return paths
+
+
+def _query(client: LabeledClient, server: LabeledServer, items: list) -> dict:
+    oprf_response = server.handle_oprf_request(client.oprf_request(items))
+    query = client.build_query(oprf_response)
+    return client.extract_result(server.handle_query(query))
+
+
+def test_merged_shards_answer_queries(
+    apsi_params: str, shard_paths: list, tmp_path: pathlib.Path
+):
+    db_path = str(tmp_path / "apsi.db")
+    merge_shards(shard_paths, db_path)
+
+    server = LabeledServer()
+    server.load_db(db_path)
+    assert server.shard_count == 3
+
+    client = LabeledClient(apsi_params)
+    items = [f"item{i}" for i in range(0, 30, 7)] + ["unknown"]
+    assert _query(client, server, items) == {
+        f"item{i}": f"{i:010d}".encode() for i in range(0, 30, 7)
+    }
+
+
+def test_shards_served_from_manifest(
+    apsi_params: str, shard_paths: list, tmp_path: pathlib.Path
+):
+    manifest_path = str(tmp_path / "manifest.json")
+    write_manifest(manifest_path, shard_paths)
+
+    server = LabeledServer()
+    server.load_db_shards(read_manifest(manifest_path))
+
+    client = LabeledClient(apsi_params)
+    assert _query(client, server, ["item3", "item29"]) == {
+        "item3": b"0000000003",
+        "item29": b"0000000029",
+    }
+
+    with pytest.raises(RuntimeError):
+        server.add_item("item30", "0000000030")
+
+
+def test_merging_shards_with_different_keys_fails(
+    apsi_params: str, tmp_path: pathlib.Path
+):
+    csv_path = tmp_path / "db.csv"
+    csv_path.write_text("item,1234567890\nmeti,0987654321\n")
+    paths = [str(tmp_path / "shard-0.db"), str(tmp_path / "shard-1.db")]
+    build_shard(str(csv_path), apsi_params, new_oprf_key(apsi_params), 0, 1, paths[0])
+    build_shard(str(csv_path), apsi_params, new_oprf_key(apsi_params), 0, 1, paths[1])
+
+    with pytest.raises(ValueError):
+        merge_shards(paths, str(tmp_path / "apsi.db"))
+
+
+def test_merging_shards_with_different_label_lengths_fails(
+    apsi_params: str, tmp_path: pathlib.Path
+):
+    (tmp_path / "part-0.csv").write_text("item,1234567890\n")
+    (tmp_path / "part-1.csv").write_text("meti,1234\n")
+    key = new_oprf_key(apsi_params)
+    paths = [str(tmp_path / "shard-0.db"), str(tmp_path / "shard-1.db")]
+    for part, path in enumerate(paths):
+        build_shard(str(tmp_path / f"part-{part}.csv"), apsi_params, key, 0, 1, path)
+
+    with pytest.raises(ValueError):
+        merge_shards(paths, str(tmp_path / "apsi.db"))
+
+    # Builders that only see part of the input agree on a maximum label length
+    for part, path in enumerate(paths):
+        build_shard(
+            str(tmp_path / f"part-{part}.csv"),
+            apsi_params,
+            key,
+            0,
+            1,
+            path,
+            max_label_length=10,
+        )
+    db_path = str(tmp_path / "apsi.db")
+    merge_shards(paths, db_path)
+
+    server = LabeledServer()
+    server.load_db(db_path)
+    client = LabeledClient(apsi_params)
+    assert _query(client, server, ["item", "meti"]) == {
+        "item": b"1234567890",
+        "meti": b"1234",
+    }
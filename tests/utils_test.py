@@ -3,17 +3,33 @@ import pathlib
 from contextlib import redirect_stdout
 
 import pytest
-from apsi.servers import UnlabeledServer
+from apsi.clients import UnlabeledClient
+from apsi.servers import LabeledServer, UnlabeledServer
 from apsi.utils import (
+    ThreadPoolSampler,
     disable_console_log,
     enable_console_log,
+    get_memory_usage,
+    get_op_stats,
     get_thread_count,
+    get_thread_tuning,
+    is_thread_auto_tune,
+    reset_op_stats,
     set_log_file,
     set_log_level,
+    set_thread_auto_tune,
     set_thread_count,
+    track_build_memory,
 )
 
 
+@pytest.fixture
+def restore_thread_count():
+    thread_count = get_thread_count()
+    yield
+    set_thread_count(thread_count)
+
+
 def _something_that_logs(apsi_params: str) -> str:
     server = UnlabeledServer()
     server.init_db(apsi_params)
@@ -62,3 +78,89 @@ def test_enabled_console_log_output(apsi_params: str):
         expected_message = _something_that_logs(apsi_params)
 
     assert expected_message in f.getvalue()
+
+
+def test_op_stats(apsi_params: str):
+    reset_op_stats()
+    sampler = ThreadPoolSampler()
+
+    server = UnlabeledServer()
+    server.init_db(apsi_params)
+    server.add_items(["item"])
+    client = UnlabeledClient(apsi_params)
+    oprf_request = client.oprf_request(["item"])
+    query = client.build_query(server.handle_oprf_request(oprf_request))
+    assert client.extract_result(server.handle_query(query)) == ["item"]
+
+    stats = get_op_stats()
+    assert stats["oprf"]["calls"] == 2
+    assert stats["query"]["calls"] == 2
+    assert stats["db_build"]["calls"] == 1
+    assert stats["decrypt"]["calls"] == 1
+    assert all(op["waiting"] == 0 and op["running"] == 0 for op in stats.values())
+
+    sample = sampler.sample()
+    assert sample["thread_count"] == get_thread_count()
+    assert sample["busy_threads"] >= 0
+    assert sample["ops"]["query"]["calls"] == 2
+    assert sample["ops"]["query"]["run_seconds"] > 0
+
+
+def test_thread_budget(apsi_params: str, restore_thread_count: None):
+    set_thread_count(3)
+    server = UnlabeledServer()
+    server.init_db(apsi_params)
+    server.add_items(["item"])
+    client = UnlabeledClient(apsi_params)
+
+    for thread_count in [1, 2]:
+        oprf_response = server.handle_oprf_request(
+            client.oprf_request(["item"]), thread_count=thread_count
+        )
+        response = server.handle_query(client.build_query(oprf_response))
+        assert client.extract_result(response, thread_count=thread_count) == ["item"]
+    assert get_thread_count() == 3
+
+    with pytest.raises(ValueError):
+        server.handle_oprf_request(client.oprf_request(["item"]), thread_count=0)
+
+
+def test_thread_auto_tune(apsi_params: str, restore_thread_count: None):
+    set_thread_count(3)
+    server = UnlabeledServer()
+    server.init_db(apsi_params)
+    server.add_items(["item"])
+    client = UnlabeledClient(apsi_params)
+
+    set_thread_auto_tune(max_thread_count=2)
+    try:
+        assert is_thread_auto_tune()
+        assert get_thread_tuning()["oprf"] == {"thread_count": 1, "tuned": False}
+        for _ in range(6):
+            oprf_response = server.handle_oprf_request(client.oprf_request(["item"]))
+            response = server.handle_query(client.build_query(oprf_response))
+            assert client.extract_result(response) == ["item"]
+    finally:
+        set_thread_auto_tune(False)
+
+    tuning = get_thread_tuning()
+    for op in ["oprf", "decrypt"]:
+        assert tuning[op]["tuned"]
+        assert tuning[op]["thread_count"] in [1, 2]
+    assert not tuning["query"]["tuned"]
+    assert not tuning["db_build"]["tuned"]
+    assert get_thread_count() == 3
+
+
+def test_track_build_memory(apsi_params: str, tmp_path: pathlib.Path):
+    db_file = tmp_path / "db.csv"
+    db_file.write_text("".join(f"item{i},label{i}\n" for i in range(100)))
+
+    server = LabeledServer()
+    with track_build_memory() as stages:
+        server.load_csv_db(str(db_file), apsi_params, retain_items=True)
+
+    assert [stage["stage"] for stage in stages] == ["parse", "encode", "item_store"]
+    assert all(stage["items"] == 100 for stage in stages)
+    assert all(stage["seconds"] >= 0 for stage in stages)
+    assert set(stages[0]["after"]) == set(get_memory_usage())